@@ -7,52 +7,87 @@
 #include "../mem/pmm.h"
 #include "../mem/vmm.h"
 #include "../task/sync/spinlock.h"
+#include "../task/timer.h"
+#include "../drivers/time/clockevent.h"
+#include "../mem/tlb.h"
+#include "../mem/paging.h"
 #include <stddef.h>
 #include <stdint.h>
 
 static uint32_t lapic_base = 0;
 
-static uint32_t lapic_read(uint32_t offset) {
-    uint32_t* reg;
-    reg = (uint32_t*) (lapic_base + offset);
+extern void apic_timer_irq();
+extern void apic_spurious_irq();
+extern void apic_ipi_irq();
+
+uint32_t lapic_read(uint32_t offset) {
+    volatile uint32_t* reg;
+    reg = (volatile uint32_t*) (lapic_base + offset);
     return *reg;
 }
 
-static void lapic_write(uint32_t offset, uint32_t value) {
-    uint32_t* reg;
-    reg = (uint32_t*) (lapic_base + offset);
+void lapic_write(uint32_t offset, uint32_t value) {
+    volatile uint32_t* reg;
+    reg = (volatile uint32_t*) (lapic_base + offset);
     *reg = value;
 }
 
+static inline int apic_this_cpu(void) {
+    int cpu = tlb_this_cpu();
+    return cpu >= 0 && cpu < CONFIG_MAX_CPUS ? cpu : 0;
+}
+
+// cpuid leaf 1, edx bit 9
+static bool apic_present(void) {
+    uint32_t eax = 1, ebx, ecx = 0, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "+c"(ecx), "=d"(edx));
+    return (edx & CPUID_EDX_APIC) != 0;
+}
+
+static uint64_t apic_rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+// flat logical destinations, one bit per cpu, and software enable with the spurious vector
 static void init_local_apic() {
-    uint32_t tmp;
-    lapic_write(LOCAL_APIC_LDR_REG, 0x0);
-    tmp = (1 >> smp_fetch_cpu());
-    tmp = tmp << 24;
-    lapic_write(LOCAL_APIC_LDR_REG, 0xffffffff);
-    tmp = lapic_read(LOCAL_APIC_SPURIOUS_REG);
-    tmp = tmp | (1 << 8);
-    lapic_write(LOCAL_APIC_SPURIOUS_REG, tmp);
+    lapic_write(LOCAL_APIC_LDF_REG, 0xffffffff);
+    lapic_write(LOCAL_APIC_LDR_REG, (1u << (apic_this_cpu() % 8)) << 24);
+    lapic_write(LOCAL_APIC_TPR_REG, 0);
+    lapic_write(LOCAL_APIC_SPURIOUS_REG, APIC_SVR_ENABLE | APIC_SPURIOUS_VECTOR);
 }
 
-void apic_bsp_init(uint32_t phys_base_address) {
+// map and enable the boot cpu's lapic, -1 leaves the pit as the tick
+int apic_bsp_init(void) {
     if (lapic_base)
-        return;
-    lapic_base = phys_base_address;
+        return 0;
+    if (!apic_present()) {
+        log("apic: no local apic, the pit keeps the tick\n", YELLOW);
+        return -1;
+    }
+
+    uint64_t base = apic_rdmsr(IA32_APIC_BASE_MSR) & ~(uint64_t) (PAGE_SIZE - 1);
+    if (base >> 32 || vmm_map_kernel_mmio((uintptr_t) base, 1) < 0) {
+        log("apic: could not map the local apic\n", RED);
+        return -1;
+    }
+    lapic_base = (uint32_t) base;
+
+    set_idt_entry(APIC_SPURIOUS_VECTOR, (uint32_t) apic_spurious_irq, KERNEL_CODE_SEGMENT, 0x8E);
+    set_idt_entry(SMP_IPI_VECTOR, (uint32_t) apic_ipi_irq, KERNEL_CODE_SEGMENT, 0x8E);
     init_local_apic();
+    log("apic: init - ok\n", GREEN);
+    return 0;
 }
 
 #define UINT_MAX 4294967295
-static uint32_t ticks[8];
 
-void timer_wait_ticks(uint32_t t) {
-    int wait_idle = 0;
+static void timer_wait_ticks(uint32_t t) {
+    int wait_idle = IA32_INT_ENABLED();
     uint32_t current_ticks;
-    uint32_t eflags = get_eflags();
-    if (IRQ_ENABLED(eflags))
-        wait_idle = 1;
-    current_ticks = ticks[0];
-    while (ticks[0] < current_ticks + t) {
+    current_ticks = global_tick_count;
+    while (global_tick_count < current_ticks + t) {
         if (wait_idle)
             asm("hlt");
         else
@@ -60,21 +95,84 @@ void timer_wait_ticks(uint32_t t) {
     }
 }
 
+// calibrated once on the bsp against the pit, the aps assume the same bus clock
+static uint32_t apic_ticks_per_second = 0;
+static uint32_t apic_timer_vector = 0;
+static clock_event_t apic_clockevent[CONFIG_MAX_CPUS];
+
+static int apic_timer_set_periodic(clock_event_t* evt, uint32_t hz) {
+    lapic_write(LOCAL_APIC_TIMER_LVT_REG,
+                APIC_LVT_DELIVERY_MODE_FIXED + APIC_LVT_TIMER_MODE_PERIODIC + APIC_LVT_VECTOR * apic_timer_vector);
+    lapic_write(LOCAL_APIC_INIT_COUNT_REG, evt->freq / hz);
+    return 0;
+}
+
+static int apic_timer_set_next_event(clock_event_t* evt, uint32_t cycles) {
+    (void) evt;
+    lapic_write(LOCAL_APIC_TIMER_LVT_REG,
+                APIC_LVT_DELIVERY_MODE_FIXED + APIC_LVT_TIMER_MODE_ONE_SHOT + APIC_LVT_VECTOR * apic_timer_vector);
+    lapic_write(LOCAL_APIC_INIT_COUNT_REG, cycles);
+    return 0;
+}
+
+static void apic_timer_shutdown(clock_event_t* evt) {
+    (void) evt;
+    lapic_write(LOCAL_APIC_TIMER_LVT_REG, APIC_LVT_MASK);
+    lapic_write(LOCAL_APIC_INIT_COUNT_REG, 0);
+}
+
+// the current count reads 0 once a one-shot ran out
+static uint32_t apic_timer_elapsed(clock_event_t* evt) {
+    uint32_t count = lapic_read(LOCAL_APIC_CURRENT_COUNT_REG);
+    return count > evt->programmed ? evt->programmed : evt->programmed - count;
+}
+
+// calibrate on the first call, then hand this cpu's lapic timer to the clock event layer
+// the boot cpu calls this from kmain, the pit has to be ticking with interrupts on for the calibration
 void apic_init_timer(int vector) {
-    uint32_t timer_lvt;
-    uint32_t apic_ticks;
-    uint32_t apic_ticks_per_second;
-    timer_lvt = APIC_LVT_DELIVERY_MODE_FIXED + APIC_LVT_MASK + APIC_LVT_TIMER_MODE_ONE_SHOT + APIC_LVT_VECTOR * vector;
-    lapic_write(LOCAL_APIC_TIMER_LVT_REG, timer_lvt);
-    lapic_write(LOCAL_APIC_DCR_REG, 0xa);
-    lapic_write(LOCAL_APIC_INIT_COUNT_REG, UINT_MAX);
-    timer_wait_ticks(APIC_CALIBRATE_TICKS);
-    apic_ticks = lapic_read(LOCAL_APIC_CURRENT_COUNT_REG);
-    apic_ticks = ~apic_ticks;
-    apic_ticks_per_second = apic_ticks * 100 / APIC_CALIBRATE_TICKS;
-
-    timer_lvt = APIC_LVT_DELIVERY_MODE_FIXED + APIC_LVT_TIMER_MODE_PERIODIC + APIC_LVT_VECTOR * vector;
-    lapic_write(LOCAL_APIC_TIMER_LVT_REG, timer_lvt);
-
-    lapic_write(LOCAL_APIC_INIT_COUNT_REG, apic_ticks / APIC_CALIBRATE_TICKS);
-}
\ No newline at end of file
+    if (!lapic_base)
+        return;
+    int cpu = apic_this_cpu();
+
+    apic_timer_vector = (uint32_t) vector;
+    lapic_write(LOCAL_APIC_DCR_REG, APIC_TIMER_DIVIDE_128);
+    if (!apic_ticks_per_second) {
+        // the idt is shared, the first cpu installs the stub for everyone
+        set_idt_entry(vector, (uint32_t) apic_timer_irq, KERNEL_CODE_SEGMENT, 0x8E);
+        uint32_t apic_ticks;
+        lapic_write(LOCAL_APIC_TIMER_LVT_REG, APIC_LVT_DELIVERY_MODE_FIXED + APIC_LVT_MASK +
+                                                  APIC_LVT_TIMER_MODE_ONE_SHOT + APIC_LVT_VECTOR * vector);
+        lapic_write(LOCAL_APIC_INIT_COUNT_REG, UINT_MAX);
+        timer_wait_ticks(APIC_CALIBRATE_TICKS);
+        apic_ticks = lapic_read(LOCAL_APIC_CURRENT_COUNT_REG);
+        apic_ticks = ~apic_ticks;
+        apic_ticks_per_second = apic_ticks / APIC_CALIBRATE_TICKS * TIMER_HZ;
+    }
+
+    clock_event_t* evt = &apic_clockevent[cpu];
+    evt->name = "lapic";
+    evt->features = CLOCK_EVT_PERIODIC | CLOCK_EVT_ONESHOT;
+    evt->freq = apic_ticks_per_second;
+    evt->min_cycles = 1;
+    evt->max_cycles = UINT_MAX;
+    evt->rating = 200;
+    evt->set_periodic = apic_timer_set_periodic;
+    evt->set_next_event = apic_timer_set_next_event;
+    evt->shutdown = apic_timer_shutdown;
+    evt->elapsed = apic_timer_elapsed;
+    if (clockevent_register(evt, cpu) < 0)
+        log("apic: timer not usable as a clock event\n", RED);
+}
+
+// remote calls from smp_tell_cpus_to_do_fn, nobody sends them on a single cpu build
+void apic_ipi_interrupt(void) {
+#ifdef CONFIG_SMP
+    smp_handle_ipi();
+#endif
+    lapic_write(LOCAL_APIC_EOI, 0);
+}
+
+void apic_timer_interrupt(void) {
+    clockevent_interrupt(&apic_clockevent[apic_this_cpu()]);
+    lapic_write(LOCAL_APIC_EOI, 0);
+}
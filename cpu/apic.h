@@ -1,3 +1,6 @@
+#ifndef APIC_H
+#define APIC_H
+
 #include <stdint.h>
 #include <stddef.h>
 #define LOCAL_APIC_BASE 0xfee00000
@@ -37,6 +40,12 @@
 #define IPI_INIT 0x5
 #define IPI_STARTUP 0x6
 #define APIC_CALIBRATE_TICKS 10
+#define APIC_TIMER_DIVIDE_128 0xa
+#define APIC_TIMER_VECTOR 0xEF // just below the ipi vector
+#define APIC_SPURIOUS_VECTOR 0xFF
+#define APIC_SVR_ENABLE (1 << 8)
+#define IA32_APIC_BASE_MSR 0x1B
+#define CPUID_EDX_APIC (1 << 9)
 
 typedef struct io_apic {
     uint8_t apic_id;
@@ -44,4 +53,13 @@ typedef struct io_apic {
     uint32_t phys_base_address;
     struct io_apic* next;
     struct io_apic* prev;
-} io_apic_t;
\ No newline at end of file
+} io_apic_t;
+
+uint32_t lapic_read(uint32_t offset);
+void lapic_write(uint32_t offset, uint32_t value);
+int apic_bsp_init(void);
+void apic_init_timer(int vector);
+void apic_timer_interrupt(void);
+void apic_ipi_interrupt(void);
+
+#endif // APIC_H
@@ -0,0 +1,189 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "clockevent.h"
+#include "../../task/timer.h"
+#include "../../task/sched.h"
+#include "../../interrupts/interrupts.h"
+#include "../../smp/smp.h"
+#include "../../lib/logging.h"
+
+// the boot cpu keeps time, its ticks advance the tick count and run the timer wheel
+#define CLOCKEVENT_TIMEKEEPER 0
+
+typedef struct clockevent_cpu {
+    clock_event_t* dev;
+    bool periodic;       // ticks in periodic mode while busy, otherwise a one-shot per tick
+    bool stopped;        // a one-shot covering stop_ticks ticks is pending, idle or just back from it
+    uint32_t stop_ticks;
+} clockevent_cpu_t;
+
+static clockevent_cpu_t clockevent_cpus[CONFIG_MAX_CPUS];
+
+static inline int clockevent_this_cpu(void) {
+#ifdef CONFIG_SMP
+    int cpu = smp_fetch_cpu();
+    return cpu >= 0 && cpu < CONFIG_MAX_CPUS ? cpu : 0;
+#else
+    return 0;
+#endif
+}
+
+static void clockevent_program(clock_event_t* evt, uint32_t cycles) {
+    if (cycles < evt->min_cycles)
+        cycles = evt->min_cycles;
+    if (cycles > evt->max_cycles)
+        cycles = evt->max_cycles;
+    evt->programmed = cycles;
+    evt->set_next_event(evt, cycles);
+}
+
+static void clockevent_start_tick(clockevent_cpu_t* ce) {
+    clock_event_t* evt = ce->dev;
+    ce->stopped = false;
+    if (ce->periodic) {
+        evt->programmed = evt->cycles_per_tick;
+        evt->set_periodic(evt, TIMER_HZ);
+    } else {
+        clockevent_program(evt, evt->cycles_per_tick);
+    }
+}
+
+static void clockevent_run_ticks(int cpu, uint32_t ticks) {
+    if (!ticks)
+        return;
+    if (cpu == CLOCKEVENT_TIMEKEEPER)
+        scheduler_tick(ticks);
+    sched_cpu_tick(ticks);
+}
+
+// called on the cpu itself, the lapic timer can only be programmed from its own cpu
+int clockevent_register(clock_event_t* evt, int cpu) {
+    if (!evt || cpu < 0 || cpu >= CONFIG_MAX_CPUS || !evt->freq)
+        return -1;
+    if (!(evt->features & CLOCK_EVT_PERIODIC) && !(evt->features & CLOCK_EVT_ONESHOT))
+        return -1;
+    if (((evt->features & CLOCK_EVT_PERIODIC) && !evt->set_periodic) ||
+        ((evt->features & CLOCK_EVT_ONESHOT) && (!evt->set_next_event || !evt->elapsed)))
+        return -1;
+
+    evt->cycles_per_tick = evt->freq / TIMER_HZ;
+    if (!evt->cycles_per_tick)
+        return -1;
+
+    clockevent_cpu_t* ce = &clockevent_cpus[cpu];
+    if (ce->dev && ce->dev->rating >= evt->rating)
+        return 0;
+
+    bool ints = IA32_INT_ENABLED();
+    IA32_INT_MASK();
+    if (ce->dev && ce->dev->shutdown)
+        ce->dev->shutdown(ce->dev);
+    ce->dev = evt;
+    ce->periodic = (evt->features & CLOCK_EVT_PERIODIC) != 0;
+    if (!ce->periodic && evt->max_cycles < evt->cycles_per_tick) {
+        ce->dev = NULL;
+        if (ints)
+            IA32_INT_UNMASK();
+        return -1;
+    }
+    clockevent_start_tick(ce);
+    if (ints)
+        IA32_INT_UNMASK();
+
+    log_f("clockevent: %s ticking cpu %u\n", evt->name, (uint32_t) cpu);
+    return 0;
+}
+
+clock_event_t* clockevent_get(int cpu) {
+    if (cpu < 0 || cpu >= CONFIG_MAX_CPUS)
+        return NULL;
+    return clockevent_cpus[cpu].dev;
+}
+
+void clockevent_interrupt(clock_event_t* evt) {
+    int cpu = clockevent_this_cpu();
+    clockevent_cpu_t* ce = &clockevent_cpus[cpu];
+    // a device that was replaced and left with an interrupt in flight
+    if (ce->dev != evt)
+        return;
+
+    uint32_t ticks = 1;
+    if (ce->stopped) {
+        ticks = ce->stop_ticks;
+        clockevent_start_tick(ce);
+    } else if (!ce->periodic) {
+        clockevent_program(evt, evt->cycles_per_tick);
+    }
+    clockevent_run_ticks(cpu, ticks);
+}
+
+// the pending tick is kept where it was, the one-shot runs on from it to the tick the next timer is due on
+void clockevent_idle_enter(void) {
+    clockevent_cpu_t* ce = &clockevent_cpus[clockevent_this_cpu()];
+    clock_event_t* evt = ce->dev;
+    if (!evt || !(evt->features & CLOCK_EVT_ONESHOT) || ce->stopped)
+        return;
+
+    uint64_t now = timer_now();
+    uint64_t next = timer_next_expiry();
+    if (next <= now + 1)
+        return; // due on the coming tick anyway
+
+    uint32_t elapsed = evt->elapsed(evt);
+    if (elapsed >= evt->programmed)
+        return; // the tick is already pending
+    uint32_t remaining = evt->programmed - elapsed;
+
+    uint32_t cpt = evt->cycles_per_tick;
+    uint32_t max_ticks = (evt->max_cycles - remaining) / cpt + 1;
+    uint64_t ticks = next - now;
+    if (ticks > max_ticks)
+        ticks = max_ticks;
+
+    evt->programmed = remaining + ((uint32_t) ticks - 1) * cpt;
+    evt->set_next_event(evt, evt->programmed);
+    ce->stopped = true;
+    ce->stop_ticks = (uint32_t) ticks;
+}
+
+void clockevent_idle_exit(void) {
+    bool ints = IA32_INT_ENABLED();
+    IA32_INT_MASK();
+
+    int cpu = clockevent_this_cpu();
+    clockevent_cpu_t* ce = &clockevent_cpus[cpu];
+    clock_event_t* evt = ce->dev;
+    if (evt && ce->stopped) {
+        uint32_t elapsed = evt->elapsed(evt);
+        // if it fired its interrupt does the accounting
+        if (elapsed < evt->programmed) {
+            uint32_t cpt = evt->cycles_per_tick;
+            uint32_t remaining = evt->programmed - elapsed;
+            uint32_t left = (remaining + cpt - 1) / cpt; // tick boundaries still ahead
+            uint32_t ticks = ce->stop_ticks > left ? ce->stop_ticks - left : 0;
+
+            // run up to the next boundary as a one tick stop, then ticking resumes in phase
+            clockevent_program(evt, remaining - (left - 1) * cpt);
+            ce->stop_ticks = 1;
+            clockevent_run_ticks(cpu, ticks);
+        }
+    }
+
+    if (ints)
+        IA32_INT_UNMASK();
+}
@@ -0,0 +1,42 @@
+#ifndef CLOCKEVENT_H
+#define CLOCKEVENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// clock event devices, the timers that interrupt a cpu (the pit, each cpu's lapic timer)
+// a cpu ticks with its best device, one-shot devices are re-armed a tick at a time while busy
+// and programmed for the next pending timer when the cpu goes idle, so an idle cpu stops ticking
+#define CLOCK_EVT_PERIODIC 0x1
+#define CLOCK_EVT_ONESHOT 0x2
+
+typedef struct clock_event {
+    const char* name;
+    uint32_t features;
+    uint32_t freq;       // counter frequency in hz
+    uint32_t min_cycles; // shortest one-shot the device takes
+    uint32_t max_cycles; // longest one-shot the device takes
+    int rating;          // a cpu uses its highest rated device
+    int (*set_periodic)(struct clock_event* evt, uint32_t hz);
+    int (*set_next_event)(struct clock_event* evt, uint32_t cycles);
+    void (*shutdown)(struct clock_event* evt);
+    // cycles since the pending one-shot was programmed, at least programmed once it has fired
+    uint32_t (*elapsed)(struct clock_event* evt);
+
+    uint32_t cycles_per_tick; // set on registration
+    uint32_t programmed;      // cycles of the pending one-shot
+} clock_event_t;
+
+int clockevent_register(clock_event_t* evt, int cpu);
+clock_event_t* clockevent_get(int cpu);
+
+// from the device's interrupt handler, before its eoi
+void clockevent_interrupt(clock_event_t* evt);
+
+// idle loop, interrupts off on enter, stop ticking until the next timer is due
+void clockevent_idle_enter(void);
+// back from hlt, account for the ticks slept through if the device did not wake us
+void clockevent_idle_exit(void);
+
+#endif // CLOCKEVENT_H
@@ -326,6 +326,9 @@ static struct vfs_node* tmpfs_open(struct vfs_node* node, char* relpath) {
         h->pos = target_inode->size;
     }
 
+    // the inode address names the file, opens of the same file share mapped pages through it
+    node->stat.st_ino = (uint32_t) (uintptr_t) target_inode;
+    node->stat.st_size = target_inode->size;
     node->data_pointer = h;
     return node;
 }
@@ -196,6 +196,7 @@ static int vfs_node_alloc(struct vfs_node** node, struct vfs_mountpoint* mp, int
     }
     (*node)->mountpoint = mp;
     (*node)->vfs_mode = mode;
+    (*node)->name = NULL;
 
     refcount_init(&(*node)->refcount);
 
@@ -290,6 +291,8 @@ int vfs_free_node(struct vfs_node* node) {
         vfs_free_mountpoint(node->mountpoint);
     }
 
+    if (node->name)
+        kfree(node->name, flopstrlen(node->name) + 1);
     kfree(node, sizeof(struct vfs_node));
     return errcode ? errcode : -1;
 }
@@ -521,6 +524,14 @@ int vfs_write(struct vfs_node* node, unsigned char* buffer, unsigned long size)
     return -1;
 }
 
+// remember the path a node was opened with, file mappings reopen it for their own handle
+static void vfs_node_set_name(struct vfs_node* n, const char* name) {
+    size_t len = flopstrlen(name) + 1;
+    n->name = kmalloc(len);
+    if (n->name)
+        flopstrcopy(n->name, name, len);
+}
+
 struct vfs_node* vfs_open(char* name, int mode) {
     struct vfs_node* n = NULL;
     char* relative_path = NULL;
@@ -536,12 +547,14 @@ struct vfs_node* vfs_open(char* name, int mode) {
 
     if (vfs_try_open(n, mp, relative_path) == 0) {
         vfs_seek_if_append(n);
+        vfs_node_set_name(n, name);
         return n;
     }
 
     if (vfs_create_file_if_needed(mp, relative_path, mode) == 0) {
         if (vfs_try_open(n, mp, relative_path) == 0) {
             vfs_seek_if_append(n);
+            vfs_node_set_name(n, name);
             return n;
         }
     }
@@ -11,6 +11,7 @@
 #include "../mem/paging.h"
 #include "../mem/utils.h"
 #include "../kernel/kernel.h"
+#include "../drivers/time/clockevent.h"
 #include <stdbool.h>
 
 extern void isr0();
@@ -30,11 +31,17 @@ void init_stack() {
     __asm__ volatile("mov %0, %%esp" ::"r"(stack_top));
 }
 
-#define PIT_FREQUENCY 100
+// irqs that interrupted ring 3 end here after their eoi
+// a thread spinning in user mode makes no syscalls, this is where its tick takes the cpu away
+void c_irq_user_return(void) {
+    sched_preempt_point();
+}
 
-// wrapper for the scheduler tick
-void scheduler_tick() {
-    return;
+// wrapper for the scheduler tick, runs the timers due on it
+// ticks is more than one when the timekeeping cpu comes back from a tickless idle
+void scheduler_tick(uint32_t ticks) {
+    global_tick_count += ticks;
+    sched_tick(ticks);
 }
 
 extern void isr0();
@@ -63,13 +70,19 @@ void c_isr13(void) {
 }
 
 // page fault
-void c_isr14(void) {
+// demand paged ranges are resolved here, anything else is fatal
+void c_isr14(uint32_t error_code) {
     uint32_t addr;
-    uint32_t error_code;
 
     __asm__ volatile("mov %%cr2, %0" : "=r"(addr));
 
-    __asm__ volatile("movl 4(%%esp), %0" : "=r"(error_code));
+    process_t* proc = proc_get_current();
+    vmm_region_t* region = (proc && proc->region) ? proc->region : vmm_current_region();
+    if (vmm_handle_page_fault(region, addr, error_code) == 0) {
+        if (proc)
+            proc->minor_faults++;
+        return;
+    }
 
     log("isr14: page fault, get fucked\n", RED);
     log_address("Faulting Address: ", addr);
@@ -104,10 +117,62 @@ void _pic_register_eoi(irq_num_t irq) {
     }
 }
 
+static bool pit_oneshot = false;
+
+static void pit_write_count(uint8_t command, uint32_t count) {
+    outb(PIT_COMMAND_PORT, command);
+    outb(PIT_CHANNEL0_PORT, count & PIT_DIVISOR_LSB_MASK);
+    outb(PIT_CHANNEL0_PORT, (count >> PIT_DIVISOR_MSB_SHIFT) & PIT_DIVISOR_LSB_MASK);
+}
+
+static int pit_set_periodic(clock_event_t* evt, uint32_t hz) {
+    (void) evt;
+    pit_oneshot = false;
+    pit_write_count(PIT_COMMAND_MODE, PIT_BASE_FREQUENCY / hz);
+    return 0;
+}
+
+static int pit_set_next_event(clock_event_t* evt, uint32_t cycles) {
+    (void) evt;
+    pit_oneshot = true;
+    pit_write_count(PIT_COMMAND_ONESHOT, cycles);
+    return 0;
+}
+
+// the lapic took over, keep irq0 masked
+static void pit_shutdown(clock_event_t* evt) {
+    (void) evt;
+    outb(PIC1_DATA, inb(PIC1_DATA) | (1 << IRQ_PIT));
+}
+
+static uint32_t pit_elapsed(clock_event_t* evt) {
+    outb(PIT_COMMAND_PORT, PIT_READBACK_CH0);
+    uint8_t status = inb(PIT_CHANNEL0_PORT);
+    uint32_t count = inb(PIT_CHANNEL0_PORT);
+    count |= (uint32_t) inb(PIT_CHANNEL0_PORT) << PIT_DIVISOR_MSB_SHIFT;
+
+    if ((pit_oneshot && (status & PIT_STATUS_OUT)) || count > evt->programmed)
+        return evt->programmed;
+    return evt->programmed - count;
+}
+
+// only the boot cpu takes irq0, the lapic timer outranks it once it is calibrated
+static clock_event_t pit_clockevent = {
+    .name = "pit",
+    .features = CLOCK_EVT_PERIODIC | CLOCK_EVT_ONESHOT,
+    .freq = PIT_BASE_FREQUENCY,
+    .min_cycles = 1,
+    .max_cycles = PIT_MAX_COUNT,
+    .rating = 100,
+    .set_periodic = pit_set_periodic,
+    .set_next_event = pit_set_next_event,
+    .shutdown = pit_shutdown,
+    .elapsed = pit_elapsed,
+};
+
 // pit
 void c_irq0(void) {
-    global_tick_count++;
-    scheduler_tick();
+    clockevent_interrupt(&pit_clockevent);
     _pic_register_eoi(IRQ_PIT);
 }
 
@@ -182,12 +247,10 @@ static void _pic_init() {
 }
 
 static void _pit_init() {
-    uint16_t divisor = PIT_BASE_FREQUENCY / PIT_FREQUENCY;
-
-    outb(PIT_COMMAND_PORT, PIT_COMMAND_MODE);
-
-    outb(PIT_CHANNEL0_PORT, divisor & PIT_DIVISOR_LSB_MASK);
-    outb(PIT_CHANNEL0_PORT, (divisor >> PIT_DIVISOR_MSB_SHIFT) & PIT_DIVISOR_LSB_MASK);
+    if (clockevent_register(&pit_clockevent, 0) < 0) {
+        log("pit: init - failed\n", RED);
+        return;
+    }
     log("pit: init - ok\n", GREEN);
 }
 
@@ -45,7 +45,11 @@ static uint8_t interrupt_stack[ISR_STACK_SIZE] __attribute__((aligned(16)));
 #define PIT_CHANNEL0_PORT 0x40
 #define PIT_BASE_FREQUENCY 1193182
 
-#define PIT_COMMAND_MODE 0x36
+#define PIT_COMMAND_MODE 0x34    // channel 0, rate generator, its count reads back linearly
+#define PIT_COMMAND_ONESHOT 0x30 // channel 0, interrupt on terminal count
+#define PIT_READBACK_CH0 0xC2    // latch status and count of channel 0
+#define PIT_STATUS_OUT 0x80      // out pin, high once a one-shot count ran out
+#define PIT_MAX_COUNT 0xFFFF
 #define PIT_CHANNEL0 0x40
 #define PIT_DIVISOR_LSB_MASK 0xFF
 #define PIT_DIVISOR_MSB_SHIFT 8
@@ -73,4 +77,5 @@ void set_idt_entry(int n, uint32_t base, uint16_t sel, uint8_t flags);
         (eflags & (1 << 9)) != 0;                                                                                      \
     })
 extern uint32_t global_tick_count;
+void scheduler_tick(uint32_t ticks);
 #endif // INTERRUPTS_H
@@ -6,6 +6,9 @@ global isr14
 
 global irq0
 global irq1
+global apic_timer_irq
+global apic_spurious_irq
+global apic_ipi_irq
 
 ; funcntions prefixed with 'c_' are C functions 
 extern c_isr0
@@ -15,6 +18,9 @@ extern c_isr14
 
 extern c_irq0
 extern c_irq1
+extern c_irq_user_return
+extern apic_timer_interrupt
+extern apic_ipi_interrupt
 
 section .text
 
@@ -46,7 +52,9 @@ isr13:
 isr14:
     pusha
     cld
+    push dword [esp+32] ; error code pushed by the cpu
     call c_isr14
+    add esp, 4
     popa
     add esp, 4
     iret
@@ -55,6 +63,10 @@ isr14:
 irq0:
     pusha               
     call c_irq0   
+    test dword [esp+36], 3 ; cs of the interrupted code, pusha left 32 bytes over eip
+    jz .kernel
+    call c_irq_user_return
+.kernel:
     popa                
     iret
 
@@ -62,5 +74,33 @@ irq0:
 irq1:
     pusha              
     call c_irq1 
+    test dword [esp+36], 3
+    jz .kernel
+    call c_irq_user_return
+.kernel:
     popa                
+    iret
+
+; lapic timer, the tick once apic_init_timer handed it to the clock events
+apic_timer_irq:
+    pusha
+    cld
+    call apic_timer_interrupt
+    test dword [esp+36], 3
+    jz .kernel
+    call c_irq_user_return
+.kernel:
+    popa
+    iret
+
+; cross cpu calls
+apic_ipi_irq:
+    pusha
+    cld
+    call apic_ipi_interrupt
+    popa
+    iret
+
+; lapic spurious interrupt, it takes no eoi
+apic_spurious_irq:
     iret
\ No newline at end of file
@@ -35,12 +35,15 @@ kernel.c:
 #include "../fs/vfs/vfs.h"
 #include "../drivers/keyboard/keyboard.h"
 #include "../interrupts/interrupts.h"
+#include "../cpu/apic.h"
 #include "../lib/str.h"
 #include "../lib/assert.h"
 #include "../mem/pmm.h"
 #include "../mem/utils.h"
 #include "../mem/slab.h"
 #include "../mem/vmm.h"
+#include "../mem/ksm.h"
+#include "../mem/filemap.h"
 #include "../mem/gdt.h"
 #include "../mem/alloc.h"
 #include "../task/sched.h"
@@ -138,8 +141,21 @@ int kmain(uint32_t magic, multiboot_info_t* mb_info) {
     slab_init();
     vmm_init();
     init_kernel_heap();
+    page_cache_init();
     vfs_init();
     sched_init();
+    // the lapic one-shot takes the tick over from the pit, it is calibrated against it first
+    if (apic_bsp_init() == 0) {
+#ifdef CONFIG_SMP
+        smp_init_bsp();
+#endif
+        apic_init_timer(APIC_TIMER_VECTOR);
+    }
+    vmm_pt_pool_start(); // needs the scheduler for its refill thread
+    vmm_reclaim_start();
+    ksm_start();
+    filemap_start(); // writeback of shared file mappings
+    rand_frames_start();
     proc_init();
     echo("floppaOS kernel booted! now we do nothing.\n", GREEN);
 
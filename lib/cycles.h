@@ -0,0 +1,21 @@
+#ifndef CYCLES_H
+#define CYCLES_H
+
+#include <stdint.h>
+
+// cycle counting for the kernel's own timing stats
+static inline uint64_t cycles_now(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+// fold the count'th sample into a running average and max, no 64-bit division in the kernel
+static inline void cycles_account(uint32_t* avg, uint32_t* max, uint32_t count, uint64_t cycles) {
+    uint32_t c = (uint32_t) cycles;
+    *avg = (uint32_t) ((int32_t) *avg + ((int32_t) (c - *avg)) / (int32_t) count);
+    if (c > *max)
+        *max = c;
+}
+
+#endif // CYCLES_H
@@ -0,0 +1,175 @@
+/*
+lz4.c - lz4 block compression for floppaOS
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "lz4.h"
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // the block always ends in at least this many literals
+#define LZ4_MFLIMIT 12      // no match may start closer than this to the end
+#define LZ4_MAX_OFFSET 65535
+
+static inline uint32_t lz4_read32(const uint8_t* p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint32_t lz4_hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// lengths of 15 and up continue in 255 byte steps after the token
+static int lz4_put_len(uint8_t* dst, size_t cap, size_t* op, size_t len) {
+    while (len >= 255) {
+        if (*op >= cap)
+            return -1;
+        dst[(*op)++] = 255;
+        len -= 255;
+    }
+    if (*op >= cap)
+        return -1;
+    dst[(*op)++] = (uint8_t) len;
+    return 0;
+}
+
+// one sequence: token, literals, then the match (mlen 0 for the closing literals only sequence)
+static int lz4_emit(uint8_t* dst, size_t cap, size_t* op, const uint8_t* lit, size_t lit_len, size_t offset,
+                    size_t mlen) {
+    if (*op >= cap)
+        return -1;
+    size_t token = (*op)++;
+    uint8_t t = (uint8_t) ((lit_len >= 15 ? 15 : lit_len) << 4);
+
+    if (lit_len >= 15 && lz4_put_len(dst, cap, op, lit_len - 15) < 0)
+        return -1;
+    if (*op + lit_len > cap)
+        return -1;
+    for (size_t i = 0; i < lit_len; i++)
+        dst[*op + i] = lit[i];
+    *op += lit_len;
+
+    if (mlen) {
+        if (*op + 2 > cap)
+            return -1;
+        dst[(*op)++] = (uint8_t) (offset & 0xFF);
+        dst[(*op)++] = (uint8_t) (offset >> 8);
+
+        size_t m = mlen - LZ4_MIN_MATCH;
+        t |= (uint8_t) (m >= 15 ? 15 : m);
+        if (m >= 15 && lz4_put_len(dst, cap, op, m - 15) < 0)
+            return -1;
+    }
+
+    dst[token] = t;
+    return 0;
+}
+
+int lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap, lz4_state_t* state) {
+    if (!src || !dst || !state || len > LZ4_MAX_INPUT)
+        return -1;
+
+    // positions are stored plus one so a zeroed table means empty
+    for (size_t i = 0; i < (1u << LZ4_HASH_BITS); i++)
+        state->table[i] = 0;
+
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    if (len > LZ4_MFLIMIT) {
+        size_t limit = len - LZ4_MFLIMIT;
+        while (ip < limit) {
+            uint32_t seq = lz4_read32(src + ip);
+            uint32_t h = lz4_hash(seq);
+            size_t ref = state->table[h];
+            state->table[h] = (uint16_t) (ip + 1);
+
+            if (!ref || ip - (ref - 1) > LZ4_MAX_OFFSET || lz4_read32(src + ref - 1) != seq) {
+                ip++;
+                continue;
+            }
+            ref--;
+
+            size_t mlen = LZ4_MIN_MATCH;
+            size_t max = len - LZ4_LAST_LITERALS - ip;
+            while (mlen < max && src[ref + mlen] == src[ip + mlen])
+                mlen++;
+
+            if (lz4_emit(dst, dst_cap, &op, src + anchor, ip - anchor, ip - ref, mlen) < 0)
+                return -1;
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+
+    if (lz4_emit(dst, dst_cap, &op, src + anchor, len - anchor, 0, 0) < 0)
+        return -1;
+    return (int) op;
+}
+
+int lz4_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap) {
+    if (!src || !dst)
+        return -1;
+
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < len) {
+        uint8_t t = src[ip++];
+        uint8_t b;
+
+        size_t lit = t >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= len)
+                    return -1;
+                b = src[ip++];
+                lit += b;
+            } while (b == 255);
+        }
+        if (ip + lit > len || op + lit > dst_cap)
+            return -1;
+        for (size_t i = 0; i < lit; i++)
+            dst[op + i] = src[ip + i];
+        ip += lit;
+        op += lit;
+
+        // the last sequence has no match
+        if (ip >= len)
+            break;
+
+        if (ip + 2 > len)
+            return -1;
+        size_t offset = (size_t) src[ip] | ((size_t) src[ip + 1] << 8);
+        ip += 2;
+        if (!offset || offset > op)
+            return -1;
+
+        size_t mlen = t & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= len)
+                    return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ4_MIN_MATCH;
+        if (op + mlen > dst_cap)
+            return -1;
+
+        // byte by byte, the match may overlap what it is producing
+        for (size_t i = 0; i < mlen; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return (int) op;
+}
@@ -0,0 +1,22 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// lz4 block format, no frame header or checksums
+#define LZ4_HASH_BITS 12
+#define LZ4_MAX_INPUT 65535 // match offsets and the hash table are 16 bit
+
+// match finder state, reused between calls so it does not sit on the stack
+typedef struct lz4_state {
+    uint16_t table[1 << LZ4_HASH_BITS];
+} lz4_state_t;
+
+// returns the compressed size, or -1 if the output would not fit in dst_cap
+int lz4_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap, lz4_state_t* state);
+
+// returns the decompressed size, or -1 on malformed input or overflow of dst_cap
+int lz4_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap);
+
+#endif // LZ4_H
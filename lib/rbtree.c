@@ -0,0 +1,214 @@
+/*
+rbtree.c - intrusive red-black tree for floppaOS
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include "rbtree.h"
+
+static inline bool rb_is_red(rb_node_t* node) {
+    return node && node->red;
+}
+
+// put child where node hangs from its parent
+static void rb_replace_child(rb_root_t* root, rb_node_t* node, rb_node_t* child) {
+    if (!node->parent)
+        root->node = child;
+    else if (node == node->parent->left)
+        node->parent->left = child;
+    else
+        node->parent->right = child;
+    if (child)
+        child->parent = node->parent;
+}
+
+static void rb_rotate_left(rb_root_t* root, rb_node_t* x) {
+    rb_node_t* y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    rb_replace_child(root, x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void rb_rotate_right(rb_root_t* root, rb_node_t* x) {
+    rb_node_t* y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    rb_replace_child(root, x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+void rb_insert_color(rb_root_t* root, rb_node_t* node) {
+    node->red = true;
+    while (rb_is_red(node->parent)) {
+        // a red parent is never the root, so the grandparent exists
+        rb_node_t* parent = node->parent;
+        rb_node_t* gparent = parent->parent;
+
+        if (parent == gparent->left) {
+            rb_node_t* uncle = gparent->right;
+            if (rb_is_red(uncle)) {
+                parent->red = uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rb_rotate_left(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            gparent->red = true;
+            rb_rotate_right(root, gparent);
+        } else {
+            rb_node_t* uncle = gparent->left;
+            if (rb_is_red(uncle)) {
+                parent->red = uncle->red = false;
+                gparent->red = true;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rb_rotate_right(root, parent);
+                node = parent;
+                parent = node->parent;
+            }
+            parent->red = false;
+            gparent->red = true;
+            rb_rotate_left(root, gparent);
+        }
+    }
+    root->node->red = false;
+}
+
+// node took the place of a removed black node and is short one black, it may be NULL
+static void rb_erase_color(rb_root_t* root, rb_node_t* node, rb_node_t* parent) {
+    while (node != root->node && !rb_is_red(node)) {
+        if (node == parent->left) {
+            rb_node_t* sibling = parent->right;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rb_rotate_left(root, parent);
+                sibling = parent->right;
+            }
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!rb_is_red(sibling->right)) {
+                sibling->left->red = false;
+                sibling->red = true;
+                rb_rotate_right(root, sibling);
+                sibling = parent->right;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->right->red = false;
+            rb_rotate_left(root, parent);
+        } else {
+            rb_node_t* sibling = parent->left;
+            if (sibling->red) {
+                sibling->red = false;
+                parent->red = true;
+                rb_rotate_right(root, parent);
+                sibling = parent->left;
+            }
+            if (!rb_is_red(sibling->left) && !rb_is_red(sibling->right)) {
+                sibling->red = true;
+                node = parent;
+                parent = node->parent;
+                continue;
+            }
+            if (!rb_is_red(sibling->left)) {
+                sibling->right->red = false;
+                sibling->red = true;
+                rb_rotate_left(root, sibling);
+                sibling = parent->left;
+            }
+            sibling->red = parent->red;
+            parent->red = false;
+            sibling->left->red = false;
+            rb_rotate_right(root, parent);
+        }
+        node = root->node;
+    }
+    if (node)
+        node->red = false;
+}
+
+void rb_erase(rb_root_t* root, rb_node_t* node) {
+    rb_node_t* child;
+    rb_node_t* parent;
+    bool black_removed = !node->red;
+
+    if (!node->left) {
+        child = node->right;
+        parent = node->parent;
+        rb_replace_child(root, node, child);
+    } else if (!node->right) {
+        child = node->left;
+        parent = node->parent;
+        rb_replace_child(root, node, child);
+    } else {
+        // two children, the successor takes node's place and color
+        rb_node_t* next = node->right;
+        while (next->left)
+            next = next->left;
+        black_removed = !next->red;
+        child = next->right;
+        if (next->parent == node) {
+            parent = next;
+        } else {
+            parent = next->parent;
+            rb_replace_child(root, next, child);
+            next->right = node->right;
+            next->right->parent = next;
+        }
+        rb_replace_child(root, node, next);
+        next->left = node->left;
+        next->left->parent = next;
+        next->red = node->red;
+    }
+
+    if (black_removed)
+        rb_erase_color(root, child, parent);
+    node->parent = node->left = node->right = NULL;
+}
+
+rb_node_t* rb_first(rb_root_t* root) {
+    rb_node_t* node = root->node;
+    if (!node)
+        return NULL;
+    while (node->left)
+        node = node->left;
+    return node;
+}
+
+rb_node_t* rb_next(rb_node_t* node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
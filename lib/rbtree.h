@@ -0,0 +1,37 @@
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// intrusive red-black tree, the node lives inside whatever is sorted
+// callers walk down to the insertion point themselves and link the node there,
+// so the tree never compares keys or allocates
+typedef struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    bool red;
+} rb_node_t;
+
+typedef struct rb_root {
+    rb_node_t* node;
+} rb_root_t;
+
+#define RB_ROOT_INIT {NULL}
+#define rb_entry(ptr, type, member) ((type*) ((char*) (ptr) - offsetof(type, member)))
+
+// hang node off parent at *link (parent's left or right, or the root), then rebalance
+static inline void rb_link_node(rb_node_t* node, rb_node_t* parent, rb_node_t** link) {
+    node->parent = parent;
+    node->left = node->right = NULL;
+    *link = node;
+}
+
+void rb_insert_color(rb_root_t* root, rb_node_t* node);
+void rb_erase(rb_root_t* root, rb_node_t* node);
+rb_node_t* rb_first(rb_root_t* root);
+rb_node_t* rb_next(rb_node_t* node);
+
+#endif // RBTREE_H
@@ -0,0 +1,349 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "filemap.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "alloc.h"
+#include "utils.h"
+#include "paging.h"
+#include "highmem.h"
+#include "../fs/vfs/vfs.h"
+#include "../lib/logging.h"
+#include "../task/sched.h"
+#include "../task/sync/spinlock.h"
+
+static filemap_t* filemap_list = NULL;
+static spinlock_t filemap_lock = SPINLOCK_INIT;
+static uint32_t filemap_next_id = 1;
+static filemap_stats_t filemap_stats;
+
+static inline uint64_t filemap_key(filemap_t* fm, uint32_t pgoff) {
+    return ((uint64_t) fm->id << 32) | pgoff;
+}
+
+static inline void filemap_count(uint32_t* counter) {
+    atomic_fetch_add_explicit((atomic_uint*) counter, 1, memory_order_relaxed);
+}
+
+// find the mapping state of the file node has open, or start it
+// the file gets its own handle so page-ins never move the mapper's file position
+filemap_t* filemap_get(struct vfs_node* node, bool writable) {
+    if (!node || !node->name)
+        return NULL;
+
+    struct vfs_node* handle = vfs_open(node->name, writable ? VFS_MODE_RW : VFS_MODE_R);
+    if (!handle)
+        return NULL;
+
+    bool ints = spinlock(&filemap_lock);
+    filemap_t* fm = NULL;
+    if (handle->stat.st_ino) {
+        for (fm = filemap_list; fm; fm = fm->next) {
+            if (fm->mp == handle->mountpoint && fm->ino == handle->stat.st_ino)
+                break;
+        }
+    }
+
+    if (fm) {
+        fm->users++;
+        spinlock_unlock(&filemap_lock, ints);
+
+        // first writable shared mapping of a file only mapped for reading so far
+        // page-ins and writeback use the node under io, so it is swapped there too
+        if (writable) {
+            mutex_lock(&fm->io);
+            if (!(fm->node->vfs_mode & VFS_MODE_W)) {
+                struct vfs_node* old = fm->node;
+                fm->node = handle;
+                handle = old;
+            }
+            mutex_unlock(&fm->io);
+        }
+        vfs_close(handle);
+        return fm;
+    }
+
+    fm = (filemap_t*) kmalloc(sizeof(filemap_t));
+    if (!fm) {
+        spinlock_unlock(&filemap_lock, ints);
+        vfs_close(handle);
+        return NULL;
+    }
+    fm->mp = handle->mountpoint;
+    fm->ino = handle->stat.st_ino;
+    fm->node = handle;
+    fm->id = filemap_next_id++;
+    fm->users = 1;
+    fm->pages = 0;
+    fm->dirty = 0;
+    fm->size = FILEMAP_SIZE_UNKNOWN;
+    mutex_init(&fm->io);
+    spinlock_init(&fm->lock);
+    fm->next = filemap_list;
+    filemap_list = fm;
+    spinlock_unlock(&filemap_lock, ints);
+    return fm;
+}
+
+// a lazy range was split or copied by fork
+void filemap_dup(filemap_t* fm) {
+    if (!fm)
+        return;
+    bool ints = spinlock(&filemap_lock);
+    fm->users++;
+    spinlock_unlock(&filemap_lock, ints);
+}
+
+// the last user writes the file back and takes its clean pages out of the cache
+void filemap_put(filemap_t* fm) {
+    if (!fm)
+        return;
+
+    bool ints = spinlock(&filemap_lock);
+    if (--fm->users) {
+        spinlock_unlock(&filemap_lock, ints);
+        return;
+    }
+    for (filemap_t** link = &filemap_list; *link; link = &(*link)->next) {
+        if (*link == fm) {
+            *link = fm->next;
+            break;
+        }
+    }
+    spinlock_unlock(&filemap_lock, ints);
+
+    filemap_writeback(fm);
+    // pages still mapped somewhere are skipped, the cache evicts them once they are free
+    for (uint32_t pgoff = 0; pgoff < fm->pages; pgoff++)
+        page_cache_remove(filemap_key(fm, pgoff));
+    vfs_close(fm->node);
+    kfree(fm, sizeof(filemap_t));
+}
+
+// cache a page of the file, read in on first use, called with fm->io held
+// returns with a cache reference held, *fresh tells whether it had to be read
+static uint8_t* filemap_read_page(filemap_t* fm, uint32_t pgoff, bool* fresh) {
+    bool created;
+    uint8_t* page = (uint8_t*) page_cache_get(filemap_key(fm, pgoff), &created);
+    if (!page)
+        return NULL;
+
+    if (created) {
+        // the cache frame may sit above the identity map and a kmap slot cannot be held across
+        // the read, so the file goes through a bounce buffer
+        uint8_t* buf = (uint8_t*) kmalloc(PAGE_SIZE);
+        uint32_t off = pgoff * PAGE_SIZE;
+        int n = -1;
+        if (buf && vfs_seek(fm->node, off, VFS_SEEK_STRT) == 0)
+            n = vfs_read(fm->node, buf, PAGE_SIZE);
+        if (n < 0)
+            n = 0;
+        // past the end of the file reads as zeroes
+        if (buf && n < PAGE_SIZE)
+            flop_memset(buf + n, 0, PAGE_SIZE - n);
+
+        uint8_t* dst = buf ? (uint8_t*) kmap_atomic((uintptr_t) page) : NULL;
+        if (dst) {
+            flop_memcpy(dst, buf, PAGE_SIZE);
+            kunmap_atomic(dst);
+        }
+        if (buf)
+            kfree(buf, PAGE_SIZE);
+        if (!dst) {
+            // never filled, nobody may find it in the cache
+            page_cache_release(filemap_key(fm, pgoff));
+            page_cache_remove(filemap_key(fm, pgoff));
+            return NULL;
+        }
+
+        if (n < PAGE_SIZE)
+            fm->size = off + (uint32_t) n;
+        else if (fm->size != FILEMAP_SIZE_UNKNOWN && fm->size < off + PAGE_SIZE)
+            fm->size = FILEMAP_SIZE_UNKNOWN; // grown since the last short read
+        filemap_count(&filemap_stats.page_ins);
+    }
+
+    if (pgoff >= fm->pages)
+        fm->pages = pgoff + 1;
+    *fresh = created;
+    return page;
+}
+
+// pull up to count pages starting at pgoff into the cache, stops at the end of the file
+static void filemap_readahead_locked(filemap_t* fm, uint32_t pgoff, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++, pgoff++) {
+        if (fm->size != FILEMAP_SIZE_UNKNOWN && (uint64_t) pgoff * PAGE_SIZE >= fm->size)
+            break;
+        bool fresh;
+        if (!filemap_read_page(fm, pgoff, &fresh))
+            break;
+        page_cache_release(filemap_key(fm, pgoff));
+        if (fresh)
+            filemap_count(&filemap_stats.readahead);
+    }
+}
+
+// the cached frame for a page of the file
+// a page that had to be read in also reads the next readahead pages, they are likely next
+// returns with a frame reference held for the caller's pte, 0 on failure
+uintptr_t filemap_page(filemap_t* fm, uint32_t pgoff, uint32_t readahead) {
+    if (!fm)
+        return 0;
+
+    mutex_lock(&fm->io);
+    bool fresh;
+    uint8_t* page = filemap_read_page(fm, pgoff, &fresh);
+    if (!page) {
+        mutex_unlock(&fm->io);
+        return 0;
+    }
+
+    // the pte's reference, the cache keeps its own
+    pmm_page_ref((uintptr_t) page);
+    page_cache_release(filemap_key(fm, pgoff));
+
+    if (fresh)
+        filemap_readahead_locked(fm, pgoff + 1, readahead);
+    else
+        filemap_count(&filemap_stats.hits);
+    mutex_unlock(&fm->io);
+    return (uintptr_t) page;
+}
+
+// madvise(WILLNEED), get pages into the cache before anyone faults on them
+void filemap_readahead(filemap_t* fm, uint32_t pgoff, uint32_t count) {
+    if (!fm)
+        return;
+    mutex_lock(&fm->io);
+    filemap_readahead_locked(fm, pgoff, count);
+    mutex_unlock(&fm->io);
+}
+
+// a shared mapping is about to write to the page
+void filemap_mark_dirty(filemap_t* fm, uint32_t pgoff) {
+    if (!fm)
+        return;
+    bool ints = spinlock(&fm->lock);
+    if (page_cache_mark_dirty(filemap_key(fm, pgoff)))
+        fm->dirty++;
+    spinlock_unlock(&fm->lock, ints);
+}
+
+static int filemap_wrprotect(struct vmm_region* region, uintptr_t va, void* ctx) {
+    (void) ctx;
+    vmm_wrprotect(region, va);
+    return 0;
+}
+
+// write every dirty page back to the file
+// mappings lose write access before the copy goes out, so a later write faults and dirties the page again
+int filemap_writeback(filemap_t* fm) {
+    if (!fm)
+        return -1;
+
+    // pages are copied out through a kmap slot, which cannot be held across the write
+    uint8_t* buf = (uint8_t*) kmalloc(PAGE_SIZE);
+    if (!buf)
+        return -1;
+
+    // io keeps page-ins out while pages go to the file, fm->lock only covers the dirty count
+    int ret = 0;
+    mutex_lock(&fm->io);
+    for (uint32_t pgoff = 0; pgoff < fm->pages && fm->dirty; pgoff++) {
+        uint64_t key = filemap_key(fm, pgoff);
+        bool ints = spinlock(&fm->lock);
+        bool was_dirty = page_cache_test_clear_dirty(key);
+        if (was_dirty)
+            fm->dirty--;
+        spinlock_unlock(&fm->lock, ints);
+        if (!was_dirty)
+            continue;
+
+        uint8_t* page = (uint8_t*) page_cache_find(key);
+        if (!page)
+            continue;
+        pmm_for_each_mapping((uintptr_t) page, filemap_wrprotect, NULL);
+
+        uint32_t off = pgoff * PAGE_SIZE;
+        uint32_t len = PAGE_SIZE;
+        if (fm->size != FILEMAP_SIZE_UNKNOWN)
+            len = off >= fm->size ? 0 : (fm->size - off < PAGE_SIZE ? fm->size - off : PAGE_SIZE);
+
+        uint8_t* src = len ? (uint8_t*) kmap_atomic((uintptr_t) page) : NULL;
+        if (src) {
+            flop_memcpy(buf, src, len);
+            kunmap_atomic(src);
+        }
+
+        if (len && (!src || vfs_seek(fm->node, off, VFS_SEEK_STRT) < 0 || vfs_write(fm->node, buf, len) != (int) len)) {
+            ints = spinlock(&fm->lock);
+            if (page_cache_mark_dirty(key))
+                fm->dirty++;
+            spinlock_unlock(&fm->lock, ints);
+            filemap_count(&filemap_stats.write_errors);
+            ret = -1;
+        } else {
+            filemap_count(&filemap_stats.written);
+        }
+        page_cache_release(key);
+    }
+    mutex_unlock(&fm->io);
+    kfree(buf, PAGE_SIZE);
+    return ret;
+}
+
+// one pass over every mapped file, each one is pinned while its pages go out
+void filemap_writeback_all(void) {
+    filemap_t* fm = NULL;
+    for (;;) {
+        bool ints = spinlock(&filemap_lock);
+        filemap_t* next = fm ? fm->next : filemap_list;
+        if (next)
+            next->users++;
+        spinlock_unlock(&filemap_lock, ints);
+
+        if (fm)
+            filemap_put(fm);
+        if (!next)
+            break;
+        if (next->dirty)
+            filemap_writeback(next);
+        fm = next;
+    }
+}
+
+static void filemap_thread(void) {
+    for (;;) {
+        filemap_writeback_all();
+        sched_thread_sleep(FILEMAP_WRITEBACK_MS);
+    }
+}
+
+void filemap_start(void) {
+    if (!sched_create_kernel_thread(filemap_thread, 1, "filemap"))
+        log("filemap: failed to start writeback thread\n", RED);
+}
+
+void filemap_get_stats(filemap_stats_t* out) {
+    if (!out)
+        return;
+    bool ints = spinlock(&filemap_lock);
+    *out = filemap_stats;
+    spinlock_unlock(&filemap_lock, ints);
+}
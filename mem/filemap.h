@@ -0,0 +1,51 @@
+#ifndef FILEMAP_H
+#define FILEMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../task/sync/spinlock.h"
+#include "../task/sync/mutex.h"
+
+struct vfs_node;
+struct vfs_mountpoint;
+
+// file mappings: pages live in the page cache under (file id, page index) and are
+// only read in when a mapping faults on them, MAP_SHARED pages are written back
+#define FILEMAP_WRITEBACK_MS 500
+#define FILEMAP_SIZE_UNKNOWN 0xFFFFFFFF
+
+typedef struct filemap {
+    struct vfs_mountpoint* mp;
+    uint32_t ino;           // 0 if the filesystem has no inode numbers, the file is not shared between opens then
+    struct vfs_node* node;  // own handle for page-ins and writeback, the mapper may close its fd
+    uint32_t id;            // upper half of the page cache key, never reused
+    uint32_t users;         // lazy ranges backed by this file
+    uint32_t pages;         // one past the highest page faulted in
+    uint32_t dirty;         // pages waiting for writeback
+    uint32_t size;          // end of file as seen by page-ins, writeback never extends the file past it
+    mutex_t io;             // page-ins and writeback of this file, held across the file i/o
+    spinlock_t lock;        // dirty count, taken by faults that cannot wait on io
+    struct filemap* next;
+} filemap_t;
+
+typedef struct filemap_stats {
+    uint32_t page_ins;     // pages read from a file into the cache
+    uint32_t hits;         // faults served by a page that was already cached
+    uint32_t readahead;    // pages read in ahead of a fault
+    uint32_t written;      // dirty pages written back
+    uint32_t write_errors; // left dirty for the next pass
+} filemap_stats_t;
+
+filemap_t* filemap_get(struct vfs_node* node, bool writable);
+void filemap_dup(filemap_t* fm);
+void filemap_put(filemap_t* fm);
+uintptr_t filemap_page(filemap_t* fm, uint32_t pgoff, uint32_t readahead);
+void filemap_readahead(filemap_t* fm, uint32_t pgoff, uint32_t count);
+void filemap_mark_dirty(filemap_t* fm, uint32_t pgoff);
+int filemap_writeback(filemap_t* fm);
+void filemap_writeback_all(void);
+void filemap_start(void);
+void filemap_get_stats(filemap_stats_t* out);
+
+#endif // FILEMAP_H
@@ -0,0 +1,362 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "gaptree.h"
+#include "alloc.h"
+
+static inline int gap_height(gap_node_t* n) {
+    return n ? n->height : 0;
+}
+
+// recompute the summary of n from its children
+static void gap_update(gap_node_t* n) {
+    gap_node_t* l = n->left;
+    gap_node_t* r = n->right;
+    uintptr_t sum = 0, max = 0;
+
+    n->lo = l ? l->lo : n->start;
+    n->hi = r ? r->hi : n->end;
+    if (l) {
+        uintptr_t g = n->start - l->hi;
+        sum += l->gap_sum + g;
+        max = l->max_gap > g ? l->max_gap : g;
+    }
+    if (r) {
+        uintptr_t g = r->lo - n->end;
+        sum += r->gap_sum + g;
+        if (r->max_gap > max)
+            max = r->max_gap;
+        if (g > max)
+            max = g;
+    }
+    n->gap_sum = sum;
+    n->max_gap = max;
+    int hl = gap_height(l), hr = gap_height(r);
+    n->height = (hl > hr ? hl : hr) + 1;
+}
+
+static gap_node_t* gap_rotate_right(gap_node_t* n) {
+    gap_node_t* l = n->left;
+    n->left = l->right;
+    l->right = n;
+    gap_update(n);
+    gap_update(l);
+    return l;
+}
+
+static gap_node_t* gap_rotate_left(gap_node_t* n) {
+    gap_node_t* r = n->right;
+    n->right = r->left;
+    r->left = n;
+    gap_update(n);
+    gap_update(r);
+    return r;
+}
+
+static gap_node_t* gap_balance(gap_node_t* n) {
+    gap_update(n);
+    int bal = gap_height(n->left) - gap_height(n->right);
+    if (bal > 1) {
+        if (gap_height(n->left->left) < gap_height(n->left->right))
+            n->left = gap_rotate_left(n->left);
+        return gap_rotate_right(n);
+    }
+    if (bal < -1) {
+        if (gap_height(n->right->right) < gap_height(n->right->left))
+            n->right = gap_rotate_right(n->right);
+        return gap_rotate_left(n);
+    }
+    return n;
+}
+
+static gap_node_t* gap_insert(gap_node_t* n, gap_node_t* node, bool* overlap) {
+    if (!n)
+        return node;
+    if (node->end <= n->start)
+        n->left = gap_insert(n->left, node, overlap);
+    else if (node->start >= n->end)
+        n->right = gap_insert(n->right, node, overlap);
+    else
+        *overlap = true;
+    return gap_balance(n);
+}
+
+static gap_node_t* gap_take_min(gap_node_t* n, gap_node_t** min) {
+    if (!n->left) {
+        *min = n;
+        return n->right;
+    }
+    n->left = gap_take_min(n->left, min);
+    return gap_balance(n);
+}
+
+static gap_node_t* gap_remove(gap_node_t* n, uintptr_t start, gap_node_t** removed) {
+    if (!n)
+        return NULL;
+    if (start < n->start) {
+        n->left = gap_remove(n->left, start, removed);
+    } else if (start > n->start) {
+        n->right = gap_remove(n->right, start, removed);
+    } else {
+        *removed = n;
+        if (!n->left || !n->right)
+            return n->left ? n->left : n->right;
+        gap_node_t* succ;
+        gap_node_t* right = gap_take_min(n->right, &succ);
+        succ->left = n->left;
+        succ->right = right;
+        n = succ;
+    }
+    return gap_balance(n);
+}
+
+static void gap_free_all(gap_node_t* n) {
+    while (n) {
+        gap_free_all(n->left);
+        gap_node_t* right = n->right;
+        kfree(n, sizeof(gap_node_t));
+        n = right;
+    }
+}
+
+void gap_tree_init(gap_tree_t* tree, uintptr_t base, uintptr_t limit) {
+    tree->root = NULL;
+    tree->base = base;
+    tree->limit = limit;
+    tree->count = 0;
+}
+
+void gap_tree_clear(gap_tree_t* tree) {
+    gap_free_all(tree->root);
+    tree->root = NULL;
+    tree->count = 0;
+}
+
+// record [start, end) as allocated, fails if it leaves the tree's space or overlaps
+int gap_tree_insert(gap_tree_t* tree, uintptr_t start, uintptr_t end) {
+    if (start >= end || start < tree->base || end > tree->limit)
+        return -1;
+
+    gap_node_t* node = (gap_node_t*) kmalloc(sizeof(gap_node_t));
+    if (!node)
+        return -1;
+    node->start = start;
+    node->end = end;
+    node->left = NULL;
+    node->right = NULL;
+    gap_update(node);
+
+    bool overlap = false;
+    tree->root = gap_insert(tree->root, node, &overlap);
+    if (overlap) {
+        kfree(node, sizeof(gap_node_t));
+        return -1;
+    }
+    tree->count++;
+    return 0;
+}
+
+// forget the allocation starting at start, its end goes to end_out
+int gap_tree_remove(gap_tree_t* tree, uintptr_t start, uintptr_t* end_out) {
+    gap_node_t* removed = NULL;
+    tree->root = gap_remove(tree->root, start, &removed);
+    if (!removed)
+        return -1;
+    if (end_out)
+        *end_out = removed->end;
+    kfree(removed, sizeof(gap_node_t));
+    tree->count--;
+    return 0;
+}
+
+uintptr_t gap_tree_free_bytes(gap_tree_t* tree) {
+    gap_node_t* root = tree->root;
+    if (!root)
+        return tree->limit - tree->base;
+    return (root->lo - tree->base) + root->gap_sum + (tree->limit - root->hi);
+}
+
+// the hole holding free byte number off, counting holes from the bottom
+static void gap_locate(gap_tree_t* tree, uintptr_t off, uintptr_t* gs, uintptr_t* ge) {
+    gap_node_t* n = tree->root;
+    if (!n) {
+        *gs = tree->base;
+        *ge = tree->limit;
+        return;
+    }
+    if (off < n->lo - tree->base) {
+        *gs = tree->base;
+        *ge = n->lo;
+        return;
+    }
+    off -= n->lo - tree->base;
+    if (off >= n->gap_sum) {
+        *gs = n->hi;
+        *ge = tree->limit;
+        return;
+    }
+
+    // off < n->gap_sum from here on, so the hole is inside n's subtree
+    for (;;) {
+        gap_node_t* l = n->left;
+        gap_node_t* r = n->right;
+        if (l) {
+            if (off < l->gap_sum) {
+                n = l;
+                continue;
+            }
+            off -= l->gap_sum;
+            uintptr_t g = n->start - l->hi;
+            if (off < g) {
+                *gs = l->hi;
+                *ge = n->start;
+                return;
+            }
+            off -= g;
+        }
+        uintptr_t g = r->lo - n->end;
+        if (off < g) {
+            *gs = n->end;
+            *ge = r->lo;
+            return;
+        }
+        off -= g;
+        n = r;
+    }
+}
+
+// lowest hole of at least need bytes, edges of the space included
+static bool gap_find(gap_tree_t* tree, uintptr_t need, uintptr_t* gs, uintptr_t* ge) {
+    gap_node_t* n = tree->root;
+    if (!n) {
+        *gs = tree->base;
+        *ge = tree->limit;
+        return tree->limit - tree->base >= need;
+    }
+    if (n->lo - tree->base >= need) {
+        *gs = tree->base;
+        *ge = n->lo;
+        return true;
+    }
+
+    while (n && n->max_gap >= need) {
+        gap_node_t* l = n->left;
+        gap_node_t* r = n->right;
+        if (l && l->max_gap >= need) {
+            n = l;
+            continue;
+        }
+        if (l && n->start - l->hi >= need) {
+            *gs = l->hi;
+            *ge = n->start;
+            return true;
+        }
+        if (r && r->lo - n->end >= need) {
+            *gs = n->end;
+            *ge = r->lo;
+            return true;
+        }
+        n = r;
+    }
+
+    n = tree->root;
+    if (tree->limit - n->hi >= need) {
+        *gs = n->hi;
+        *ge = tree->limit;
+        return true;
+    }
+    return false;
+}
+
+// random aligned start for size bytes inside [gs, ge), 0 if it does not fit
+static uintptr_t gap_place(uintptr_t gs, uintptr_t ge, size_t size, size_t align, uint32_t (*rand)(void)) {
+    uint64_t aligned = ((uint64_t) gs + align - 1) & ~((uint64_t) align - 1);
+    if (aligned + size > ge)
+        return 0;
+    uintptr_t first = (uintptr_t) aligned;
+    uint32_t slots = (ge - size - first) / align + 1;
+    return first + (rand() % slots) * align;
+}
+
+typedef struct {
+    uintptr_t from;
+    size_t size;
+    size_t align;
+    uintptr_t prev; // end of the allocation before the hole being looked at
+    uintptr_t found;
+} gap_fit_t;
+
+static bool gap_fit_hole(gap_fit_t* fit, uintptr_t gs, uintptr_t ge) {
+    if (gs < fit->from)
+        gs = fit->from;
+    if (ge <= gs)
+        return false;
+    uint64_t aligned = ((uint64_t) gs + fit->align - 1) & ~((uint64_t) fit->align - 1);
+    if (aligned + fit->size > ge)
+        return false;
+    fit->found = (uintptr_t) aligned;
+    return true;
+}
+
+// holes in address order, subtrees that end below from are skipped whole
+static bool gap_fit_walk(gap_node_t* n, gap_fit_t* fit) {
+    if (!n)
+        return false;
+    if (n->hi <= fit->from) {
+        fit->prev = n->hi;
+        return false;
+    }
+    if (gap_fit_walk(n->left, fit) || gap_fit_hole(fit, fit->prev, n->start))
+        return true;
+    fit->prev = n->end;
+    return gap_fit_walk(n->right, fit);
+}
+
+uintptr_t gap_tree_first_fit(gap_tree_t* tree, uintptr_t from, size_t size, size_t align) {
+    if (!size || !align || (align & (align - 1)))
+        return 0;
+    gap_fit_t fit = {.from = from, .size = size, .align = align, .prev = tree->base, .found = 0};
+    if (gap_fit_walk(tree->root, &fit) || gap_fit_hole(&fit, fit.prev, tree->limit))
+        return fit.found;
+    return 0;
+}
+
+uintptr_t gap_tree_pick(gap_tree_t* tree, size_t size, size_t align, uint32_t (*rand)(void)) {
+    if (!size || !align || (align & (align - 1)))
+        return 0;
+    uintptr_t free = gap_tree_free_bytes(tree);
+    if (free < size)
+        return 0;
+
+    // a free byte drawn uniformly lands in each hole in proportion to its size,
+    // holes too small for the request are drawn again a bounded number of times
+    for (int probe = 0; probe < GAP_TREE_PROBES; probe++) {
+        uintptr_t off = ((uint64_t) rand() * free) >> 32;
+        uintptr_t gs, ge;
+        gap_locate(tree, off, &gs, &ge);
+        uintptr_t va = gap_place(gs, ge, size, align, rand);
+        if (va)
+            return va;
+    }
+
+    // mostly full, any hole that is sure to fit the aligned request
+    uint64_t need = (uint64_t) size + align - 1;
+    uintptr_t gs, ge;
+    if (need > free || !gap_find(tree, (uintptr_t) need, &gs, &ge))
+        return 0;
+    return gap_place(gs, ge, size, align, rand);
+}
@@ -0,0 +1,44 @@
+#ifndef GAPTREE_H
+#define GAPTREE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// balanced tree of allocated ranges inside [base, limit), every node also knows the
+// holes between the allocations below it so a free spot can be picked without a scan
+#define GAP_TREE_PROBES 8 // random draws before falling back to the first hole that fits
+
+typedef struct gap_node {
+    uintptr_t start;   // allocation [start, end)
+    uintptr_t end;
+    uintptr_t lo;      // first start in the subtree
+    uintptr_t hi;      // last end in the subtree
+    uintptr_t max_gap; // largest hole between allocations in the subtree
+    uintptr_t gap_sum; // all holes between allocations in the subtree
+    struct gap_node* left;
+    struct gap_node* right;
+    int height;
+} gap_node_t;
+
+typedef struct gap_tree {
+    gap_node_t* root;
+    uintptr_t base;  // first usable address
+    uintptr_t limit; // one past the last usable address
+    size_t count;
+} gap_tree_t;
+
+void gap_tree_init(gap_tree_t* tree, uintptr_t base, uintptr_t limit);
+void gap_tree_clear(gap_tree_t* tree);
+int gap_tree_insert(gap_tree_t* tree, uintptr_t start, uintptr_t end);
+int gap_tree_remove(gap_tree_t* tree, uintptr_t start, uintptr_t* end_out);
+uintptr_t gap_tree_free_bytes(gap_tree_t* tree);
+
+// random align-aligned start of size free bytes, about uniform over all the free space
+// returns 0 if no hole is big enough
+uintptr_t gap_tree_pick(gap_tree_t* tree, size_t size, size_t align, uint32_t (*rand)(void));
+
+// lowest align-aligned start at or above from with size free bytes, 0 if there is none
+uintptr_t gap_tree_first_fit(gap_tree_t* tree, uintptr_t from, size_t size, size_t align);
+
+#endif // GAPTREE_H
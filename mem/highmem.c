@@ -0,0 +1,122 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "highmem.h"
+#include "vmm.h"
+#include "tlb.h"
+#include "utils.h"
+#include "paging.h"
+#include "../lib/logging.h"
+#include "../interrupts/interrupts.h"
+
+static uint8_t kmap_depth[CONFIG_MAX_CPUS];
+static bool kmap_ints[CONFIG_MAX_CPUS][KMAP_SLOTS_PER_CPU];
+static bool kmap_ready = false;
+
+// the slot table is part of the kernel image, so it sits in the identity map and needs no
+// cleared frame to set up. page table pages themselves are cleared through it
+static uint32_t kmap_pt[PAGE_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+
+static inline int kmap_cpu(void) {
+    int cpu = tlb_this_cpu();
+    if (cpu < 0 || cpu >= CONFIG_MAX_CPUS)
+        cpu = 0;
+    return cpu;
+}
+
+// the page table behind the slots is a kernel one, so every directory made after this shares it
+// has to run before anything allocates a frame that is only reached through kmap_atomic
+int highmem_init(void) {
+    if (CONFIG_MAX_CPUS * KMAP_SLOTS_PER_CPU > PAGE_ENTRIES) {
+        log("highmem: too many kmap slots for one page table\n", RED);
+        return -1;
+    }
+    if (vmm_install_kernel_pt(KMAP_BASE, (uintptr_t) kmap_pt) < 0) {
+        log("highmem: failed to set up kmap slots\n", RED);
+        return -1;
+    }
+    kmap_ready = true;
+    return 0;
+}
+
+void* kmap_atomic(uintptr_t pa) {
+    if (pa < HIGHMEM_START)
+        return (void*) pa;
+    if (!kmap_ready)
+        return NULL;
+
+    bool ints = IA32_INT_ENABLED();
+    __asm__ volatile("cli");
+    int cpu = kmap_cpu();
+    uint32_t depth = kmap_depth[cpu];
+    if (depth >= KMAP_SLOTS_PER_CPU) {
+        log("highmem: kmap slots exhausted\n", RED);
+        if (ints)
+            __asm__ volatile("sti");
+        return NULL;
+    }
+    kmap_ints[cpu][depth] = ints;
+    kmap_depth[cpu] = depth + 1;
+
+    // slots belong to one cpu and interrupts are off, a local invlpg is enough
+    uint32_t slot = cpu * KMAP_SLOTS_PER_CPU + depth;
+    uintptr_t va = KMAP_BASE + slot * PAGE_SIZE;
+    kmap_pt[slot] = (pa & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
+    invlpg((void*) va);
+    return (void*) (va | (pa & ~PAGE_MASK));
+}
+
+void kunmap_atomic(void* addr) {
+    uintptr_t va = (uintptr_t) addr & PAGE_MASK;
+    if (va < KMAP_BASE || va >= KMAP_BASE + LARGE_PAGE_SIZE)
+        return; // came straight from the physical address
+
+    int cpu = kmap_cpu();
+    uint32_t slot = (va - KMAP_BASE) / PAGE_SIZE;
+    if (!kmap_depth[cpu] || slot != cpu * KMAP_SLOTS_PER_CPU + kmap_depth[cpu] - 1) {
+        log("highmem: kunmap_atomic out of order\n", RED);
+        return;
+    }
+
+    uint32_t depth = --kmap_depth[cpu];
+    kmap_pt[slot] = 0;
+    invlpg((void*) va);
+    if (kmap_ints[cpu][depth])
+        __asm__ volatile("sti");
+}
+
+int highmem_copy_page(uintptr_t dst, uintptr_t src) {
+    void* d = kmap_atomic(dst);
+    void* s = kmap_atomic(src);
+    int ret = d && s ? 0 : -1;
+    if (!ret)
+        flop_memcpy(d, s, PAGE_SIZE);
+    if (s)
+        kunmap_atomic(s);
+    if (d)
+        kunmap_atomic(d);
+    return ret;
+}
+
+int highmem_zero_page(uintptr_t pa) {
+    void* p = kmap_atomic(pa);
+    if (!p)
+        return -1;
+    flop_memset(p, 0, PAGE_SIZE);
+    kunmap_atomic(p);
+    return 0;
+}
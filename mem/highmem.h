@@ -0,0 +1,27 @@
+#ifndef HIGHMEM_H
+#define HIGHMEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "paging.h"
+
+// only the low identity map is shared by every directory, so a frame can be used through
+// its physical address only below it. frames from HIGHMEM_START up come from pmm_alloc_high_page
+// and go through per-cpu mapping slots
+#define HIGHMEM_START KERNEL_LOW_END
+#define KMAP_PDE 1021 // 0xFF400000, between the paging stack and the recursive slots
+#define KMAP_BASE ((uintptr_t) KMAP_PDE << 22)
+#define KMAP_SLOTS_PER_CPU 4 // nesting depth, a page copy needs two
+
+int highmem_init(void);
+
+// map a frame for a short time, interrupts stay off until the matching kunmap_atomic
+// unmaps have to come in reverse order of the maps on the same cpu
+void* kmap_atomic(uintptr_t pa);
+void kunmap_atomic(void* addr);
+
+// -1 if a frame could not be mapped, nothing was written then
+int highmem_copy_page(uintptr_t dst, uintptr_t src);
+int highmem_zero_page(uintptr_t pa);
+
+#endif // HIGHMEM_H
@@ -0,0 +1,385 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "ksm.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "tlb.h"
+#include "alloc.h"
+#include "utils.h"
+#include "paging.h"
+#include "highmem.h"
+#include "../lib/logging.h"
+#include "../task/sched.h"
+#include "../task/sync/spinlock.h"
+
+// merged frames, the table keeps one reference of its own on each
+typedef struct ksm_stable {
+    uint32_t hash;
+    uintptr_t pa;
+    struct ksm_stable* next;
+} ksm_stable_t;
+
+// pages seen once during the current pass, a second page with the same contents merges with it
+typedef struct ksm_unstable {
+    uint32_t hash;
+    vmm_region_t* region;
+    uintptr_t va;
+    uintptr_t pa;
+    struct ksm_unstable* next;
+} ksm_unstable_t;
+
+static ksm_stable_t* ksm_stable[KSM_HASH_BUCKETS];
+static ksm_unstable_t* ksm_unstable[KSM_HASH_BUCKETS];
+static spinlock_t ksm_lock = {0};
+
+static volatile int ksm_running = 1;
+static volatile uint32_t ksm_pages_to_scan = KSM_DEFAULT_PAGES_TO_SCAN;
+static volatile uint32_t ksm_sleep_ms = KSM_DEFAULT_SLEEP_MS;
+
+// where the last batch stopped, NULL starts a new pass at the head of the list
+// the region is looked up again before use, it may have been destroyed in between
+static vmm_region_t* ksm_cursor_region = NULL;
+static uintptr_t ksm_cursor_va = 0;
+static ksm_stats_t ksm_stats;
+
+// false if the frame could not be mapped, the page is skipped for this pass then
+static bool ksm_hash_page(uintptr_t pa, uint32_t* hash) {
+    const uint32_t* words = (const uint32_t*) kmap_atomic(pa);
+    if (!words)
+        return false;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++)
+        h = (h ^ words[i]) * 16777619u;
+    kunmap_atomic((void*) words);
+    *hash = h;
+    return true;
+}
+
+static bool ksm_same(uintptr_t a, uintptr_t b) {
+    void* pa = kmap_atomic(a);
+    void* pb = kmap_atomic(b);
+    bool same = pa && pb && flop_memcmp(pa, pb, PAGE_SIZE) == 0;
+    if (pb)
+        kunmap_atomic(pb);
+    if (pa)
+        kunmap_atomic(pa);
+    return same;
+}
+
+static ksm_stable_t* ksm_stable_find(uint32_t hash, uintptr_t pa) {
+    for (ksm_stable_t* node = ksm_stable[hash % KSM_HASH_BUCKETS]; node; node = node->next) {
+        if (node->hash == hash && node->pa != pa && ksm_same(node->pa, pa))
+            return node;
+    }
+    return NULL;
+}
+
+// node comes from the caller, nothing is allocated under ksm_lock
+static ksm_stable_t* ksm_stable_insert(ksm_stable_t* node, uint32_t hash, uintptr_t pa) {
+    pmm_page_ref(pa);
+    node->hash = hash;
+    node->pa = pa;
+    node->next = ksm_stable[hash % KSM_HASH_BUCKETS];
+    ksm_stable[hash % KSM_HASH_BUCKETS] = node;
+    return node;
+}
+
+// merged frames whose last user went away (cow break, unmap, exit) only have the table's reference
+static void ksm_stable_prune(void) {
+    for (int b = 0; b < KSM_HASH_BUCKETS; b++) {
+        ksm_stable_t** link = &ksm_stable[b];
+        while (*link) {
+            ksm_stable_t* node = *link;
+            if (pmm_page_refcount(node->pa) > 1) {
+                link = &node->next;
+                continue;
+            }
+            *link = node->next;
+            vmm_free_frame(node->pa);
+            kfree(node, sizeof(ksm_stable_t));
+        }
+    }
+}
+
+static void ksm_unstable_clear(void) {
+    for (int b = 0; b < KSM_HASH_BUCKETS; b++) {
+        while (ksm_unstable[b]) {
+            ksm_unstable_t* entry = ksm_unstable[b];
+            ksm_unstable[b] = entry->next;
+            kfree(entry, sizeof(ksm_unstable_t));
+        }
+    }
+}
+
+// takes the entry out of the table, the caller frees it
+static ksm_unstable_t* ksm_unstable_take(uint32_t hash, uintptr_t pa) {
+    for (ksm_unstable_t** link = &ksm_unstable[hash % KSM_HASH_BUCKETS]; *link; link = &(*link)->next) {
+        ksm_unstable_t* entry = *link;
+        if (entry->hash == hash && entry->pa != pa) {
+            *link = entry->next;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void ksm_unstable_insert(ksm_unstable_t* entry, uint32_t hash, vmm_region_t* region, uintptr_t va, uintptr_t pa) {
+    entry->hash = hash;
+    entry->region = region;
+    entry->va = va;
+    entry->pa = pa;
+    entry->next = ksm_unstable[hash % KSM_HASH_BUCKETS];
+    ksm_unstable[hash % KSM_HASH_BUCKETS] = entry;
+}
+
+// private anonymous pages only, shared memory and frames with other users are left alone
+static inline bool ksm_candidate(uint32_t pte) {
+    uintptr_t pa = pte & PAGE_MASK;
+    return (pte & PAGE_PRESENT) && (pte & PAGE_USER) && !(pte & PAGE_SHARED) && !vmm_is_zero_page(pa) &&
+           pmm_page_refcount(pa) == 1;
+}
+
+// write protect the pte first so the page cannot change under the comparison
+static void ksm_write_protect(vmm_region_t* region, uintptr_t va, uint32_t* pte) {
+    if (!(*pte & PAGE_RW))
+        return;
+    *pte = (*pte & ~PAGE_RW) | PAGE_COW;
+    tlb_flush_range(region, va, 1);
+}
+
+// point the pte at the merged frame kpa, the old frame is freed
+// a page that changed before it was protected just stays cow on its own frame
+static bool ksm_merge(vmm_region_t* region, uintptr_t va, uint32_t* pte, uintptr_t kpa) {
+    ksm_write_protect(region, va, pte);
+    uint32_t old = *pte;
+    uintptr_t pa = old & PAGE_MASK;
+    if (!ksm_same(pa, kpa))
+        return false;
+
+    pmm_page_ref(kpa);
+    *pte = kpa | (old & ~PAGE_MASK);
+    tlb_flush_range(region, va, 1);
+    pmm_rmap_move(pa, va, kpa, va, region);
+    vmm_free_frame(pa);
+    ksm_stats.merges++;
+    return true;
+}
+
+typedef struct {
+    uintptr_t va;
+    uintptr_t pa;
+    uint32_t* pte;
+} ksm_lookup_t;
+
+static int ksm_lookup_pte(vmm_region_t* region, uintptr_t va, uint32_t* pte, void* ctx) {
+    ksm_lookup_t* lookup = (ksm_lookup_t*) ctx;
+    if ((*pte & PAGE_MASK) == lookup->pa)
+        lookup->pte = pte;
+    return 1;
+}
+
+// the region an unstable entry was seen in may have been destroyed since
+static bool ksm_region_alive(vmm_region_t* region) {
+    for (vmm_region_t* it = vmm_region_list(); it; it = it->next) {
+        if (it == region)
+            return true;
+    }
+    return false;
+}
+
+// an unstable page became the merged copy, if it is still mapped where it was seen
+static ksm_stable_t* ksm_promote(ksm_unstable_t* entry, ksm_stable_t* node, uint32_t hash, uintptr_t pa) {
+    if (!ksm_region_alive(entry->region))
+        return NULL;
+
+    ksm_lookup_t lookup = {.va = entry->va, .pa = entry->pa, .pte = NULL};
+    vmm_walk_ops_t ops = {.pte_entry = ksm_lookup_pte, .large_entry = NULL, .ctx = &lookup};
+    vmm_walk(entry->region, entry->va, entry->va + PAGE_SIZE, &ops);
+    if (!lookup.pte || !ksm_candidate(*lookup.pte))
+        return NULL;
+
+    ksm_write_protect(entry->region, entry->va, lookup.pte);
+    uint32_t now;
+    if (!ksm_hash_page(entry->pa, &now) || now != hash || !ksm_same(entry->pa, pa))
+        return NULL;
+    return ksm_stable_insert(node, hash, entry->pa);
+}
+
+// spare table entries are allocated before ksm_lock is taken and carried over between pages
+typedef struct {
+    size_t budget;
+    size_t scanned;
+    uintptr_t stop_va;
+    bool stopped;
+    ksm_stable_t* spare_stable;
+    ksm_unstable_t* spare_unstable;
+} ksm_scan_walk_t;
+
+static int ksm_scan_pte(vmm_region_t* region, uintptr_t va, uint32_t* pte, void* ctx) {
+    ksm_scan_walk_t* walk = (ksm_scan_walk_t*) ctx;
+    if (walk->scanned >= walk->budget) {
+        walk->stop_va = va;
+        walk->stopped = true;
+        return 1;
+    }
+    walk->scanned++;
+
+    if (!ksm_candidate(*pte))
+        return 0;
+
+    if (!walk->spare_stable)
+        walk->spare_stable = (ksm_stable_t*) kmalloc(sizeof(ksm_stable_t));
+    if (!walk->spare_unstable)
+        walk->spare_unstable = (ksm_unstable_t*) kmalloc(sizeof(ksm_unstable_t));
+    if (!walk->spare_stable || !walk->spare_unstable)
+        return 0;
+
+    uintptr_t pa = *pte & PAGE_MASK;
+    uint32_t hash;
+    if (!ksm_hash_page(pa, &hash))
+        return 0;
+
+    // the tables are locked for this one page only
+    bool ints = spinlock(&ksm_lock);
+    ksm_stable_t* stable = ksm_stable_find(hash, pa);
+    if (stable) {
+        ksm_merge(region, va, pte, stable->pa);
+        spinlock_unlock(&ksm_lock, ints);
+        return 0;
+    }
+
+    ksm_unstable_t* twin = ksm_unstable_take(hash, pa);
+    if (twin) {
+        stable = ksm_promote(twin, walk->spare_stable, hash, pa);
+        if (stable)
+            walk->spare_stable = NULL;
+    }
+    if (stable) {
+        ksm_merge(region, va, pte, stable->pa);
+    } else {
+        ksm_unstable_insert(walk->spare_unstable, hash, region, va, pa);
+        walk->spare_unstable = NULL;
+    }
+    spinlock_unlock(&ksm_lock, ints);
+
+    if (twin)
+        kfree(twin, sizeof(ksm_unstable_t));
+    return 0;
+}
+
+// scan up to pages ptes from where the last call stopped, returns how many were looked at
+// ksm_lock is only held per page and at the end of a pass, never across the batch
+size_t ksm_scan(size_t pages) {
+    if (!pages)
+        return 0;
+
+    ksm_scan_walk_t walk = {.budget = pages,
+                            .scanned = 0,
+                            .stop_va = 0,
+                            .stopped = false,
+                            .spare_stable = NULL,
+                            .spare_unstable = NULL};
+
+    // a cursor region that went away ends the pass early
+    bool ints = spinlock(&ksm_lock);
+    vmm_region_t* region = vmm_region_list();
+    if (ksm_cursor_region)
+        region = ksm_region_alive(ksm_cursor_region) ? ksm_cursor_region : NULL;
+    uintptr_t va = region ? ksm_cursor_va : 0;
+    spinlock_unlock(&ksm_lock, ints);
+
+    while (walk.scanned < walk.budget) {
+        if (!region) {
+            // end of a full pass, everything not merged by now starts over
+            ints = spinlock(&ksm_lock);
+            ksm_unstable_clear();
+            ksm_stable_prune();
+            ksm_stats.full_scans++;
+            spinlock_unlock(&ksm_lock, ints);
+            va = 0;
+            break;
+        }
+
+        vmm_walk_ops_t ops = {.pte_entry = ksm_scan_pte, .large_entry = NULL, .ctx = &walk};
+        vmm_walk(region, va, KERNEL_VIRT_BASE, &ops);
+        if (walk.stopped) {
+            va = walk.stop_va;
+            break;
+        }
+        region = region->next;
+        va = 0;
+    }
+
+    ints = spinlock(&ksm_lock);
+    ksm_cursor_region = region;
+    ksm_cursor_va = va;
+    ksm_stats.pages_scanned += walk.scanned;
+    spinlock_unlock(&ksm_lock, ints);
+
+    if (walk.spare_stable)
+        kfree(walk.spare_stable, sizeof(ksm_stable_t));
+    if (walk.spare_unstable)
+        kfree(walk.spare_unstable, sizeof(ksm_unstable_t));
+    return walk.scanned;
+}
+
+static void ksm_thread(void) {
+    for (;;) {
+        if (ksm_running)
+            ksm_scan(ksm_pages_to_scan);
+        sched_thread_sleep(ksm_sleep_ms);
+    }
+}
+
+void ksm_start(void) {
+    if (!sched_create_kernel_thread(ksm_thread, 1, "ksm"))
+        log("ksm: failed to start scanner thread\n", RED);
+}
+
+void ksm_set_running(int run) {
+    ksm_running = run;
+}
+
+// pages looked at per wakeup and how long the scanner sleeps in between
+void ksm_set_scan_rate(uint32_t pages_to_scan, uint32_t sleep_ms) {
+    if (pages_to_scan)
+        ksm_pages_to_scan = pages_to_scan;
+    if (sleep_ms)
+        ksm_sleep_ms = sleep_ms;
+}
+
+void ksm_get_stats(ksm_stats_t* out) {
+    if (!out)
+        return;
+
+    bool ints = spinlock(&ksm_lock);
+    ksm_stats.pages_shared = 0;
+    ksm_stats.pages_saved = 0;
+    for (int b = 0; b < KSM_HASH_BUCKETS; b++) {
+        for (ksm_stable_t* node = ksm_stable[b]; node; node = node->next) {
+            // one reference is the table's own
+            uint32_t users = pmm_page_refcount(node->pa) - 1;
+            if (!users)
+                continue;
+            ksm_stats.pages_shared++;
+            ksm_stats.pages_saved += users - 1;
+        }
+    }
+    *out = ksm_stats;
+    spinlock_unlock(&ksm_lock, ints);
+}
@@ -0,0 +1,28 @@
+#ifndef KSM_H
+#define KSM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "vmm.h"
+
+// same-page merging: identical private anonymous pages are folded into one
+// read-only copy-on-write frame by a background scanner
+#define KSM_HASH_BUCKETS 256
+#define KSM_DEFAULT_PAGES_TO_SCAN 100
+#define KSM_DEFAULT_SLEEP_MS 20
+
+typedef struct ksm_stats {
+    uint32_t pages_shared;  // merged frames that still have users
+    uint32_t pages_saved;   // ptes pointing at a merged frame beyond the first, frames given back
+    uint32_t merges;        // ptes switched to a merged frame since boot
+    uint32_t pages_scanned;
+    uint32_t full_scans;
+} ksm_stats_t;
+
+void ksm_start(void);
+void ksm_set_running(int run);
+void ksm_set_scan_rate(uint32_t pages_to_scan, uint32_t sleep_ms);
+size_t ksm_scan(size_t pages);
+void ksm_get_stats(ksm_stats_t* out);
+
+#endif // KSM_H
@@ -21,25 +21,15 @@ You should have received a copy of the GNU General Public License along with Flo
 #include "../drivers/vga/vgahandler.h"
 #include "../lib/logging.h"
 
-static inline uintptr_t kvirt_to_phys(void* v) {
-    uintptr_t va = (uintptr_t) v;
-    if (KERNEL_VIRT_BASE == 0)
-        return va;
-    if (va >= KERNEL_VIRT_BASE)
-        return va - KERNEL_VIRT_BASE;
-    return va;
-}
-
-static inline void* kphys_to_virt(uintptr_t p) {
-    if (KERNEL_VIRT_BASE == 0)
-        return (void*) p;
-    return (void*) (p + KERNEL_VIRT_BASE);
-}
-
 uint32_t* pg_dir = (uint32_t*) 0xFFFFF000;
 uint32_t* pg_tbls = (uint32_t*) 0xFFC00000;
 uint32_t* current_pg_dir = NULL;
 
+// set once cr4.pse is on, vmm only builds 4 MiB pdes after that
+static int paging_pse = 0;
+// set once cr4.pge is on, kernel mappings are then marked global
+static int paging_pge = 0;
+
 #define KERNEL_STACK_PAGING_ADDR 0xFF000000
 
 static inline uint32_t page_dir_index_from_va(uint32_t va) {
@@ -58,43 +48,76 @@ static void enable_paging(uint8_t enable_wp, uint8_t enable_pse) {
     uint32_t cr0;
     uint32_t cr4;
 
+    // the boot directory already has 4 MiB pdes, pse has to be on before paging is
+    if (enable_pse) {
+        __asm__ volatile("mov %%cr4, %0\n"
+                         "or %1, %0\n"
+                         "mov %0, %%cr4"
+                         : "=r"(cr4)
+                         : "r"(CR4_PSE_BIT)
+                         : "memory");
+        paging_pse = 1;
+    }
+
     __asm__ volatile("mov %%cr0, %0\n"
                      "or %1, %0\n"
                      "mov %0, %%cr0"
                      : "=r"(cr0)
                      : "r"(enable_wp ? 0x80010000 : 0x80000000) // 0x80010000 -> PG + WP
     );
+}
 
-    if (enable_pse) {
-        __asm__ volatile("mov %%cr0, %0\n"
-                         "or %1, %0\n"
-                         "mov %0, %%cr0"
-                         : "=r"(cr0)
-                         : "r"(enable_wp ? 0x80010000 : 0x80000000)
-                         : "memory");
-    }
+static uint32_t paging_cpuid_features(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return edx;
+}
+
+// cpuid leaf 1, edx bit 3
+static int paging_cpu_has_pse(void) {
+    return (paging_cpuid_features() >> 3) & 1;
+}
+
+// cpuid leaf 1, edx bit 13
+static int paging_cpu_has_pge(void) {
+    return (paging_cpuid_features() >> 13) & 1;
+}
+
+static void enable_global_pages(void) {
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0\n"
+                     "or %1, %0\n"
+                     "mov %0, %%cr4"
+                     : "=r"(cr4)
+                     : "r"(CR4_PGE_BIT)
+                     : "memory");
+    paging_pge = 1;
+}
+
+int paging_pse_enabled(void) {
+    return paging_pse;
+}
+
+int paging_pge_enabled(void) {
+    return paging_pge;
 }
 
 static void zero_area(void* area) {
     flop_memset(area, 0, TABLE_BYTES);
 }
 
+// the boot directory, paging is still off while it is built so frames are used by their physical address
 uint32_t* pd;
-uint32_t* pt0;
-uint32_t* pt1022;
-
-uintptr_t pt0_phys;
-uintptr_t pt1022_phys;
 uintptr_t pd_phys;
-uintptr_t new_pt_phys;
+uintptr_t pt1022_phys;
 
 static int paging_init_page_directory() {
-    uintptr_t pd_phys = (uintptr_t) pmm_alloc_page();
+    pd_phys = (uintptr_t) pmm_alloc_page();
     if (!pd_phys) {
         log("pmm_alloc_page failed for pd\n", RED);
         return -1;
     }
-    uint32_t* pd = (uint32_t*) kphys_to_virt(pd_phys);
+    pd = (uint32_t*) pd_phys;
     zero_area(pd);
     return 0;
 }
@@ -108,40 +131,47 @@ static int paging_alloc_and_zero_pt(uintptr_t* out_phys, uint32_t** out_virt, co
         return -1;
     }
 
-    *out_virt = (uint32_t*) kphys_to_virt(*out_phys);
+    *out_virt = (uint32_t*) *out_phys;
     zero_area(*out_virt);
     return 0;
 }
 
-static void paging_fill_identity_mapping(uint32_t* pt) {
+static void paging_fill_identity_mapping(uint32_t* pt, uintptr_t base, uint32_t flags) {
     for (uint32_t i = 0; i < PAGE_ENTRIES; ++i) {
-        pt[i] = (uint32_t) ((((uintptr_t) i * TABLE_BYTES) & PAGE_MASK) | PAGE_PRESENT | PAGE_RW);
+        pt[i] = (uint32_t) (((base + (uintptr_t) i * TABLE_BYTES) & PAGE_MASK) | flags);
     }
 }
 
-static int paging_init_first_page_table() {
-    uintptr_t pt0_phys = 0;
-    uint32_t* pt0 = NULL;
+// identity map the first KERNEL_LOW_PDES slots, the kernel image and everything it allocated so far
+// with pse every slot is one 4 MiB pde and no page table is needed. the map is the same in every
+// directory, so with pge it is global and survives address space switches in the tlb
+static int paging_init_low_identity(int large, int global) {
+    uint32_t flags = PAGE_PRESENT | PAGE_RW | (global ? PAGE_GLOBAL : 0);
+    for (uint32_t pdi = 0; pdi < KERNEL_LOW_PDES; pdi++) {
+        if (large) {
+            pd[pdi] = (uint32_t) ((uintptr_t) pdi << 22) | flags | PAGE_LARGE;
+            continue;
+        }
 
-    if (paging_alloc_and_zero_pt(&pt0_phys, &pt0, "pt0") < 0)
-        return -1;
+        uintptr_t pt_phys = 0;
+        uint32_t* pt = NULL;
 
-    paging_fill_identity_mapping(pt0);
+        if (paging_alloc_and_zero_pt(&pt_phys, &pt, "low identity pt") < 0)
+            return -1;
+
+        paging_fill_identity_mapping(pt, (uintptr_t) pdi << 22, flags);
+        pd[pdi] = (uint32_t) (pt_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
+    }
     return 0;
 }
 
 static int paging_init_recursive_page_table_slot() {
-    uintptr_t pt_phys = 0;
-    uint32_t* pt_virt = NULL;
-
-    if (paging_alloc_and_zero_pt(&pt_phys, &pt_virt, "pt1022") < 0)
-        return -1;
-
-    return 0;
+    uint32_t* pt1022 = NULL;
+    return paging_alloc_and_zero_pt(&pt1022_phys, &pt1022, "pt1022");
 }
 
 static int paging_init_page_tables() {
-    if (paging_init_first_page_table() < 0)
+    if (paging_init_low_identity(paging_cpu_has_pse(), paging_cpu_has_pge()) < 0)
         return -1;
 
     if (paging_init_recursive_page_table_slot() < 0)
@@ -152,8 +182,7 @@ static int paging_init_page_tables() {
 
 static int paging_init_recursive_mapping() {
     pd[1022] = (uint32_t) (pt1022_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
-    uint32_t* pt1022 = (uint32_t*) kphys_to_virt(pt1022_phys);
-    zero_area(pt1022);
+    uint32_t* pt1022 = (uint32_t*) pt1022_phys;
     pd[1023] = (uint32_t) (pd_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
     pt1022[1023] = (uint32_t) (pd_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
     return 0;
@@ -192,7 +221,12 @@ void paging_init(void) {
     current_pg_dir = pd;
     load_pd(pd);
     log("page directory loaded\n", YELLOW);
-    enable_paging(0, 0);
+    // write protect is needed so kernel writes to read-only
+    // user pages (e.g. the shared zero page) fault as well
+    enable_paging(1, paging_cpu_has_pse());
+    // pge has to be turned on after paging, intel sdm 4.10.2.4
+    if (paging_cpu_has_pge())
+        enable_global_pages();
     log("paging enabled\n", YELLOW);
     int paging_setup_stack_status = paging_init_paging_stack();
     if (paging_setup_stack_status < 0) {
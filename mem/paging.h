@@ -12,19 +12,60 @@
 #define PAGE_PRESENT 0x1
 #define PAGE_RW 0x2
 #define PAGE_USER 0x4
+#define PAGE_PWT 0x8 // write-through
+#define PAGE_PCD 0x10 // not cached, for device registers
+#define PAGE_ACCESSED 0x20 // set by the cpu on any access, reclaim clears it
+#define PAGE_DIRTY 0x40 // set by the cpu on a write, madvise(FREE) clears it
+#define PAGE_COW 0x200 // avl bit, frame is shared until the next write
+#define PAGE_SHARED 0x400 // avl bit, frame belongs to a shared memory object and stays shared across fork
+#define PAGE_SWAPPED 0x800 // avl bit, not present pte holds a zram slot instead of a frame
+#define PAGE_LARGE 0x80 // pde maps a 4 MiB page directly (needs cr4.pse)
+#define CR4_PSE_BIT 0x10
+#define PAGE_GLOBAL 0x100 // kept in the tlb across cr3 loads (needs cr4.pge)
+#define CR4_PGE_BIT 0x80
 #define PAGE_PRESENT 0x1
 
 #define TABLE_BYTES 0x1000
 #define PAGE_ENTRIES 1024
 #define PAGE_MASK 0xFFFFF000
+#define LARGE_PAGE_SIZE 0x400000
+#define LARGE_PAGE_MASK 0xFFC00000
 
 #define KERNEL_VIRT_BASE 0xC0000000U
+#define KERNEL_PDE_START (KERNEL_VIRT_BASE >> 22)
+
+// the kernel is linked at 1 MiB and runs off an identity map of the first KERNEL_LOW_PDES
+// slots, its image, heap, stacks and boot frames live there. every directory shares
+// these pdes with the boot one, like the kernel half
+#define KERNEL_LOW_PDES 16
+#define KERNEL_LOW_END ((uintptr_t) KERNEL_LOW_PDES << 22)
 
 void paging_init(void);
 void load_pd(uint32_t* pd);
+int paging_pse_enabled(void);
+int paging_pge_enabled(void);
 
 static inline void invlpg(void* va) {
     asm volatile("invlpg (%0)" : : "a"(va));
 }
 
+// drop every non-global tlb entry by reloading cr3
+static inline void flush_tlb(void) {
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+// global entries survive a cr3 reload, toggling cr4.pge drops them too
+static inline void flush_tlb_all(void) {
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    if (!(cr4 & CR4_PGE_BIT)) {
+        flush_tlb();
+        return;
+    }
+    asm volatile("mov %0, %%cr4" : : "r"(cr4 & ~CR4_PGE_BIT) : "memory");
+    asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
 #endif
\ No newline at end of file
@@ -19,12 +19,24 @@ You should have received a copy of the GNU General Public License along with Flo
 #include "../lib/logging.h"
 #include "utils.h"
 #include "paging.h"
+#include "highmem.h"
 #include "pmm.h"
 #include "alloc.h"
+#include "../lib/cycles.h"
 #include <stdint.h>
+#include <stdatomic.h>
 
 struct buddy_allocator buddy;
 
+// frame addresses are 32 bit, the part of the memory map past this is counted but not used
+#define PMM_PHYS_LIMIT 0x100000000ULL
+static uint64_t pmm_above_limit_bytes = 0;
+
+// the free list a block at addr belongs on, a buddy is always on the same side as its pair
+static inline struct page** pmm_free_head(uintptr_t addr, uint32_t order) {
+    return addr >= HIGHMEM_START ? &buddy.high_free_list[order] : &buddy.free_list[order];
+}
+
 static void pmm_buddy_split(uintptr_t addr, uint32_t order) {
     if (order == 0) {
         log("pmm_buddy_split: order=0, nothing to split\n", YELLOW);
@@ -47,11 +59,12 @@ static void pmm_buddy_split(uintptr_t addr, uint32_t order) {
     page_one->is_free = 1;
     page_two->is_free = 1;
 
-    page_one->next = buddy.free_list[order - 1];
-    buddy.free_list[order - 1] = page_one;
+    struct page** head = pmm_free_head(addr, order - 1);
+    page_one->next = *head;
+    *head = page_one;
 
-    page_two->next = buddy.free_list[order - 1];
-    buddy.free_list[order - 1] = page_two;
+    page_two->next = *head;
+    *head = page_two;
 }
 
 static void pmm_buddy_merge(uintptr_t addr, uint32_t order) {
@@ -67,7 +80,7 @@ static void pmm_buddy_merge(uintptr_t addr, uint32_t order) {
 
     if (buddy_page && buddy_page->is_free && buddy_page->order == order) {
         // unlink buddy_page from its free list
-        struct page** prev = &buddy.free_list[order];
+        struct page** prev = pmm_free_head(buddy_addr, order);
         while (*prev && *prev != buddy_page) {
             prev = &(*prev)->next;
         }
@@ -82,8 +95,9 @@ static void pmm_buddy_merge(uintptr_t addr, uint32_t order) {
         // can't merge, put this block into its list
         page->order = order;
         page->is_free = 1;
-        page->next = buddy.free_list[order];
-        buddy.free_list[order] = page;
+        struct page** head = pmm_free_head(addr, order);
+        page->next = *head;
+        *head = page;
     }
 }
 
@@ -125,7 +139,7 @@ static uint8_t* pmm_mmap_next(multiboot_memory_map_t* entry) {
 }
 
 static bool pmm_region_usable(multiboot_memory_map_t* entry) {
-    return entry->type == MULTIBOOT_MEMORY_AVAILABLE && entry->addr >= 0x100000ULL;
+    return entry->type == MULTIBOOT_MEMORY_AVAILABLE && entry->addr >= 0x100000ULL && entry->addr < PMM_PHYS_LIMIT;
 }
 
 static uintptr_t pmm_align(uint32_t x) {
@@ -136,9 +150,12 @@ static uintptr_t pmm_region_start(multiboot_memory_map_t* entry) {
     return pmm_align((uintptr_t) entry->addr);
 }
 
+// clipped below 4 GiB, the sum used to wrap around and hand out low frames a second time
 static uintptr_t pmm_region_end(multiboot_memory_map_t* entry) {
-    uintptr_t end = (uintptr_t) entry->addr + (uintptr_t) entry->len;
-    return end & ~(PAGE_SIZE - 1);
+    uint64_t end = entry->addr + entry->len;
+    if (end > PMM_PHYS_LIMIT - PAGE_SIZE)
+        end = PMM_PHYS_LIMIT - PAGE_SIZE;
+    return (uintptr_t) end & ~(PAGE_SIZE - 1);
 }
 
 static uintptr_t pmm_reserved_top(multiboot_info_t* mb) {
@@ -198,8 +215,13 @@ static void pmm_add_free(struct page* page, uintptr_t addr) {
     page->address = addr;
     page->order = 0;
     page->is_free = 1;
-    page->next = buddy.free_list[0];
-    buddy.free_list[0] = page;
+    page->refcount = 0;
+    page->mapcount = 0;
+    page->rmap = NULL;
+    struct page** head = pmm_free_head(addr, 0);
+    page->next = *head;
+    *head = page;
+    buddy.free_pages++;
 }
 
 static bool pmm_addr_in_pageinfo(uintptr_t addr, uintptr_t s, uintptr_t entry) {
@@ -267,6 +289,7 @@ uint64_t pmm_count_usable_pages(multiboot_info_t* mb, uintptr_t* out_first_usabl
 
     uint64_t total_bytes = 0;
     uintptr_t first_usable = 0;
+    pmm_above_limit_bytes = 0;
 
     uint8_t* ptr = pmm_mmap_begin(mb);
     uint8_t* end = pmm_mmap_end(mb);
@@ -276,6 +299,11 @@ uint64_t pmm_count_usable_pages(multiboot_info_t* mb, uintptr_t* out_first_usabl
         if (!pmm_mmap_entry_valid(mm))
             break;
 
+        if (mm->type == MULTIBOOT_MEMORY_AVAILABLE && mm->addr + mm->len > PMM_PHYS_LIMIT) {
+            uint64_t from = mm->addr > PMM_PHYS_LIMIT ? mm->addr : PMM_PHYS_LIMIT;
+            pmm_above_limit_bytes += mm->addr + mm->len - from;
+        }
+
         if (pmm_region_usable(mm)) {
             uintptr_t rs = pmm_region_start(mm);
             uintptr_t re = pmm_region_end(mm);
@@ -356,6 +384,8 @@ void pmm_init(multiboot_info_t* mb_info) {
     log_uint("pmm: usable pages: ", usable_pages);
     log_uint("pmm: total memory bytes (from mmap): ", (uint32_t) (total_memory_bytes & 0xFFFFFFFFU));
     log_address("pmm: first usable addr: ", usable_start);
+    if (pmm_above_limit_bytes)
+        log_uint("pmm: MiB above 4 GiB left unused: ", (uint32_t) (pmm_above_limit_bytes >> 20));
 
     pmm_buddy_init(usable_pages, usable_start, mb_info);
 
@@ -392,17 +422,23 @@ void pmm_copy_page(void* dst, void* src) {
     spinlock_unlock(&buddy.lock, true);
 }
 
-static struct page* pmm_fetch_order_block(uint32_t order) {
+static struct page* pmm_fetch_from(struct page** lists, uint32_t order) {
     for (uint32_t j = order; j <= MAX_ORDER; j++) {
-        if (buddy.free_list[j]) {
-            struct page* blk = buddy.free_list[j];
-            buddy.free_list[j] = blk->next;
+        if (lists[j]) {
+            struct page* blk = lists[j];
+            lists[j] = blk->next;
             return blk;
         }
     }
     return NULL;
 }
 
+// high frames are used up first by whoever can take them, the low side is kept for the kernel
+static struct page* pmm_fetch_order_block(uint32_t order, bool high) {
+    struct page* blk = high ? pmm_fetch_from(buddy.high_free_list, order) : NULL;
+    return blk ? blk : pmm_fetch_from(buddy.free_list, order);
+}
+
 static void pmm_determine_split(struct page* blk, uint32_t from_order, uint32_t to_order) {
     while (from_order > to_order) {
         from_order--;
@@ -410,16 +446,21 @@ static void pmm_determine_split(struct page* blk, uint32_t from_order, uint32_t
     }
 }
 
-static void* pmm_alloc_block(uint32_t order) {
-    struct page* blk = pmm_fetch_order_block(order);
+static void* pmm_alloc_block(uint32_t order, bool high) {
+    struct page* blk = pmm_fetch_order_block(order, high);
     if (!blk)
         return NULL;
 
     blk->is_free = 0;
     blk->order = order;
+    buddy.free_pages -= 1u << order;
 
     pmm_determine_split(blk, blk->order, order);
 
+    // every frame in the block starts out with a single owner
+    for (uint32_t i = 0; i < (1u << order); i++)
+        blk[i].refcount = 1;
+
     return (void*) blk->address;
 }
 
@@ -429,10 +470,13 @@ static void pmm_free_block(uintptr_t addr, uint32_t order) {
         return;
 
     page->is_free = 1;
+    for (uint32_t i = 0; i < (1u << order) && page + i < buddy.page_info + buddy.total_pages; i++)
+        page[i].refcount = 0;
+    buddy.free_pages += 1u << order;
     pmm_buddy_merge(page->address, order);
 }
 
-void* pmm_alloc_pages(uint32_t order, uint32_t count) {
+static void* pmm_alloc_pages_from(uint32_t order, uint32_t count, bool high) {
     if (order > MAX_ORDER || count == 0)
         return NULL;
 
@@ -441,7 +485,7 @@ void* pmm_alloc_pages(uint32_t order, uint32_t count) {
     void* first_page = NULL;
     // allocate 'count' blocks of 'order' pages each
     for (uint32_t i = 0; i < count; i++) {
-        void* pg = pmm_alloc_block(order);
+        void* pg = pmm_alloc_block(order, high);
 
         if (!pg) {
             // rollback already-allocated pages
@@ -477,10 +521,21 @@ void pmm_free_pages(void* addr, uint32_t order, uint32_t count) {
     spinlock_unlock(&buddy.lock, true);
 }
 
+// below HIGHMEM_START, the kernel can use these through their physical address
+void* pmm_alloc_pages(uint32_t order, uint32_t count) {
+    return pmm_alloc_pages_from(order, count, false);
+}
+
 void* pmm_alloc_page(void) {
     return pmm_alloc_pages(0, 1);
 }
 
+// for frames that are only ever touched through kmap_atomic, user pages and the page cache
+// comes from above HIGHMEM_START while there is any, so the low side lasts for tables and the heap
+void* pmm_alloc_high_page(void) {
+    return pmm_alloc_pages_from(0, 1, true);
+}
+
 void pmm_free_page(void* addr) {
     pmm_free_pages(addr, 0, 1);
 }
@@ -493,16 +548,13 @@ uint32_t pmm_get_page_count() {
     return buddy.total_pages;
 }
 
+// read without the lock, a snapshot is all the reclaim watermarks need
+uint32_t pmm_get_free_page_count(void) {
+    return __atomic_load_n(&buddy.free_pages, __ATOMIC_RELAXED);
+}
+
 uint32_t pmm_get_free_memory_size(void) {
-    int free_pages = 0;
-    for (int i = 0; i <= MAX_ORDER; i++) {
-        struct page* page = buddy.free_list[i];
-        while (page) {
-            free_pages++;
-            page = page->next;
-        }
-    }
-    return free_pages * PAGE_SIZE;
+    return pmm_get_free_page_count() * PAGE_SIZE;
 }
 
 struct page* pmm_get_last_used_page(void) {
@@ -533,6 +585,242 @@ struct page* phys_to_page_index(uintptr_t addr) {
     return &buddy.page_info[index];
 }
 
+// frame refcounts, used for sharing frames between address spaces (cow)
+void pmm_page_ref(uintptr_t addr) {
+    struct page* page = phys_to_page_index(addr & ~(PAGE_SIZE - 1));
+    if (!page)
+        return;
+    atomic_fetch_add_explicit((atomic_uint*) &page->refcount, 1, memory_order_relaxed);
+}
+
+// drops a reference and returns how many are left, the caller frees at 0
+uint32_t pmm_page_unref(uintptr_t addr) {
+    struct page* page = phys_to_page_index(addr & ~(PAGE_SIZE - 1));
+    if (!page)
+        return 0;
+    uint32_t old = atomic_load_explicit((atomic_uint*) &page->refcount, memory_order_relaxed);
+    while (old) {
+        if (atomic_compare_exchange_weak_explicit((atomic_uint*) &page->refcount, &old, old - 1, memory_order_acq_rel,
+                                                  memory_order_relaxed))
+            return old - 1;
+    }
+    return 0;
+}
+
+uint32_t pmm_page_refcount(uintptr_t addr) {
+    struct page* page = phys_to_page_index(addr & ~(PAGE_SIZE - 1));
+    if (!page)
+        return 0;
+    return atomic_load_explicit((atomic_uint*) &page->refcount, memory_order_relaxed);
+}
+
+// reverse map, which (region, va) pairs map a frame
+// one lock for every chain, entries only change on map and unmap of user pages
+static spinlock_t rmap_lock = {0};
+static pmm_rmap_stats_t rmap_stats;
+
+// entries are carved out of page sized chunks and recycled through a free list, never given back
+// a remove followed by an add (cow, remap, swap in place) reuses the entry it just freed
+static pmm_rmap_t* rmap_free = NULL;
+
+// carve one more chunk into the free list, the allocation happens without the lock
+static int pmm_rmap_grow(void) {
+    pmm_rmap_t* chunk = (pmm_rmap_t*) kmalloc(PAGE_SIZE);
+    if (!chunk)
+        return -1;
+
+    bool ints = spinlock(&rmap_lock);
+    for (uint32_t i = 0; i < PMM_RMAP_PER_CHUNK; i++) {
+        chunk[i].next = rmap_free;
+        rmap_free = &chunk[i];
+    }
+    rmap_stats.spare += PMM_RMAP_PER_CHUNK;
+    spinlock_unlock(&rmap_lock, ints);
+    return 0;
+}
+
+// make sure count entries are spare before a batch of adds (fork copies a whole table at once)
+// other cpus can still take them, so the adds keep checking
+int pmm_rmap_reserve(uint32_t count) {
+    for (;;) {
+        bool ints = spinlock(&rmap_lock);
+        uint32_t spare = rmap_stats.spare;
+        spinlock_unlock(&rmap_lock, ints);
+
+        if (spare >= count)
+            return 0;
+        if (pmm_rmap_grow() < 0) {
+            atomic_fetch_add_explicit((atomic_uint*) &rmap_stats.failed, 1, memory_order_relaxed);
+            return -1;
+        }
+    }
+}
+
+// -1 when no entry could be had, the caller must not install the pte
+int pmm_rmap_add(uintptr_t addr, struct vmm_region* region, uintptr_t va) {
+    struct page* page = phys_to_page_index(addr & ~(PAGE_SIZE - 1));
+    if (!page)
+        return 0;
+
+    uint64_t start = cycles_now();
+    bool ints = spinlock(&rmap_lock);
+    while (!rmap_free) {
+        spinlock_unlock(&rmap_lock, ints);
+        if (pmm_rmap_grow() < 0) {
+            atomic_fetch_add_explicit((atomic_uint*) &rmap_stats.failed, 1, memory_order_relaxed);
+            return -1;
+        }
+        ints = spinlock(&rmap_lock);
+    }
+
+    pmm_rmap_t* entry = rmap_free;
+    rmap_free = entry->next;
+    rmap_stats.spare--;
+
+    entry->region = region;
+    entry->va = va & ~(PAGE_SIZE - 1);
+    entry->next = page->rmap;
+    page->rmap = entry;
+    page->mapcount++;
+    rmap_stats.adds++;
+    rmap_stats.entries++;
+    rmap_stats.add_cycles += cycles_now() - start;
+    spinlock_unlock(&rmap_lock, ints);
+    return 0;
+}
+
+void pmm_rmap_remove(uintptr_t addr, struct vmm_region* region, uintptr_t va) {
+    struct page* page = phys_to_page_index(addr & ~(PAGE_SIZE - 1));
+    if (!page || !page->rmap)
+        return;
+
+    uint64_t start = cycles_now();
+    va &= ~(PAGE_SIZE - 1);
+
+    bool ints = spinlock(&rmap_lock);
+    for (pmm_rmap_t** link = &page->rmap; *link; link = &(*link)->next) {
+        if ((*link)->region == region && (*link)->va == va) {
+            pmm_rmap_t* found = *link;
+            *link = found->next;
+            found->next = rmap_free;
+            rmap_free = found;
+            page->mapcount--;
+            rmap_stats.spare++;
+            rmap_stats.removes++;
+            rmap_stats.entries--;
+            break;
+        }
+    }
+    rmap_stats.remove_cycles += cycles_now() - start;
+    spinlock_unlock(&rmap_lock, ints);
+}
+
+// a pte changed frame or address, its entry is relinked under one lock so this never needs memory
+// an entry that was never recorded is added instead
+int pmm_rmap_move(uintptr_t from, uintptr_t from_va, uintptr_t to, uintptr_t to_va, struct vmm_region* region) {
+    struct page* src = phys_to_page_index(from & ~(PAGE_SIZE - 1));
+    struct page* dst = phys_to_page_index(to & ~(PAGE_SIZE - 1));
+    if (!dst) {
+        if (src)
+            pmm_rmap_remove(from, region, from_va);
+        return 0;
+    }
+
+    from_va &= ~(PAGE_SIZE - 1);
+    pmm_rmap_t* found = NULL;
+    bool ints = spinlock(&rmap_lock);
+    for (pmm_rmap_t** link = src ? &src->rmap : NULL; link && *link; link = &(*link)->next) {
+        if ((*link)->region == region && (*link)->va == from_va) {
+            found = *link;
+            *link = found->next;
+            src->mapcount--;
+            break;
+        }
+    }
+    if (found) {
+        found->va = to_va & ~(PAGE_SIZE - 1);
+        found->next = dst->rmap;
+        dst->rmap = found;
+        dst->mapcount++;
+    }
+    spinlock_unlock(&rmap_lock, ints);
+
+    return found ? 0 : pmm_rmap_add(to, region, to_va);
+}
+
+uint32_t pmm_page_mapcount(uintptr_t addr) {
+    struct page* page = phys_to_page_index(addr & ~(PAGE_SIZE - 1));
+    if (!page)
+        return 0;
+    return atomic_load_explicit((atomic_uint*) &page->mapcount, memory_order_relaxed);
+}
+
+// 1 when the pte at va in region is on the frame's chain
+int pmm_rmap_has(uintptr_t addr, struct vmm_region* region, uintptr_t va) {
+    struct page* page = phys_to_page_index(addr & ~(PAGE_SIZE - 1));
+    if (!page)
+        return 0;
+
+    va &= ~(PAGE_SIZE - 1);
+    int found = 0;
+    bool ints = spinlock(&rmap_lock);
+    for (pmm_rmap_t* entry = page->rmap; entry; entry = entry->next) {
+        if (entry->region == region && entry->va == va) {
+            found = 1;
+            break;
+        }
+    }
+    spinlock_unlock(&rmap_lock, ints);
+    return found;
+}
+
+// calls fn for every user pte mapping the frame at addr
+// fn runs on a snapshot without the lock held, so it may map and unmap the frame itself
+int pmm_for_each_mapping(uintptr_t addr, pmm_rmap_fn_t fn, void* ctx) {
+    struct page* page = phys_to_page_index(addr & ~(PAGE_SIZE - 1));
+    if (!page || !fn)
+        return -1;
+
+    pmm_rmap_t* snapshot = NULL;
+    uint32_t cap = 0;
+    uint32_t count = 0;
+    for (;;) {
+        bool ints = spinlock(&rmap_lock);
+        uint32_t want = page->mapcount;
+        if (want <= cap) {
+            for (pmm_rmap_t* entry = page->rmap; entry && count < cap; entry = entry->next)
+                snapshot[count++] = *entry;
+            spinlock_unlock(&rmap_lock, ints);
+            break;
+        }
+        spinlock_unlock(&rmap_lock, ints);
+
+        // the chain grew while unlocked, size the snapshot again
+        if (snapshot)
+            kfree(snapshot, cap * sizeof(pmm_rmap_t));
+        cap = want;
+        snapshot = (pmm_rmap_t*) kmalloc(cap * sizeof(pmm_rmap_t));
+        if (!snapshot)
+            return -1;
+    }
+
+    int ret = 0;
+    for (uint32_t i = 0; i < count && !ret; i++)
+        ret = fn(snapshot[i].region, snapshot[i].va, ctx);
+
+    if (snapshot)
+        kfree(snapshot, cap * sizeof(pmm_rmap_t));
+    return ret;
+}
+
+void pmm_rmap_get_stats(pmm_rmap_stats_t* out) {
+    if (!out)
+        return;
+    bool ints = spinlock(&rmap_lock);
+    *out = rmap_stats;
+    spinlock_unlock(&rmap_lock, ints);
+}
+
 int pmm_is_valid_addr(uintptr_t addr) {
     if (addr % PAGE_SIZE != 0)
         return 0;
@@ -880,22 +1168,31 @@ static void _lru_add_head(page_cache_entry_t* entry) {
         page_cache.lru_tail = entry;
 }
 
-void* page_cache_get(uint64_t idx) {
-    spinlock(&page_cache.lock);
+// look a page up, allocating an empty one if it is not cached yet
+// *created tells the caller it has to fill the page, the entry stays referenced until page_cache_release
+void* page_cache_get(uint64_t idx, bool* created) {
+    bool ints = spinlock(&page_cache.lock);
+    if (created)
+        *created = false;
     page_cache_entry_t* entry = radix_get_entry(page_cache.tree, idx);
     if (entry) {
         entry->refcount++;
         _lru_remove(entry);
         _lru_add_head(entry);
-        spinlock_unlock(&page_cache.lock, true);
+        spinlock_unlock(&page_cache.lock, ints);
         return (void*) entry->phys;
     }
-    void* page = pmm_alloc_page();
+    void* page = pmm_alloc_high_page();
     if (!page) {
-        spinlock_unlock(&page_cache.lock, true);
+        spinlock_unlock(&page_cache.lock, ints);
         return NULL;
     }
     entry = (page_cache_entry_t*) kmalloc(sizeof(page_cache_entry_t));
+    if (!entry) {
+        pmm_free_page(page);
+        spinlock_unlock(&page_cache.lock, ints);
+        return NULL;
+    }
     entry->phys = (uintptr_t) page;
     entry->idx = idx;
     entry->prev_lru = entry->next_lru = NULL;
@@ -904,67 +1201,92 @@ void* page_cache_get(uint64_t idx) {
     if (radix_set_entry(page_cache.tree, idx, entry) < 0) {
         pmm_free_page(page);
         kfree(entry, sizeof(page_cache_entry_t));
-        spinlock_unlock(&page_cache.lock, true);
+        spinlock_unlock(&page_cache.lock, ints);
         return NULL;
     }
     _lru_add_head(entry);
     page_cache.page_count++;
-    spinlock_unlock(&page_cache.lock, true);
+    if (created)
+        *created = true;
+    spinlock_unlock(&page_cache.lock, ints);
     return page;
 }
 
-void page_cache_mark_dirty(uint64_t idx) {
-    spinlock(&page_cache.lock);
+// like page_cache_get but never allocates, NULL if the page is not cached
+void* page_cache_find(uint64_t idx) {
+    bool ints = spinlock(&page_cache.lock);
+    page_cache_entry_t* entry = radix_get_entry(page_cache.tree, idx);
+    if (entry)
+        entry->refcount++;
+    spinlock_unlock(&page_cache.lock, ints);
+    return entry ? (void*) entry->phys : NULL;
+}
+
+// returns true if the page was clean before
+bool page_cache_mark_dirty(uint64_t idx) {
+    bool ints = spinlock(&page_cache.lock);
     page_cache_entry_t* entry = radix_get_entry(page_cache.tree, idx);
+    bool was_clean = entry && !entry->dirty;
     if (entry)
         entry->dirty = true;
-    spinlock_unlock(&page_cache.lock, true);
+    spinlock_unlock(&page_cache.lock, ints);
+    return was_clean;
+}
+
+// writeback claims a dirty page, a write after this dirties it again
+bool page_cache_test_clear_dirty(uint64_t idx) {
+    bool ints = spinlock(&page_cache.lock);
+    page_cache_entry_t* entry = radix_get_entry(page_cache.tree, idx);
+    bool dirty = entry && entry->dirty;
+    if (entry)
+        entry->dirty = false;
+    spinlock_unlock(&page_cache.lock, ints);
+    return dirty;
 }
 
 void page_cache_release(uint64_t idx) {
-    spinlock(&page_cache.lock);
+    bool ints = spinlock(&page_cache.lock);
     page_cache_entry_t* entry = radix_get_entry(page_cache.tree, idx);
     if (entry) {
         if (entry->refcount > 0)
             entry->refcount--;
     }
-    spinlock_unlock(&page_cache.lock, true);
+    spinlock_unlock(&page_cache.lock, ints);
+}
+
+// a page can only go once nobody holds it, no pte maps it and nothing is left to write back
+static bool page_cache_idle(page_cache_entry_t* entry) {
+    return entry->refcount == 0 && !entry->dirty && pmm_page_refcount(entry->phys) <= 1;
 }
 
 /* evict one least-recently-used page if any. */
 int page_cache_evict_one(void) {
-    spinlock(&page_cache.lock);
+    bool ints = spinlock(&page_cache.lock);
     page_cache_entry_t* victim = page_cache.lru_tail;
+    while (victim && !page_cache_idle(victim))
+        victim = victim->prev_lru;
     if (!victim) {
-        spinlock_unlock(&page_cache.lock, true);
-        return 0;
-    }
-    if (victim->refcount > 0) {
-        spinlock_unlock(&page_cache.lock, true);
+        spinlock_unlock(&page_cache.lock, ints);
         return 0;
     }
     _lru_remove(victim);
     radix_del_entry(page_cache.tree, victim->idx);
     page_cache.page_count--;
-    spinlock_unlock(&page_cache.lock, true);
+    spinlock_unlock(&page_cache.lock, ints);
     return 1;
 }
 
 void page_cache_remove(uint64_t idx) {
-    spinlock(&page_cache.lock);
+    bool ints = spinlock(&page_cache.lock);
     page_cache_entry_t* entry = radix_get_entry(page_cache.tree, idx);
-    if (!entry) {
-        spinlock_unlock(&page_cache.lock, true);
-        return;
-    }
-    if (entry->refcount > 0) {
-        spinlock_unlock(&page_cache.lock, true);
+    if (!entry || !page_cache_idle(entry)) {
+        spinlock_unlock(&page_cache.lock, ints);
         return;
     }
     _lru_remove(entry);
     radix_del_entry(page_cache.tree, idx);
     page_cache.page_count--;
-    spinlock_unlock(&page_cache.lock, true);
+    spinlock_unlock(&page_cache.lock, ints);
 }
 
 void page_cache_free_all(void) {
@@ -11,17 +11,49 @@
 
 #define PAGE_SIZE 4096
 
+struct vmm_region;
+
+// one user pte mapping a frame, chained off the frame's struct page
+typedef struct pmm_rmap {
+    struct vmm_region* region;
+    uintptr_t va;
+    struct pmm_rmap* next;
+} pmm_rmap_t;
+
+// entries come out of page sized chunks
+#define PMM_RMAP_PER_CHUNK (PAGE_SIZE / sizeof(pmm_rmap_t))
+
 struct page {
     uintptr_t address;
     uint32_t order;
     int is_free;
+    uint32_t refcount; // number of ptes mapping this frame
+    uint32_t mapcount; // entries on the rmap chain
+    pmm_rmap_t* rmap;  // user ptes mapping this frame (see pmm_for_each_mapping)
     struct page* next;
 };
 
+// bookkeeping cost of the reverse map, cycles are rdtsc totals since boot
+typedef struct pmm_rmap_stats {
+    uint32_t adds;
+    uint32_t removes;
+    uint32_t failed; // no memory for an entry, the mapping was refused
+    uint32_t entries;
+    uint32_t spare;  // carved out and waiting on the free list
+    uint64_t add_cycles;
+    uint64_t remove_cycles;
+} pmm_rmap_stats_t;
+
+// return nonzero to stop the walk, the value is passed back
+typedef int (*pmm_rmap_fn_t)(struct vmm_region* region, uintptr_t va, void* ctx);
+
+// blocks never straddle HIGHMEM_START, each sits on the list of the side it is on
 struct buddy_allocator {
-    struct page* free_list[MAX_ORDER + 1];
+    struct page* free_list[MAX_ORDER + 1];      // below HIGHMEM_START, usable by physical address
+    struct page* high_free_list[MAX_ORDER + 1]; // only reachable through kmap_atomic
     struct page* page_info;
     uint32_t total_pages;
+    uint32_t free_pages; // frames on the free lists, kept up to date under the lock
     uintptr_t memory_start;
     uintptr_t memory_end;
     uint32_t memory_base;
@@ -70,12 +102,34 @@ extern struct buddy_allocator buddy;
 void pmm_init(multiboot_info_t* mb_info);
 void* pmm_alloc_pages(uint32_t order, uint32_t count);
 void* pmm_alloc_page(void);
+void* pmm_alloc_high_page(void);
 void pmm_free_pages(void* addr, uint32_t order, uint32_t count);
 void pmm_free_page(void* addr);
 uint32_t pmm_get_memory_size();
 uint32_t pmm_get_page_count();
+uint32_t pmm_get_free_page_count(void);
 struct page* phys_to_page_index(uintptr_t addr);
 uint32_t page_index(uintptr_t addr);
 void pmm_copy_page(void* dst, void* src);
 int pmm_is_valid_addr(uintptr_t addr);
+void pmm_page_ref(uintptr_t addr);
+uint32_t pmm_page_unref(uintptr_t addr);
+uint32_t pmm_page_refcount(uintptr_t addr);
+int pmm_rmap_reserve(uint32_t count);
+int pmm_rmap_add(uintptr_t addr, struct vmm_region* region, uintptr_t va);
+void pmm_rmap_remove(uintptr_t addr, struct vmm_region* region, uintptr_t va);
+int pmm_rmap_move(uintptr_t from, uintptr_t from_va, uintptr_t to, uintptr_t to_va, struct vmm_region* region);
+uint32_t pmm_page_mapcount(uintptr_t addr);
+int pmm_rmap_has(uintptr_t addr, struct vmm_region* region, uintptr_t va);
+int pmm_for_each_mapping(uintptr_t addr, pmm_rmap_fn_t fn, void* ctx);
+void pmm_rmap_get_stats(pmm_rmap_stats_t* out);
+void page_cache_init(void);
+void* page_cache_get(uint64_t idx, bool* created);
+void* page_cache_find(uint64_t idx);
+bool page_cache_mark_dirty(uint64_t idx);
+bool page_cache_test_clear_dirty(uint64_t idx);
+void page_cache_release(uint64_t idx);
+int page_cache_evict_one(void);
+void page_cache_remove(uint64_t idx);
+void page_cache_free_all(void);
 #endif
@@ -0,0 +1,161 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "tlb.h"
+#include "vmm.h"
+#include "paging.h"
+#include "../smp/smp.h"
+
+// without CONFIG_SMP everything runs on cpu 0 and no ipis are sent
+int tlb_this_cpu(void) {
+#ifdef CONFIG_SMP
+    return smp_fetch_cpu();
+#else
+    return 0;
+#endif
+}
+
+bool tlb_region_active_on(vmm_region_t* region, int cpu) {
+    if (!region || cpu < 0 || cpu >= CONFIG_MAX_CPUS)
+        return false;
+    uint32_t word = atomic_load_explicit((atomic_uint*) &region->active_cpus[cpu / 32], memory_order_acquire);
+    return (word >> (cpu % 32)) & 1;
+}
+
+// called by vmm_switch, the cpu leaves prev and starts caching entries for next
+void tlb_region_activate(vmm_region_t* prev, vmm_region_t* next) {
+    int cpu = tlb_this_cpu();
+    if (cpu < 0 || cpu >= CONFIG_MAX_CPUS)
+        return;
+    uint32_t bit = 1u << (cpu % 32);
+    if (prev)
+        atomic_fetch_and_explicit((atomic_uint*) &prev->active_cpus[cpu / 32], ~bit, memory_order_release);
+    if (next)
+        atomic_fetch_or_explicit((atomic_uint*) &next->active_cpus[cpu / 32], bit, memory_order_release);
+}
+
+void tlb_batch_begin(tlb_batch_t* batch, vmm_region_t* region) {
+    batch->region = region;
+    batch->ranges = 0;
+    batch->pages = 0;
+    batch->full = false;
+    batch->global = false;
+}
+
+void tlb_batch_add(tlb_batch_t* batch, uintptr_t va, size_t pages) {
+    if (!pages)
+        return;
+    uintptr_t start = va & PAGE_MASK;
+    uintptr_t end = start + pages * PAGE_SIZE;
+    if (start >= KERNEL_VIRT_BASE || end > KERNEL_VIRT_BASE || start < KERNEL_LOW_END)
+        batch->global = true;
+
+    batch->pages += pages;
+    if (batch->full || batch->pages > TLB_FULL_FLUSH_PAGES) {
+        batch->full = true;
+        return;
+    }
+
+    // most callers walk forward, so grow the last range when they line up
+    if (batch->ranges && batch->end[batch->ranges - 1] == start) {
+        batch->end[batch->ranges - 1] = end;
+        return;
+    }
+    if (batch->ranges == TLB_BATCH_RANGES) {
+        batch->full = true;
+        return;
+    }
+    batch->start[batch->ranges] = start;
+    batch->end[batch->ranges] = end;
+    batch->ranges++;
+}
+
+void tlb_batch_add_all(tlb_batch_t* batch, bool global) {
+    batch->full = true;
+    if (global)
+        batch->global = true;
+}
+
+static void tlb_flush_local(tlb_batch_t* batch) {
+    if (batch->full) {
+        if (batch->global)
+            flush_tlb_all();
+        else
+            flush_tlb();
+        return;
+    }
+    // invlpg drops global entries as well
+    for (uint32_t i = 0; i < batch->ranges; i++) {
+        for (uintptr_t va = batch->start[i]; va < batch->end[i]; va += PAGE_SIZE)
+            invlpg((void*) va);
+    }
+}
+
+#ifdef CONFIG_SMP
+static void tlb_remote_flush(void* arg) {
+    tlb_flush_local((tlb_batch_t*) arg);
+}
+
+// every other cpu for kernel mappings, otherwise only the ones with the region loaded
+static uint64_t tlb_remote_mask(tlb_batch_t* batch, int me) {
+    uint64_t mask = 0;
+    int cpus = smp_cpu_count();
+    for (int cpu = 0; cpu < cpus && cpu < CONFIG_MAX_CPUS; cpu++) {
+        if (cpu == me)
+            continue;
+        if (batch->global || tlb_region_active_on(batch->region, cpu))
+            mask |= (uint64_t) 1 << cpu;
+    }
+    return mask;
+}
+#endif
+
+void tlb_batch_finish(tlb_batch_t* batch) {
+    if (!batch->full && batch->ranges == 0)
+        return;
+
+    int me = tlb_this_cpu();
+    if (!batch->region || batch->global || tlb_region_active_on(batch->region, me))
+        tlb_flush_local(batch);
+
+#ifdef CONFIG_SMP
+    // one ipi for the whole batch, smp waits for the remotes so the batch can live on the stack
+    uint64_t mask = tlb_remote_mask(batch, me);
+    if (mask)
+        smp_tell_cpus_to_do_fn(mask, tlb_remote_flush, batch);
+#endif
+
+    batch->ranges = 0;
+    batch->pages = 0;
+    batch->full = false;
+    batch->global = false;
+}
+
+void tlb_flush_range(vmm_region_t* region, uintptr_t va, size_t pages) {
+    tlb_batch_t batch;
+    tlb_batch_begin(&batch, region);
+    tlb_batch_add(&batch, va, pages);
+    tlb_batch_finish(&batch);
+}
+
+void tlb_flush_region(vmm_region_t* region, bool global) {
+    tlb_batch_t batch;
+    tlb_batch_begin(&batch, region);
+    tlb_batch_add_all(&batch, global);
+    tlb_batch_finish(&batch);
+}
@@ -0,0 +1,36 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "vmm.h"
+
+// ranges a batch can hold before it gives up and flushes everything
+#define TLB_BATCH_RANGES 8
+// above this many pages one cr3 reload is cheaper than an invlpg per page
+#define TLB_FULL_FLUSH_PAGES 32
+
+// flushes collected while page tables are being changed
+// tlb_batch_finish sends them out once, locally and to the cpus that have the region loaded
+typedef struct tlb_batch {
+    vmm_region_t* region;
+    uintptr_t start[TLB_BATCH_RANGES];
+    uintptr_t end[TLB_BATCH_RANGES];
+    uint32_t ranges;
+    uint32_t pages;
+    bool full;   // drop every non-global entry
+    bool global; // kernel mappings changed, every cpu has them cached
+} tlb_batch_t;
+
+int tlb_this_cpu(void);
+void tlb_batch_begin(tlb_batch_t* batch, vmm_region_t* region);
+void tlb_batch_add(tlb_batch_t* batch, uintptr_t va, size_t pages);
+void tlb_batch_add_all(tlb_batch_t* batch, bool global);
+void tlb_batch_finish(tlb_batch_t* batch);
+void tlb_flush_range(vmm_region_t* region, uintptr_t va, size_t pages);
+void tlb_flush_region(vmm_region_t* region, bool global);
+void tlb_region_activate(vmm_region_t* prev, vmm_region_t* next);
+bool tlb_region_active_on(vmm_region_t* region, int cpu);
+
+#endif
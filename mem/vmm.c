@@ -16,9 +16,16 @@ You should have received a copy of the GNU General Public License along with Flo
 #include "pmm.h"
 #include "vmm.h"
 #include "paging.h"
+#include "tlb.h"
+#include "zram.h"
+#include "filemap.h"
+#include "highmem.h"
 #include "utils.h"
 #include "../cpu/cpu.h"
 #include "../lib/logging.h"
+#include "../task/sched.h"
+#include "../task/sync/spinlock.h"
+#include <stdatomic.h>
 
 extern uint32_t* pg_dir;
 extern uint32_t* pg_tbls;
@@ -28,6 +35,15 @@ static vmm_region_t* region_list = 0;
 static vmm_region_t kernel_region;
 static vmm_region_t* current_region = NULL;
 
+// read faults on lazily reserved ranges map this frame read-only
+static uintptr_t vmm_zero_page = 0;
+
+// the boot directory owns the kernel half and the low identity map, every other directory
+// points its kernel pdes at the same page tables. new kernel pdes bump the generation and
+// are copied into other directories on switch or on the first fault
+static uint32_t* kernel_pd_master = NULL;
+static uint32_t kernel_pd_gen = 0;
+
 static inline uint32_t pd_index(uintptr_t va) {
     return (va >> 22) & 0x3FF;
 }
@@ -43,54 +59,357 @@ static inline uint32_t page_offset(uintptr_t va) {
 #define RECURSIVE_ADDR 0xFFC00000
 #define RECURSIVE_PT(pdi) ((uint32_t*) (RECURSIVE_ADDR + (pdi) *PAGE_SIZE))
 
+// page table of a region that may not be loaded, inactive ones are reached through their physical frame
+static uint32_t* vmm_region_pt(vmm_region_t* region, uint32_t pdi) {
+    if (region == &kernel_region || region->pg_dir == current_pg_dir)
+        return RECURSIVE_PT(pdi);
+    return (uint32_t*) (region->pg_dir[pdi] & PAGE_MASK);
+}
+
+// user ptes are recorded in their frame's reverse map (pmm_for_each_mapping)
+// kernel mappings and the zero page are everywhere and are left out
+static inline int vmm_rmap_tracked(vmm_region_t* region, uint32_t pte) {
+    return (pte & PAGE_PRESENT) && (pte & PAGE_USER) && region != &kernel_region &&
+           !vmm_is_zero_page(pte & PAGE_MASK);
+}
+
+// -1 when the frame's chain could not grow, the pte must not stay installed
+static inline int vmm_rmap_add(vmm_region_t* region, uintptr_t va, uint32_t pte) {
+    if (vmm_rmap_tracked(region, pte))
+        return pmm_rmap_add(pte & PAGE_MASK, region, va);
+    return 0;
+}
+
+static inline void vmm_rmap_remove(vmm_region_t* region, uintptr_t va, uint32_t pte) {
+    if (vmm_rmap_tracked(region, pte))
+        pmm_rmap_remove(pte & PAGE_MASK, region, va);
+}
+
+// one pte replaced by another, a tracked old entry is reused so this only fails when the old one was untracked
+static inline int vmm_rmap_move(vmm_region_t* region, uintptr_t from_va, uint32_t from, uintptr_t to_va, uint32_t to) {
+    if (!vmm_rmap_tracked(region, to)) {
+        vmm_rmap_remove(region, from_va, from);
+        return 0;
+    }
+    if (!vmm_rmap_tracked(region, from))
+        return vmm_rmap_add(region, to_va, to);
+    return pmm_rmap_move(from & PAGE_MASK, from_va, to & PAGE_MASK, to_va, region);
+}
+
+// a user pte split out of a large page maps a caller owned frame (device memory, a framebuffer)
+// and never went on the frame's rmap. it is shared as it is and never freed or copied-on-write
+static inline int vmm_pte_direct(vmm_region_t* region, uintptr_t va, uint32_t pte) {
+    return vmm_rmap_tracked(region, pte) && !pmm_rmap_has(pte & PAGE_MASK, region, va);
+}
+
+// a swapped out pte keeps its zram slot in the frame bits and the rw and user bits of the page
+#define VMM_SWAP_FLAGS (PAGE_RW | PAGE_USER)
+
+static inline int vmm_is_swap_pte(uint32_t pte) {
+    return !(pte & PAGE_PRESENT) && (pte & PAGE_SWAPPED);
+}
+
+static inline uint32_t vmm_swap_pte(uint32_t slot, uint32_t pte) {
+    return (slot << 12) | PAGE_SWAPPED | (pte & VMM_SWAP_FLAGS);
+}
+
+// an entry is being cleared or overwritten, its zram slot goes with it
+static inline void vmm_drop_swap(uint32_t pte) {
+    if (vmm_is_swap_pte(pte))
+        zram_free(pte >> 12);
+}
+
+// pre-zeroed page table frames, one pool per cpu so the fault and mmap paths
+// do not have to clear 4 KiB while they hold everything up
+typedef struct vmm_pt_pool {
+    uintptr_t pages[VMM_PT_POOL_SIZE];
+    uint32_t count;
+    spinlock_t lock;
+} vmm_pt_pool_t;
+
+static vmm_pt_pool_t vmm_pt_pools[CONFIG_MAX_CPUS];
+static atomic_uint vmm_pt_pool_low = 0;
+static thread_t* vmm_pt_pool_worker = NULL;
+static vmm_pt_pool_stats_t vmm_pt_stats;
+
+static vmm_pt_pool_t* vmm_pt_pool_this_cpu(void) {
+    int cpu = tlb_this_cpu();
+    if (cpu < 0 || cpu >= CONFIG_MAX_CPUS)
+        cpu = 0;
+    return &vmm_pt_pools[cpu];
+}
+
+// zeroed frame for a new page table, the pool first and a synchronous clear if it ran dry
+// tables and directories come from pmm_alloc_page, below HIGHMEM_START, so they are
+// read and written through their physical address in every directory
+static uintptr_t vmm_alloc_pt_page(void) {
+    vmm_pt_pool_t* pool = vmm_pt_pool_this_cpu();
+    uintptr_t pt_phys = 0;
+
+    bool ints = spinlock(&pool->lock);
+    if (pool->count)
+        pt_phys = pool->pages[--pool->count];
+    uint32_t left = pool->count;
+    spinlock_unlock(&pool->lock, ints);
+
+    // the first allocation to take a pool under the low mark wakes the refill thread
+    if (left < VMM_PT_POOL_LOW && !atomic_exchange_explicit(&vmm_pt_pool_low, 1, memory_order_acq_rel))
+        sched_thread_wake(vmm_pt_pool_worker);
+
+    if (pt_phys) {
+        atomic_fetch_add_explicit((atomic_uint*) &vmm_pt_stats.hits, 1, memory_order_relaxed);
+        return pt_phys;
+    }
+
+    atomic_fetch_add_explicit((atomic_uint*) &vmm_pt_stats.misses, 1, memory_order_relaxed);
+    pt_phys = (uintptr_t) pmm_alloc_page();
+    if (pt_phys)
+        flop_memset((void*) pt_phys, 0, PAGE_SIZE);
+    return pt_phys;
+}
+
+// top every pool back up, frames are cleared before the lock is taken
+void vmm_pt_pool_refill(void) {
+    atomic_store_explicit(&vmm_pt_pool_low, 0, memory_order_relaxed);
+
+    for (int cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+        vmm_pt_pool_t* pool = &vmm_pt_pools[cpu];
+        while (pool->count < VMM_PT_POOL_SIZE) {
+            uintptr_t pt_phys = (uintptr_t) pmm_alloc_page();
+            if (!pt_phys)
+                return;
+            flop_memset((void*) pt_phys, 0, PAGE_SIZE);
+
+            bool ints = spinlock(&pool->lock);
+            bool stored = pool->count < VMM_PT_POOL_SIZE;
+            if (stored)
+                pool->pages[pool->count++] = pt_phys;
+            spinlock_unlock(&pool->lock, ints);
+
+            if (!stored) {
+                pmm_free_page((void*) pt_phys);
+                break;
+            }
+            atomic_fetch_add_explicit((atomic_uint*) &vmm_pt_stats.refilled, 1, memory_order_relaxed);
+        }
+    }
+}
+
+// background refill, sleeps until an allocation takes a pool under the low mark
+// a wakeup that races with going to sleep is caught on the next timeout
+static void vmm_pt_pool_thread(void) {
+    for (;;) {
+        if (atomic_load_explicit(&vmm_pt_pool_low, memory_order_acquire))
+            vmm_pt_pool_refill();
+        else
+            sched_thread_sleep(VMM_PT_POOL_IDLE_MS);
+    }
+}
+
+void vmm_pt_pool_start(void) {
+    vmm_pt_pool_refill();
+    vmm_pt_pool_worker = sched_create_kernel_thread(vmm_pt_pool_thread, 1, "pt_pool");
+    if (!vmm_pt_pool_worker)
+        log("vmm: failed to start page table pool thread\n", RED);
+}
+
+void vmm_pt_pool_get_stats(vmm_pt_pool_stats_t* out) {
+    if (!out)
+        return;
+    out->hits = atomic_load_explicit((atomic_uint*) &vmm_pt_stats.hits, memory_order_relaxed);
+    out->misses = atomic_load_explicit((atomic_uint*) &vmm_pt_stats.misses, memory_order_relaxed);
+    out->refilled = atomic_load_explicit((atomic_uint*) &vmm_pt_stats.refilled, memory_order_relaxed);
+}
+
 // allocate a virtual address
+// the range is only reserved here, frames are faulted in on first touch
 uintptr_t vmm_alloc(vmm_region_t* region, size_t pages, uint32_t flags) {
     uintptr_t va = vmm_find_free_range(region, pages);
     if (!va)
         return 0;
 
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t pa = (uintptr_t) pmm_alloc_page();
-        if (!pa) {
-            vmm_unmap_range(region, va, i);
-            return 0;
-        }
-        vmm_map(region, va + i * PAGE_SIZE, pa, flags);
-    }
+    if (vmm_reserve_anonymous(region, va, pages, flags) < 0)
+        return 0;
     return va;
 }
 
 // free virtual address
 void vmm_free(vmm_region_t* region, uintptr_t va, size_t pages) {
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t pa = vmm_resolve(region, va + i * PAGE_SIZE);
-        if (pa) {
-            pmm_free_page((void*) pa);
-        }
-        vmm_unmap(region, va + i * PAGE_SIZE);
-    }
+    vmm_release_range(region, va, pages);
+    vmm_unreserve(region, va, pages);
 }
 
-// map a physical page at address pa to virtual address va
-int vmm_map(vmm_region_t* region, uintptr_t va, uintptr_t pa, uint32_t flags) {
-    uint32_t pdi = pd_index(va);
-    uint32_t pti = pt_index(va);
+static inline int vmm_is_kernel_pde(uint32_t pdi) {
+    return (pdi < KERNEL_LOW_PDES || pdi >= KERNEL_PDE_START) && pdi != RECURSIVE_PDE;
+}
+
+// point the kernel pdes of dir at the shared kernel page tables
+static void vmm_sync_kernel_pdes(uint32_t* dir) {
+    if (!kernel_pd_master || dir == kernel_pd_master)
+        return;
+    for (uint32_t pdi = 0; pdi < KERNEL_LOW_PDES; pdi++)
+        dir[pdi] = kernel_pd_master[pdi];
+    for (uint32_t pdi = KERNEL_PDE_START; pdi < RECURSIVE_PDE; pdi++)
+        dir[pdi] = kernel_pd_master[pdi];
+}
+
+// bring a region up to date with kernel pdes added since it was last synced
+void vmm_sync_kernel_region(vmm_region_t* region) {
+    if (!region || region->kernel_pd_gen == kernel_pd_gen)
+        return;
+    vmm_sync_kernel_pdes(region->pg_dir);
+    region->kernel_pd_gen = kernel_pd_gen;
+}
 
-    if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
-        // allocate new pt if not present
-        uintptr_t pt_phys = (uintptr_t) pmm_alloc_page();
+// kernel page tables are allocated once in the master directory
+static int vmm_alloc_kernel_pt(vmm_region_t* region, uint32_t pdi) {
+    if (kernel_pd_master && !(kernel_pd_master[pdi] & PAGE_PRESENT)) {
+        uintptr_t pt_phys = vmm_alloc_pt_page();
         if (!pt_phys)
             return -1;
+        kernel_pd_master[pdi] = (pt_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
+        kernel_pd_gen++;
+    }
+
+    if (kernel_pd_master) {
+        region->pg_dir[pdi] = kernel_pd_master[pdi];
+        return 0;
+    }
+
+    // no master yet (before vmm_init), the table just lives in this directory
+    uintptr_t pt_phys = (uintptr_t) pmm_alloc_page();
+    if (!pt_phys)
+        return -1;
+    region->pg_dir[pdi] = (pt_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
+    flop_memset(RECURSIVE_PT(pdi), 0, PAGE_SIZE);
+    return 0;
+}
+
+// kernel mappings are the same in every directory, so they can stay in the tlb across switches
+static inline uint32_t vmm_global_flags(uint32_t pdi, uint32_t flags) {
+    if (paging_pge_enabled() && vmm_is_kernel_pde(pdi) && !(flags & PAGE_USER))
+        return flags | PAGE_GLOBAL;
+    return flags;
+}
+
+// flushes go into the region's open batch if there is one, otherwise out right away
+static void vmm_tlb_flush(vmm_region_t* region, uintptr_t va, size_t pages) {
+    if (region->tlb_batch)
+        tlb_batch_add(region->tlb_batch, va, pages);
+    else
+        tlb_flush_range(region, va, pages);
+}
+
+static void vmm_tlb_flush_all(vmm_region_t* region) {
+    if (region->tlb_batch)
+        tlb_batch_add_all(region->tlb_batch, false);
+    else
+        tlb_flush_region(region, false);
+}
+
+// a pde changed, the whole 4 MiB slot is past the full flush threshold anyway
+static inline void vmm_flush_pde(vmm_region_t* region, uint32_t pdi) {
+    vmm_tlb_flush(region, (uintptr_t) pdi << 22, PAGE_ENTRIES);
+}
+
+// collect flushes for a run of page table changes, nested calls join the outer batch
+struct tlb_batch* vmm_batch_begin(vmm_region_t* region, struct tlb_batch* batch) {
+    if (!region || region->tlb_batch)
+        return NULL;
+    tlb_batch_begin(batch, region);
+    region->tlb_batch = batch;
+    return batch;
+}
+
+void vmm_batch_end(vmm_region_t* region, struct tlb_batch* batch) {
+    if (!region || !batch)
+        return;
+    region->tlb_batch = NULL;
+    tlb_batch_finish(batch);
+}
+
+static inline int vmm_pde_is_large(uint32_t pde) {
+    return (pde & PAGE_PRESENT) && (pde & PAGE_LARGE);
+}
+
+// install a pde, kernel ones go through the master so other directories pick them up
+static void vmm_set_pde(vmm_region_t* region, uint32_t pdi, uint32_t pde) {
+    if (kernel_pd_master && vmm_is_kernel_pde(pdi)) {
+        kernel_pd_master[pdi] = pde;
+        kernel_pd_gen++;
+    }
+    region->pg_dir[pdi] = pde;
+}
+
+// break a 4 MiB mapping back into a page table with the same frames and flags
+static int vmm_split_large(vmm_region_t* region, uint32_t pdi) {
+    uint32_t pde = region->pg_dir[pdi];
+    if (!vmm_pde_is_large(pde))
+        return 0;
+
+    uintptr_t pt_phys = vmm_alloc_pt_page();
+    if (!pt_phys)
+        return -1;
+
+    // bit 7 is pat in a pte, and bit 12 (pat in a large pde) is part of the address there
+    uint32_t* pt = (uint32_t*) pt_phys;
+    uintptr_t base = pde & LARGE_PAGE_MASK;
+    uint32_t flags = (pde & ~PAGE_MASK) & ~PAGE_LARGE;
+    for (int pti = 0; pti < PAGE_ENTRIES; pti++)
+        pt[pti] = (base + pti * PAGE_SIZE) | flags;
+
+    vmm_set_pde(region, pdi, (pt_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW | (pde & PAGE_USER));
+    vmm_flush_pde(region, pdi);
+    return 0;
+}
+
+// page table covering pdi, allocated (or split out of a large page) when needed
+static uint32_t* vmm_prepare_pt(vmm_region_t* region, uint32_t pdi) {
+    if (vmm_split_large(region, pdi) < 0)
+        return NULL;
+
+    if (!(region->pg_dir[pdi] & PAGE_PRESENT) && vmm_is_kernel_pde(pdi)) {
+        if (vmm_alloc_kernel_pt(region, pdi) < 0)
+            return NULL;
+    } else if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
+        // allocate new pt if not present, it comes out of the pool already zeroed
+        uintptr_t pt_phys = vmm_alloc_pt_page();
+        if (!pt_phys)
+            return NULL;
 
         region->pg_dir[pdi] = (pt_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW | PAGE_USER;
-        // zero new pt
-        flop_memset(RECURSIVE_PT(pdi), 0, PAGE_SIZE);
     }
 
-    uint32_t* pt = RECURSIVE_PT(pdi);
-    pt[pti] = (pa & PAGE_MASK) | flags | PAGE_PRESENT;
+    return vmm_region_pt(region, pdi);
+}
+
+// pages from va up to the end of its page table, capped at pages
+static inline size_t vmm_span_in_pt(uintptr_t va, size_t pages) {
+    size_t left = PAGE_ENTRIES - pt_index(va);
+    return left < pages ? left : pages;
+}
+
+// map a physical page at address pa to virtual address va
+int vmm_map(vmm_region_t* region, uintptr_t va, uintptr_t pa, uint32_t flags) {
+    uint32_t pdi = pd_index(va);
+    uint32_t pti = pt_index(va);
+
+    uint32_t* pt = vmm_prepare_pt(region, pdi);
+    if (!pt)
+        return -1;
 
-    invlpg((void*) va);
+    // the rmap entry is taken first so a failure leaves the old mapping alone
+    uint32_t pte = (pa & PAGE_MASK) | vmm_global_flags(pdi, flags) | PAGE_PRESENT;
+    if (vmm_rmap_add(region, va, pte) < 0)
+        return -1;
+
+    // the cpu never caches not-present entries, only a replaced mapping needs a flush
+    uint32_t old = pt[pti];
+    pt[pti] = pte;
+    vmm_drop_swap(old);
+    vmm_rmap_remove(region, va, old);
+    if (old & PAGE_PRESENT)
+        vmm_tlb_flush(region, va, 1);
     return 0;
 }
 
@@ -101,11 +420,15 @@ int vmm_unmap(vmm_region_t* region, uintptr_t va) {
 
     if (!(region->pg_dir[pdi] & PAGE_PRESENT))
         return -1;
+    if (vmm_split_large(region, pdi) < 0)
+        return -1;
 
-    uint32_t* pt = RECURSIVE_PT(pdi);
+    uint32_t* pt = vmm_region_pt(region, pdi);
+    vmm_drop_swap(pt[pti]);
+    vmm_rmap_remove(region, va, pt[pti]);
     pt[pti] = 0;
 
-    invlpg((void*) va);
+    vmm_tlb_flush(region, va, 1);
     return 0;
 }
 
@@ -116,6 +439,8 @@ uintptr_t vmm_resolve(vmm_region_t* region, uintptr_t va) {
 
     if (!(region->pg_dir[pdi] & PAGE_PRESENT))
         return 0;
+    if (region->pg_dir[pdi] & PAGE_LARGE)
+        return (region->pg_dir[pdi] & LARGE_PAGE_MASK) | (va & ~LARGE_PAGE_MASK);
 
     uint32_t* pt = RECURSIVE_PT(pdi);
     if (!(pt[pti] & PAGE_PRESENT))
@@ -146,6 +471,7 @@ vmm_region_t* vmm_region_create(size_t initial_pages, uint32_t flags, uintptr_t*
         return NULL;
     uint32_t* dir = (uint32_t*) dir_phys;
     flop_memset(dir, 0, PAGE_SIZE);
+    vmm_sync_kernel_pdes(dir);
     dir[RECURSIVE_PDE] = (dir_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
     vmm_region_t* region = (vmm_region_t*) kmalloc(sizeof(vmm_region_t));
     if (!region) {
@@ -154,9 +480,11 @@ vmm_region_t* vmm_region_create(size_t initial_pages, uint32_t flags, uintptr_t*
     }
     region->pg_dir = dir;
     region->next = NULL;
-    region->random_table = NULL;
-    region->random_count = 0;
-    region->random_capacity = 0;
+    gap_tree_init(&region->aslr, USER_SPACE_START, USER_SPACE_END + 1);
+    region->lazy_ranges = NULL;
+    region->kernel_pd_gen = kernel_pd_gen;
+    flop_memset(region->active_cpus, 0, sizeof(region->active_cpus));
+    region->tlb_batch = NULL;
     region_insert(region);
     if (initial_pages > 0 && out_va) {
         uintptr_t va = vmm_alloc(region, initial_pages, flags);
@@ -172,20 +500,34 @@ vmm_region_t* vmm_region_create(size_t initial_pages, uint32_t flags, uintptr_t*
     return region;
 }
 
+static void vmm_lazy_free(vmm_lazy_range_t* range) {
+    filemap_put(range->file);
+    kfree(range, sizeof(vmm_lazy_range_t));
+}
+
+static void vmm_lazy_free_all(vmm_region_t* region) {
+    vmm_lazy_range_t* range = region->lazy_ranges;
+    while (range) {
+        vmm_lazy_range_t* next = range->next;
+        vmm_lazy_free(range);
+        range = next;
+    }
+    region->lazy_ranges = NULL;
+}
+
 void vmm_region_destroy(vmm_region_t* region) {
     if (!region)
         return;
+    // a kernel thread may still be borrowing this directory
+    if (region == current_region)
+        vmm_switch(&kernel_region);
     // TODO: unmap and free all pages owned by this region here
     // must be done by caller for now
     region_remove(region);
 
-    if (region->random_table) {
-        kfree(region->random_table, region->random_capacity * sizeof(aslr_entry_t));
-        region->random_table = NULL;
-        region->random_count = 0;
-        region->random_capacity = 0;
-    }
+    gap_tree_clear(&region->aslr);
 
+    vmm_lazy_free_all(region);
     pmm_free_page((void*) region->pg_dir);
     kfree(region, sizeof(vmm_region_t));
 }
@@ -193,20 +535,59 @@ void vmm_region_destroy(vmm_region_t* region) {
 void vmm_switch(vmm_region_t* region) {
     if (!region)
         return;
+    vmm_sync_kernel_region(region);
+    // already loaded, a cr3 write would only throw the user tlb entries away
+    if (region == current_region)
+        return;
+    tlb_region_activate(current_region, region);
     current_region = region;
     current_pg_dir = region->pg_dir;
-    load_pd(region->pg_dir);
+    // the kernel region's pg_dir is the recursive alias, cr3 wants the real directory
+    if (region == &kernel_region && kernel_pd_master)
+        load_pd(kernel_pd_master);
+    else
+        load_pd(region->pg_dir);
+}
+
+vmm_region_t* vmm_current_region(void) {
+    return current_region ? current_region : &kernel_region;
+}
+
+// head of the list of every region, follow ->next for the rest
+vmm_region_t* vmm_region_list(void) {
+    return region_list;
 }
 
 void vmm_init() {
+    // the recursive slot still holds the physical address of the boot directory
+    kernel_pd_master = (uint32_t*) (pg_dir[RECURSIVE_PDE] & PAGE_MASK);
     kernel_region.pg_dir = pg_dir;
+    kernel_region.kernel_pd_gen = 0;
     kernel_region.next = 0;
+    kernel_region.lazy_ranges = NULL;
+    gap_tree_init(&kernel_region.aslr, USER_SPACE_START, USER_SPACE_END + 1);
     current_pg_dir = pg_dir;
-    pg_dir[RECURSIVE_PDE] = ((uintptr_t) pg_dir & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
     region_insert(&kernel_region);
     // we do not need to load the kernel region because it has
     // been loaded into cr3 by the paging init function.
     // however, we set current_region to it.
+    current_region = &kernel_region;
+    tlb_region_activate(NULL, &kernel_region);
+
+    for (int cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++) {
+        vmm_pt_pools[cpu].count = 0;
+        spinlock_init(&vmm_pt_pools[cpu].lock);
+    }
+
+    // frames can come from above the identity map from here on
+    if (highmem_init() < 0)
+        return;
+
+    vmm_zero_page = (uintptr_t) pmm_alloc_page();
+    if (!vmm_zero_page || highmem_zero_page(vmm_zero_page) < 0) {
+        log("vmm: failed to allocate zero page\n", RED);
+        return;
+    }
     log("vmm: init - ok\n", GREEN);
 }
 
@@ -219,226 +600,1413 @@ uint32_t* vmm_new_copied_pgdir() {
     return new_dir;
 }
 
+static int vmm_lazy_copy(vmm_region_t* dst, vmm_region_t* src) {
+    vmm_lazy_range_t** tail = &dst->lazy_ranges;
+    for (vmm_lazy_range_t* range = src->lazy_ranges; range; range = range->next) {
+        vmm_lazy_range_t* copy = (vmm_lazy_range_t*) kmalloc(sizeof(vmm_lazy_range_t));
+        if (!copy)
+            return -1;
+        copy->start = range->start;
+        copy->end = range->end;
+        copy->flags = range->flags;
+        copy->file = range->file;
+        copy->pgoff = range->pgoff;
+        copy->advice = range->advice;
+        copy->lazyfree = range->lazyfree;
+        copy->next = NULL;
+        filemap_dup(copy->file);
+        *tail = copy;
+        tail = &copy->next;
+    }
+    return 0;
+}
+
 // copy a region's mappings into a new region and add it to the linked list of virtual regions
 vmm_region_t* vmm_copy_pagemap(vmm_region_t* src) {
     uint32_t* new_dir = vmm_new_copied_pgdir();
     vmm_region_t* dst = (vmm_region_t*) kmalloc(sizeof(vmm_region_t));
+    flop_memset(dst, 0, sizeof(vmm_region_t));
     dst->pg_dir = new_dir;
     dst->next = 0;
 
+    // the kernel half is shared, never copied
+    vmm_sync_kernel_pdes(new_dir);
+    dst->kernel_pd_gen = kernel_pd_gen;
+
+    if (vmm_lazy_copy(dst, src) < 0) {
+        vmm_region_destroy(dst);
+        return 0;
+    }
+
     // pt allocation
     for (int pdi = 0; pdi < 1024; pdi++) {
         // do it
-        if (!(src->pg_dir[pdi] & PAGE_PRESENT))
+        if (pdi == RECURSIVE_PDE || !(src->pg_dir[pdi] & PAGE_PRESENT))
+            continue;
+        if (kernel_pd_master && vmm_is_kernel_pde(pdi))
             continue;
-        uintptr_t pt_phys = (uintptr_t) pmm_alloc_page();
+
+        // large pages map caller owned frames, the child shares the pde as it is
+        if (src->pg_dir[pdi] & PAGE_LARGE) {
+            new_dir[pdi] = src->pg_dir[pdi];
+            continue;
+        }
+        // rmap entries for a full table are set aside up front so the copy rarely has to back out
+        uintptr_t pt_phys = 0;
+        if (pmm_rmap_reserve(PAGE_ENTRIES) == 0)
+            pt_phys = vmm_alloc_pt_page();
 
         // fall back if page alloc fails (important)
         if (!pt_phys) {
+            vmm_release_user_pages(dst);
             vmm_region_destroy(dst);
+            vmm_tlb_flush_all(src);
             return 0;
         }
 
-        // determine src pt (index pdi*1024 in pg_tbls)
-        uint32_t* src_pt = &pg_tbls[pdi * PAGE_ENTRIES];
+        uint32_t* src_pt = vmm_region_pt(src, pdi);
 
         // set target pt to page we allocated
         uint32_t* dst_pt = (uint32_t*) pt_phys;
-        flop_memset(dst_pt, 0, PAGE_SIZE);
 
         // frame allocation
-        for (int pti = 0; pti < PAGE_ENTRIES; pti++) {
+        int pti;
+        for (pti = 0; pti < PAGE_ENTRIES; pti++) {
             // check if page is ok
+            // both sides point at the same zram slot until one swaps it in
+            if (vmm_is_swap_pte(src_pt[pti])) {
+                zram_dup(src_pt[pti] >> 12);
+                dst_pt[pti] = src_pt[pti];
+                continue;
+            }
             if (!(src_pt[pti] & PAGE_PRESENT))
                 continue;
-            uintptr_t new_page = (uintptr_t) pmm_alloc_page();
 
-            // before copying frame we must check if the new page exists
-            // fall back if frame allocation doesnt work out
-            if (!new_page) {
-                vmm_region_destroy(dst);
-                return 0;
+            // the zero page is shared, never copied
+            if (vmm_is_zero_page(src_pt[pti] & PAGE_MASK)) {
+                dst_pt[pti] = src_pt[pti];
+                continue;
+            }
+
+            // so is what is left of a split large page, the frames stay the caller's
+            if (vmm_pte_direct(src, ((uintptr_t) pdi << 22) | ((uintptr_t) pti << 12), src_pt[pti])) {
+                dst_pt[pti] = src_pt[pti];
+                continue;
+            }
+
+            // shared memory frames stay shared, writes from either side are seen by both
+            if (src_pt[pti] & PAGE_SHARED) {
+                if (vmm_rmap_add(dst, ((uintptr_t) pdi << 22) | ((uintptr_t) pti << 12), src_pt[pti]) < 0)
+                    break;
+                pmm_page_ref(src_pt[pti] & PAGE_MASK);
+                dst_pt[pti] = src_pt[pti];
+                continue;
             }
 
-            // copy frame
+            // user frames are shared copy-on-write, both sides lose write access
+            // until one of them faults and gets its own copy
+            if (src_pt[pti] & PAGE_USER) {
+                if (vmm_rmap_add(dst, ((uintptr_t) pdi << 22) | ((uintptr_t) pti << 12), src_pt[pti]) < 0)
+                    break;
+                if (src_pt[pti] & PAGE_RW)
+                    src_pt[pti] = (src_pt[pti] & ~PAGE_RW) | PAGE_COW;
+                pmm_page_ref(src_pt[pti] & PAGE_MASK);
+                dst_pt[pti] = src_pt[pti];
+                continue;
+            }
 
-            flop_memcpy((void*) new_page, (void*) (src_pt[pti] & PAGE_MASK), PAGE_SIZE);
-            dst_pt[pti] = (new_page & PAGE_MASK) | (src_pt[pti] & ~PAGE_MASK);
+            // kernel mappings in the user half point at kernel frames,
+            // the child gets the same mapping and owns nothing
+            dst_pt[pti] = src_pt[pti];
         }
 
         new_dir[pdi] = (pt_phys & PAGE_MASK) | (src->pg_dir[pdi] & ~PAGE_MASK);
+
+        // out of rmap entries part way through, what was copied so far is released with the rest
+        if (pti < PAGE_ENTRIES) {
+            vmm_release_user_pages(dst);
+            vmm_region_destroy(dst);
+            vmm_tlb_flush_all(src);
+            return 0;
+        }
     }
 
     // point last entry of the new dir to itself (recursively)
     new_dir[RECURSIVE_PDE] = ((uintptr_t) new_dir & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
 
+    // parent ptes lost their write bit above, threads on other cpus must see that too
+    vmm_tlb_flush_all(src);
+
     // insert new region into linked list
     region_insert(dst);
     return dst;
 }
 
-void vmm_nuke_pagemap(vmm_region_t* region) {
-    for (int pdi = 0; pdi < 1024; pdi++) {
-        if (!(region->pg_dir[pdi] & PAGE_PRESENT))
-            continue;
+void vmm_nuke_pagemap(vmm_region_t* region) {
+    if (region == current_region)
+        vmm_switch(&kernel_region);
+
+    // the kernel pdes belong to the master directory
+    for (int pdi = KERNEL_LOW_PDES; pdi < KERNEL_PDE_START; pdi++) {
+        if (!(region->pg_dir[pdi] & PAGE_PRESENT) || (region->pg_dir[pdi] & PAGE_LARGE))
+            continue;
+
+        uint32_t* pt = vmm_region_pt(region, pdi);
+        for (int pti = 0; pti < PAGE_ENTRIES; pti++) {
+            vmm_drop_swap(pt[pti]);
+            // non-user entries are shared kernel mappings
+            uintptr_t va = ((uintptr_t) pdi << 22) | ((uintptr_t) pti << 12);
+            if ((pt[pti] & PAGE_PRESENT) && (pt[pti] & PAGE_USER) && !vmm_pte_direct(region, va, pt[pti])) {
+                uintptr_t pa = pt[pti] & PAGE_MASK;
+                vmm_rmap_remove(region, va, pt[pti]);
+                vmm_free_frame(pa);
+            }
+        }
+
+        uintptr_t pt_phys = region->pg_dir[pdi] & PAGE_MASK;
+        pmm_free_page((void*) pt_phys);
+    }
+
+    uintptr_t dir_phys = (uintptr_t) region->pg_dir;
+    pmm_free_page((void*) dir_phys);
+
+    vmm_lazy_free_all(region);
+    region_remove(region);
+    kfree(region, sizeof(vmm_region_t));
+}
+
+// the walk reads each region's own tables, vmm_resolve only sees the loaded directory
+vmm_region_t* vmm_find_region(uintptr_t va) {
+    vmm_region_t* iter = region_list;
+    while (iter) {
+        if (!vmm_range_is_unmapped(iter, va & PAGE_MASK, 1))
+            return iter;
+        iter = iter->next;
+    }
+    return 0;
+}
+
+size_t vmm_count_regions() {
+    size_t n = 0;
+    vmm_region_t* iter = region_list;
+    while (iter) {
+        n++;
+        iter = iter->next;
+    }
+    return n;
+}
+
+// true when [va, va + pages) covers a whole 4 MiB slot that pa lines up with
+static int vmm_can_map_large(uintptr_t va, uintptr_t pa, size_t pages) {
+    return paging_pse_enabled() && !(va & ~LARGE_PAGE_MASK) && !(pa & ~LARGE_PAGE_MASK) && pages >= PAGE_ENTRIES;
+}
+
+// map a whole 4 MiB slot with one pde, a page table already there is dropped (promoted)
+static void vmm_map_large(vmm_region_t* region, uintptr_t va, uintptr_t pa, uint32_t flags) {
+    uint32_t pdi = pd_index(va);
+    uint32_t old = region->pg_dir[pdi];
+
+    vmm_set_pde(
+        region, pdi, (pa & LARGE_PAGE_MASK) | vmm_global_flags(pdi, flags & ~PAGE_COW) | PAGE_PRESENT | PAGE_LARGE);
+    vmm_flush_pde(region, pdi);
+
+    if (!(old & PAGE_PRESENT) || (old & PAGE_LARGE))
+        return;
+
+    // every pte in the old table was covered by this mapping, they let go of their frames
+    // and swap slots like an unmap would. the table is no longer reachable through the
+    // recursive slot, so it is read through its frame
+    uint32_t* pt = (uint32_t*) (old & PAGE_MASK);
+    for (int pti = 0; pti < PAGE_ENTRIES; pti++) {
+        uint32_t pte = pt[pti];
+        uintptr_t pte_va = (va & LARGE_PAGE_MASK) | ((uintptr_t) pti << 12);
+        vmm_drop_swap(pte);
+        if (!(pte & PAGE_PRESENT))
+            continue;
+        if (vmm_pte_direct(region, pte_va, pte))
+            continue;
+        vmm_rmap_remove(region, pte_va, pte);
+        if (pte & PAGE_USER)
+            vmm_free_frame(pte & PAGE_MASK);
+    }
+    pmm_free_page((void*) (old & PAGE_MASK));
+}
+
+int vmm_map_range(vmm_region_t* region, uintptr_t va, uintptr_t pa, size_t pages, uint32_t flags) {
+    tlb_batch_t batch;
+    tlb_batch_t* open = vmm_batch_begin(region, &batch);
+    int ret = 0;
+    size_t i = 0;
+    while (i < pages) {
+        uintptr_t cur_va = va + i * PAGE_SIZE;
+        uintptr_t cur_pa = pa + i * PAGE_SIZE;
+        if (vmm_can_map_large(cur_va, cur_pa, pages - i)) {
+            vmm_map_large(region, cur_va, cur_pa, flags);
+            i += PAGE_ENTRIES;
+            continue;
+        }
+
+        // one table lookup per 4 MiB, then fill its entries in a single pass
+        uint32_t pdi = pd_index(cur_va);
+        uint32_t* pt = vmm_prepare_pt(region, pdi);
+        if (!pt) {
+            ret = -1;
+            break;
+        }
+
+        size_t n = vmm_span_in_pt(cur_va, pages - i);
+        uint32_t first = pt_index(cur_va);
+        uint32_t entry_flags = vmm_global_flags(pdi, flags) | PAGE_PRESENT;
+        int replaced = 0;
+        size_t k;
+        for (k = 0; k < n; k++) {
+            uint32_t old = pt[first + k];
+            uint32_t pte = ((cur_pa + k * PAGE_SIZE) & PAGE_MASK) | entry_flags;
+            if (vmm_rmap_add(region, cur_va + k * PAGE_SIZE, pte) < 0)
+                break;
+            replaced |= old & PAGE_PRESENT;
+            pt[first + k] = pte;
+            vmm_drop_swap(old);
+            vmm_rmap_remove(region, cur_va + k * PAGE_SIZE, old);
+        }
+        if (replaced)
+            vmm_tlb_flush(region, cur_va, k);
+        // out of rmap entries, the caller unmaps what was done
+        if (k < n) {
+            ret = -1;
+            break;
+        }
+        i += n;
+    }
+    vmm_batch_end(region, open);
+    return ret;
+}
+
+// allocate every page table a range will need up front, so mapping into it later
+// (faults, mmap, a latency sensitive phase) never waits on a table allocation
+// 4 MiB pages already cover their slot and are left alone
+int vmm_prepopulate(vmm_region_t* region, uintptr_t va, size_t pages) {
+    if (!region || !pages)
+        return -1;
+
+    uintptr_t start = va & PAGE_MASK;
+    uint32_t first = pd_index(start);
+    uint32_t last = pd_index(start + (pages - 1) * PAGE_SIZE);
+    if (last < first || last >= RECURSIVE_PDE)
+        return -1;
+
+    for (uint32_t pdi = first; pdi <= last; pdi++) {
+        if (vmm_pde_is_large(region->pg_dir[pdi]))
+            continue;
+        if (!vmm_prepare_pt(region, pdi))
+            return -1;
+    }
+    return 0;
+}
+
+int vmm_unmap_range(vmm_region_t* region, uintptr_t va, size_t pages) {
+    tlb_batch_t batch;
+    tlb_batch_t* open = vmm_batch_begin(region, &batch);
+    int ret = 0;
+    size_t i = 0;
+    while (i < pages) {
+        uintptr_t cur_va = va + i * PAGE_SIZE;
+        uint32_t pdi = pd_index(cur_va);
+
+        // a whole large page goes away without splitting it first
+        if (vmm_pde_is_large(region->pg_dir[pdi]) && !(cur_va & ~LARGE_PAGE_MASK) && pages - i >= PAGE_ENTRIES) {
+            vmm_set_pde(region, pdi, 0);
+            vmm_flush_pde(region, pdi);
+            i += PAGE_ENTRIES;
+            continue;
+        }
+
+        size_t n = vmm_span_in_pt(cur_va, pages - i);
+        if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
+            // nothing mapped in this slot
+            i += n;
+            continue;
+        }
+        if (vmm_split_large(region, pdi) < 0) {
+            ret = -1;
+            break;
+        }
+
+        uint32_t* pt = vmm_region_pt(region, pdi);
+        uint32_t first = pt_index(cur_va);
+        for (size_t k = 0; k < n; k++) {
+            vmm_drop_swap(pt[first + k]);
+            vmm_rmap_remove(region, cur_va + k * PAGE_SIZE, pt[first + k]);
+            pt[first + k] = 0;
+        }
+        vmm_tlb_flush(region, cur_va, n);
+        i += n;
+    }
+    vmm_batch_end(region, open);
+    return ret;
+}
+
+// unmap [va, va + pages) and drop the region's reference on every frame that was mapped there
+void vmm_release_range(vmm_region_t* region, uintptr_t va, size_t pages) {
+    tlb_batch_t batch;
+    tlb_batch_t* open = vmm_batch_begin(region, &batch);
+    size_t i = 0;
+    while (i < pages) {
+        uintptr_t cur_va = va + i * PAGE_SIZE;
+        uint32_t pdi = pd_index(cur_va);
+        size_t n = vmm_span_in_pt(cur_va, pages - i);
+
+        if (!(region->pg_dir[pdi] & PAGE_PRESENT) || vmm_split_large(region, pdi) < 0) {
+            i += n;
+            continue;
+        }
+
+        uint32_t* pt = vmm_region_pt(region, pdi);
+        uint32_t first = pt_index(cur_va);
+        int cleared = 0;
+        for (size_t k = 0; k < n; k++) {
+            if (vmm_is_swap_pte(pt[first + k])) {
+                vmm_drop_swap(pt[first + k]);
+                pt[first + k] = 0;
+                continue;
+            }
+            if (!(pt[first + k] & PAGE_PRESENT))
+                continue;
+            if (!vmm_pte_direct(region, cur_va + k * PAGE_SIZE, pt[first + k])) {
+                vmm_rmap_remove(region, cur_va + k * PAGE_SIZE, pt[first + k]);
+                vmm_free_frame(pt[first + k] & PAGE_MASK);
+            }
+            pt[first + k] = 0;
+            cleared = 1;
+        }
+        if (cleared)
+            vmm_tlb_flush(region, cur_va, n);
+        i += n;
+    }
+    vmm_batch_end(region, open);
+}
+
+// new pte for a present entry getting flags
+static uint32_t vmm_protect_pte(uint32_t pte, uint32_t pdi, uint32_t flags) {
+    // the zero page stays read-only, a write fault will give the page its own frame
+    if (vmm_is_zero_page(pte & PAGE_MASK))
+        flags &= ~PAGE_RW;
+    // a shared frame only becomes writable through a cow fault
+    flags &= ~(PAGE_COW | PAGE_SHARED);
+    // shared memory keeps its frames writable by every mapping
+    if (pte & PAGE_SHARED)
+        return (pte & PAGE_MASK) | vmm_global_flags(pdi, flags) | PAGE_SHARED | PAGE_PRESENT;
+    if ((flags & PAGE_RW) && ((pte & PAGE_COW) || pmm_page_refcount(pte & PAGE_MASK) > 1))
+        flags = (flags & ~PAGE_RW) | PAGE_COW;
+    return (pte & PAGE_MASK) | vmm_global_flags(pdi, flags) | PAGE_PRESENT;
+}
+
+// pages of a shared file range only become writable through a fault that marks them dirty
+static uint32_t vmm_protect_flags(vmm_region_t* region, uintptr_t va, uint32_t pte, uint32_t flags) {
+    if ((pte & PAGE_SHARED) && !(pte & PAGE_RW) && (flags & PAGE_RW)) {
+        vmm_lazy_range_t* range = vmm_find_lazy_range(region, va);
+        if (range && range->file)
+            flags &= ~PAGE_RW;
+    }
+    return flags;
+}
+
+int vmm_protect(vmm_region_t* region, uintptr_t va, uint32_t flags) {
+    uint32_t pdi = pd_index(va);
+    uint32_t pti = pt_index(va);
+    if (!(region->pg_dir[pdi] & PAGE_PRESENT))
+        return -1;
+    if (vmm_split_large(region, pdi) < 0)
+        return -1;
+    uint32_t* pt = vmm_region_pt(region, pdi);
+    if (!(pt[pti] & PAGE_PRESENT))
+        return -1;
+    pt[pti] = vmm_protect_pte(pt[pti], pdi, vmm_protect_flags(region, va, pt[pti], flags));
+    vmm_tlb_flush(region, va, 1);
+    return 0;
+}
+
+// change the flags of every mapped page in [va, va + pages), unmapped pages are skipped
+int vmm_protect_range(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags) {
+    tlb_batch_t batch;
+    tlb_batch_t* open = vmm_batch_begin(region, &batch);
+    int ret = 0;
+    size_t i = 0;
+    while (i < pages) {
+        uintptr_t cur_va = va + i * PAGE_SIZE;
+        uint32_t pdi = pd_index(cur_va);
+        size_t n = vmm_span_in_pt(cur_va, pages - i);
+
+        if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
+            i += n;
+            continue;
+        }
+        if (vmm_split_large(region, pdi) < 0) {
+            ret = -1;
+            break;
+        }
+
+        uint32_t* pt = vmm_region_pt(region, pdi);
+        uint32_t first = pt_index(cur_va);
+        for (size_t k = 0; k < n; k++) {
+            if (pt[first + k] & PAGE_PRESENT)
+                pt[first + k] = vmm_protect_pte(
+                    pt[first + k], pdi, vmm_protect_flags(region, cur_va + k * PAGE_SIZE, pt[first + k], flags));
+            else if (vmm_is_swap_pte(pt[first + k]))
+                pt[first + k] = (pt[first + k] & ~PAGE_RW) | (flags & PAGE_RW);
+        }
+        vmm_tlb_flush(region, cur_va, n);
+        i += n;
+    }
+    vmm_batch_end(region, open);
+    return ret;
+}
+
+// kernel page table for va, set up ahead of time for mappings made where nothing may be allocated
+int vmm_prepare_kernel_pt(uintptr_t va) {
+    if (!vmm_is_kernel_pde(pd_index(va)))
+        return -1;
+    return vmm_prepare_pt(&kernel_region, pd_index(va)) ? 0 : -1;
+}
+
+// device registers in the kernel half at their own physical address, uncached
+// not ram, so there is no frame to count and nothing goes on an rmap
+int vmm_map_kernel_mmio(uintptr_t pa, size_t pages) {
+    uintptr_t start = pa & PAGE_MASK;
+    if (!pages || start < KERNEL_VIRT_BASE || (uint64_t) start + (uint64_t) pages * PAGE_SIZE > KMAP_BASE)
+        return -1;
+
+    for (size_t i = 0; i < pages; i++) {
+        uintptr_t va = start + i * PAGE_SIZE;
+        uint32_t pdi = pd_index(va);
+        if (vmm_alloc_kernel_pt(&kernel_region, pdi) < 0)
+            return -1;
+        uint32_t* pt = (uint32_t*) (kernel_pd_master[pdi] & PAGE_MASK);
+        pt[pt_index(va)] = va | PAGE_PRESENT | PAGE_RW | PAGE_PCD | PAGE_PWT;
+        invlpg((void*) va);
+    }
+    return 0;
+}
+
+// hook a page table the caller already has into the master directory, for the one table
+// that has to exist before frames can be cleared. pt_phys must be zeroed and identity mapped
+int vmm_install_kernel_pt(uintptr_t va, uintptr_t pt_phys) {
+    uint32_t pdi = pd_index(va);
+    if (!kernel_pd_master || !vmm_is_kernel_pde(pdi) || (kernel_pd_master[pdi] & PAGE_PRESENT))
+        return -1;
+    kernel_pd_master[pdi] = (pt_phys & PAGE_MASK) | PAGE_PRESENT | PAGE_RW;
+    kernel_pd_gen++;
+    return 0;
+}
+
+uint32_t* vmm_get_pt(vmm_region_t* region, uintptr_t va) {
+    uint32_t pdi = pd_index(va);
+    if (!(region->pg_dir[pdi] & PAGE_PRESENT) || (region->pg_dir[pdi] & PAGE_LARGE))
+        return 0;
+    return &pg_tbls[pdi * PAGE_ENTRIES];
+}
+
+uint32_t vmm_get_pde(vmm_region_t* region, uintptr_t va) {
+    return region->pg_dir[pd_index(va)];
+}
+
+// walk the present mappings of [start, end) in address order
+// non-present pdes are skipped in one step and only present ptes reach the callbacks
+// end == 0 means up to the top of the address space, the recursive slot is never visited
+int vmm_walk(vmm_region_t* region, uintptr_t start, uintptr_t end, const vmm_walk_ops_t* ops) {
+    if (!region || !ops)
+        return -1;
+
+    uint64_t stop = end ? (uint64_t) end : 0x100000000ULL;
+    uint64_t va = start & PAGE_MASK;
+    while (va < stop) {
+        uint32_t pdi = pd_index((uintptr_t) va);
+        uint64_t slot_end = ((uint64_t) pdi + 1) << 22;
+        uint32_t pde = region->pg_dir[pdi];
+
+        if (pdi == RECURSIVE_PDE || !(pde & PAGE_PRESENT)) {
+            va = slot_end;
+            continue;
+        }
+
+        if (pde & PAGE_LARGE) {
+            if (ops->large_entry) {
+                int ret = ops->large_entry(region, (uintptr_t) (slot_end - LARGE_PAGE_SIZE), &region->pg_dir[pdi], ops->ctx);
+                if (ret)
+                    return ret;
+            }
+            va = slot_end;
+            continue;
+        }
+
+        uint32_t* pt = vmm_region_pt(region, pdi);
+        uint64_t last = slot_end < stop ? slot_end : stop;
+        for (; va < last; va += PAGE_SIZE) {
+            uint32_t* pte = &pt[pt_index((uintptr_t) va)];
+            if (!ops->pte_entry || (!(*pte & PAGE_PRESENT) && !(ops->swapped && vmm_is_swap_pte(*pte))))
+                continue;
+            int ret = ops->pte_entry(region, (uintptr_t) va, pte, ops->ctx);
+            if (ret)
+                return ret;
+        }
+        va = slot_end;
+    }
+    return 0;
+}
+
+typedef struct {
+    size_t pages;
+    uintptr_t next_free;
+    uintptr_t found;
+} vmm_free_range_walk_t;
+
+// first spot in [start, end) with room for pages that no lazy range overlaps
+static uintptr_t vmm_fit_in_gap(vmm_region_t* region, uintptr_t start, uintptr_t end, size_t pages) {
+    uint64_t need = (uint64_t) pages * PAGE_SIZE;
+    uint64_t cur = start;
+    for (vmm_lazy_range_t* range = region->lazy_ranges; range; range = range->next) {
+        if (range->end <= cur)
+            continue;
+        if (range->start >= end)
+            break;
+        if (range->start >= cur && range->start - cur >= need)
+            return (uintptr_t) cur;
+        cur = range->end;
+    }
+    if (cur < end && end - cur >= need)
+        return (uintptr_t) cur;
+    return 0;
+}
+
+static int vmm_free_range_used(vmm_free_range_walk_t* walk, vmm_region_t* region, uintptr_t va, size_t len) {
+    if (va > walk->next_free) {
+        uintptr_t fit = vmm_fit_in_gap(region, walk->next_free, va, walk->pages);
+        if (fit) {
+            walk->found = fit;
+            return 1;
+        }
+    }
+    if (va + len > walk->next_free)
+        walk->next_free = va + len;
+    return 0;
+}
+
+static int vmm_free_range_pte(vmm_region_t* region, uintptr_t va, uint32_t* pte, void* ctx) {
+    return vmm_free_range_used((vmm_free_range_walk_t*) ctx, region, va, PAGE_SIZE);
+}
+
+static int vmm_free_range_large(vmm_region_t* region, uintptr_t va, uint32_t* pde, void* ctx) {
+    return vmm_free_range_used((vmm_free_range_walk_t*) ctx, region, va, LARGE_PAGE_SIZE);
+}
+
+// find pages free virtual pages in a row, only the gaps between mappings are looked at
+// the search stays in user space, 0 means nothing was found
+uintptr_t vmm_find_free_range(vmm_region_t* region, size_t pages) {
+    if (!region || !pages)
+        return 0;
+
+    vmm_free_range_walk_t walk = {.pages = pages, .next_free = USER_SPACE_START, .found = 0};
+    // a swapped out page still owns its address
+    vmm_walk_ops_t ops = {
+        .pte_entry = vmm_free_range_pte, .large_entry = vmm_free_range_large, .ctx = &walk, .swapped = true};
+    if (vmm_walk(region, USER_SPACE_START, USER_SPACE_END + 1, &ops) > 0)
+        return walk.found;
+
+    // the tail after the last mapping
+    if (walk.next_free <= USER_SPACE_END)
+        return vmm_fit_in_gap(region, walk.next_free, USER_SPACE_END + 1, pages);
+    return 0; // no range found
+}
+
+static int vmm_range_used_pte(vmm_region_t* region, uintptr_t va, uint32_t* pte, void* ctx) {
+    return 1;
+}
+
+static int vmm_range_used_large(vmm_region_t* region, uintptr_t va, uint32_t* pde, void* ctx) {
+    return 1;
+}
+
+// no page in [va, va + pages) is mapped
+int vmm_range_is_unmapped(vmm_region_t* region, uintptr_t va, size_t pages) {
+    vmm_walk_ops_t ops = {.pte_entry = vmm_range_used_pte, .large_entry = vmm_range_used_large, .ctx = NULL};
+    return vmm_walk(region, va, va + pages * PAGE_SIZE, &ops) == 0;
+}
+
+int vmm_map_shared(
+    vmm_region_t* a, vmm_region_t* b, uintptr_t va_a, uintptr_t va_b, uintptr_t pa, size_t pages, uint32_t flags) {
+    for (size_t i = 0; i < pages; i++) {
+        if (vmm_map(a, va_a + i * PAGE_SIZE, pa + i * PAGE_SIZE, flags) < 0)
+            return -1;
+        if (vmm_map(b, va_b + i * PAGE_SIZE, pa + i * PAGE_SIZE, flags) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int vmm_identity_map(vmm_region_t* region, uintptr_t base, size_t pages, uint32_t flags) {
+    return vmm_map_range(region, base, base, pages, flags);
+}
+
+int vmm_is_mapped(vmm_region_t* region, uintptr_t va) {
+    return vmm_resolve(region, va) != 0;
+}
+
+static int vmm_count_pte(vmm_region_t* region, uintptr_t va, uint32_t* pte, void* ctx) {
+    (*(size_t*) ctx)++;
+    return 0;
+}
+
+static int vmm_count_large(vmm_region_t* region, uintptr_t va, uint32_t* pde, void* ctx) {
+    *(size_t*) ctx += PAGE_ENTRIES;
+    return 0;
+}
+
+size_t vmm_count_mapped(vmm_region_t* region) {
+    size_t n = 0;
+    vmm_walk_ops_t ops = {.pte_entry = vmm_count_pte, .large_entry = vmm_count_large, .ctx = &n};
+    vmm_walk(region, 0, KERNEL_VIRT_BASE, &ops);
+    return n;
+}
+
+int vmm_is_zero_page(uintptr_t pa) {
+    return vmm_zero_page && (pa & PAGE_MASK) == vmm_zero_page;
+}
+
+// release a frame that was mapped into a region
+// frames shared by a fork are only freed once the last mapping goes away
+void vmm_free_frame(uintptr_t pa) {
+    if (!pa || vmm_is_zero_page(pa))
+        return;
+    if (pmm_page_unref(pa & PAGE_MASK) > 0)
+        return;
+    pmm_free_page((void*) (pa & PAGE_MASK));
+}
+
+// drop every user frame of a region and the page tables left empty by it
+// the page directory and kernel half are left for vmm_region_destroy
+void vmm_release_user_pages(vmm_region_t* region) {
+    if (!region || region == &kernel_region)
+        return;
+
+    for (uint32_t pdi = KERNEL_LOW_PDES; pdi < KERNEL_PDE_START; pdi++) {
+        if (!(region->pg_dir[pdi] & PAGE_PRESENT))
+            continue;
+
+        // large pages map caller owned frames, there is no table to free either
+        if (region->pg_dir[pdi] & PAGE_LARGE) {
+            region->pg_dir[pdi] = 0;
+            continue;
+        }
+
+        uint32_t* pt = vmm_region_pt(region, pdi);
+        for (int pti = 0; pti < PAGE_ENTRIES; pti++) {
+            if (vmm_is_swap_pte(pt[pti])) {
+                vmm_drop_swap(pt[pti]);
+                pt[pti] = 0;
+                continue;
+            }
+            uintptr_t va = ((uintptr_t) pdi << 22) | ((uintptr_t) pti << 12);
+            if ((pt[pti] & PAGE_PRESENT) && (pt[pti] & PAGE_USER) && !vmm_pte_direct(region, va, pt[pti])) {
+                vmm_rmap_remove(region, va, pt[pti]);
+                vmm_free_frame(pt[pti] & PAGE_MASK);
+            }
+            pt[pti] = 0;
+        }
+
+        pmm_free_page((void*) (region->pg_dir[pdi] & PAGE_MASK));
+        region->pg_dir[pdi] = 0;
+    }
+    if (region->pg_dir == current_pg_dir)
+        vmm_tlb_flush_all(region);
+}
+
+vmm_lazy_range_t* vmm_find_lazy_range(vmm_region_t* region, uintptr_t va) {
+    if (!region)
+        return NULL;
+    for (vmm_lazy_range_t* range = region->lazy_ranges; range; range = range->next) {
+        // list is sorted by start
+        if (va < range->start)
+            return NULL;
+        if (va < range->end)
+            return range;
+    }
+    return NULL;
+}
+
+// reserve a range without backing it with frames
+// file ranges take their own reference on the file
+int vmm_reserve_file(
+    vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags, struct filemap* file, uint32_t pgoff) {
+    if (!region || !pages || (va & ~PAGE_MASK))
+        return -1;
+
+    uintptr_t end = va + pages * PAGE_SIZE;
+    if (end <= va)
+        return -1;
+
+    vmm_lazy_range_t** link = &region->lazy_ranges;
+    while (*link && (*link)->start < va) {
+        if ((*link)->end > va)
+            return -1;
+        link = &(*link)->next;
+    }
+    if (*link && (*link)->start < end)
+        return -1;
+
+    vmm_lazy_range_t* range = (vmm_lazy_range_t*) kmalloc(sizeof(vmm_lazy_range_t));
+    if (!range)
+        return -1;
+    range->start = va;
+    range->end = end;
+    range->flags = flags;
+    range->file = file;
+    range->pgoff = pgoff;
+    range->advice = VMM_ADV_NORMAL;
+    range->lazyfree = false;
+    range->next = *link;
+    *link = range;
+    filemap_dup(file);
+    return 0;
+}
+
+int vmm_reserve_anonymous(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags) {
+    return vmm_reserve_file(region, va, pages, flags, NULL, 0);
+}
+
+// split the range containing va so that va becomes a range boundary
+static int vmm_lazy_split(vmm_region_t* region, uintptr_t va) {
+    vmm_lazy_range_t* range = vmm_find_lazy_range(region, va);
+    if (!range || range->start == va)
+        return 0;
+
+    vmm_lazy_range_t* tail = (vmm_lazy_range_t*) kmalloc(sizeof(vmm_lazy_range_t));
+    if (!tail)
+        return -1;
+    tail->start = va;
+    tail->end = range->end;
+    tail->flags = range->flags;
+    tail->file = range->file;
+    tail->pgoff = range->pgoff + (va - range->start) / PAGE_SIZE;
+    tail->advice = range->advice;
+    tail->lazyfree = range->lazyfree;
+    tail->next = range->next;
+    filemap_dup(tail->file);
+    range->end = va;
+    range->next = tail;
+    return 0;
+}
+
+// drop the reservation for [va, va + pages), frames must be released by the caller
+int vmm_unreserve(vmm_region_t* region, uintptr_t va, size_t pages) {
+    if (!region || !pages)
+        return -1;
+    uintptr_t end = va + pages * PAGE_SIZE;
+    if (vmm_lazy_split(region, va) < 0 || vmm_lazy_split(region, end) < 0)
+        return -1;
+
+    vmm_lazy_range_t** link = &region->lazy_ranges;
+    while (*link) {
+        vmm_lazy_range_t* range = *link;
+        if (range->start >= end)
+            break;
+        if (range->start >= va) {
+            *link = range->next;
+            vmm_lazy_free(range);
+            continue;
+        }
+        link = &range->next;
+    }
+    return 0;
+}
+
+// change the flags pages in [va, va + pages) will be faulted in with
+int vmm_protect_reserved(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags) {
+    if (!region || !pages)
+        return -1;
+    uintptr_t end = va + pages * PAGE_SIZE;
+    if (vmm_lazy_split(region, va) < 0 || vmm_lazy_split(region, end) < 0)
+        return -1;
+
+    // whether a file range is shared was decided by mmap
+    for (vmm_lazy_range_t* range = region->lazy_ranges; range && range->start < end; range = range->next) {
+        if (range->start >= va)
+            range->flags = (flags & ~PAGE_SHARED) | (range->flags & PAGE_SHARED);
+    }
+    return 0;
+}
+
+// nothing is mapped, swapped out or reserved anywhere in [va, va + pages)
+int vmm_range_is_free(vmm_region_t* region, uintptr_t va, size_t pages) {
+    if (!region || !pages || (va & ~PAGE_MASK))
+        return 0;
+    if (!vmm_in_user_space(va, pages))
+        return 0;
+    uint64_t end = (uint64_t) va + (uint64_t) pages * PAGE_SIZE;
+
+    for (vmm_lazy_range_t* range = region->lazy_ranges; range; range = range->next) {
+        if (range->start >= end)
+            break;
+        if (range->end > va)
+            return 0;
+    }
+
+    uint64_t cur = va;
+    while (cur < end) {
+        uint32_t pdi = pd_index((uintptr_t) cur);
+        uint32_t pde = region->pg_dir[pdi];
+        if (!(pde & PAGE_PRESENT)) {
+            cur = ((uint64_t) pdi + 1) << 22;
+            continue;
+        }
+        if (pde & PAGE_LARGE)
+            return 0;
+        // swap entries are not present but still hold the page
+        if (vmm_region_pt(region, pdi)[pt_index((uintptr_t) cur)])
+            return 0;
+        cur += PAGE_SIZE;
+    }
+    return 1;
+}
+
+// put a detached lazy range back into the sorted list
+static void vmm_lazy_insert(vmm_region_t* region, vmm_lazy_range_t* range) {
+    vmm_lazy_range_t** link = &region->lazy_ranges;
+    while (*link && (*link)->start < range->start)
+        link = &(*link)->next;
+    range->next = *link;
+    *link = range;
+}
+
+// move the pages of [old_va, old_va + pages) to new_va, which must be free (see vmm_range_is_free)
+// only page table entries and reservations move, the frames and their contents stay where they are
+int vmm_move_range(vmm_region_t* region, uintptr_t old_va, uintptr_t new_va, size_t pages) {
+    if (!region || region == &kernel_region || !pages || ((old_va | new_va) & ~PAGE_MASK))
+        return -1;
+    // the kernel's pdes are shared with every directory, nothing of theirs may move
+    if (!vmm_in_user_space(old_va, pages) || !vmm_in_user_space(new_va, pages))
+        return -1;
+    uintptr_t old_end = old_va + pages * PAGE_SIZE;
+    uintptr_t new_end = new_va + pages * PAGE_SIZE;
+
+    // everything that can fail comes first so a failure leaves the mapping untouched
+    for (uint32_t pdi = pd_index(new_va); pdi <= pd_index(new_end - 1); pdi++) {
+        if (!vmm_prepare_pt(region, pdi))
+            return -1;
+    }
+    for (uint32_t pdi = pd_index(old_va); pdi <= pd_index(old_end - 1); pdi++) {
+        if (vmm_split_large(region, pdi) < 0)
+            return -1;
+    }
+    if (vmm_lazy_split(region, old_va) < 0 || vmm_lazy_split(region, old_end) < 0)
+        return -1;
+
+    tlb_batch_t batch;
+    tlb_batch_t* open = vmm_batch_begin(region, &batch);
+    size_t i = 0;
+    while (i < pages) {
+        uintptr_t cur_va = old_va + i * PAGE_SIZE;
+        uint32_t pdi = pd_index(cur_va);
+        size_t n = vmm_span_in_pt(cur_va, pages - i);
+        if (!(region->pg_dir[pdi] & PAGE_PRESENT)) {
+            i += n;
+            continue;
+        }
+
+        uint32_t* src = vmm_region_pt(region, pdi);
+        for (size_t k = 0; k < n; k++) {
+            uint32_t pte = src[pt_index(cur_va) + k];
+            if (!pte)
+                continue;
+            uintptr_t from = cur_va + k * PAGE_SIZE;
+            uintptr_t to = new_va + (i + k) * PAGE_SIZE;
+            vmm_region_pt(region, pd_index(to))[pt_index(to)] = pte;
+            src[pt_index(cur_va) + k] = 0;
+            vmm_rmap_move(region, from, pte, to, pte);
+        }
+        vmm_tlb_flush(region, cur_va, n);
+        i += n;
+    }
+    vmm_batch_end(region, open);
+
+    // the reservations follow their pages, file ranges keep their file offsets
+    vmm_lazy_range_t* moved = NULL;
+    vmm_lazy_range_t** link = &region->lazy_ranges;
+    while (*link && (*link)->start < old_end) {
+        vmm_lazy_range_t* range = *link;
+        if (range->start < old_va) {
+            link = &range->next;
+            continue;
+        }
+        *link = range->next;
+        range->next = moved;
+        moved = range;
+    }
+    while (moved) {
+        vmm_lazy_range_t* next = moved->next;
+        moved->start = moved->start - old_va + new_va;
+        moved->end = moved->end - old_va + new_va;
+        vmm_lazy_insert(region, moved);
+        moved = next;
+    }
+    return 0;
+}
+
+typedef struct {
+    size_t target;
+    size_t reclaimed;
+} vmm_reclaim_walk_t;
+
+// private anonymous page the application gave up with madvise(FREE)
+static bool vmm_lazyfree_at(vmm_region_t* region, uintptr_t va) {
+    vmm_lazy_range_t* range = vmm_find_lazy_range(region, va);
+    return range && range->lazyfree && !range->file;
+}
+
+// second chance: a page touched since the last pass only loses its accessed bit,
+// an untouched private anonymous page is compressed into zram and its frame freed
+static int vmm_reclaim_pte(vmm_region_t* region, uintptr_t va, uint32_t* pte, void* ctx) {
+    vmm_reclaim_walk_t* walk = (vmm_reclaim_walk_t*) ctx;
+    uint32_t old = *pte;
+    uintptr_t pa = old & PAGE_MASK;
+
+    if (!(old & PAGE_USER) || (old & (PAGE_SHARED | PAGE_COW)) || vmm_is_zero_page(pa) ||
+        pmm_page_refcount(pa) != 1 || vmm_pte_direct(region, va, old))
+        return 0;
+
+    // the application said it does not care about these contents, nothing to save
+    if (!(old & PAGE_DIRTY) && vmm_lazyfree_at(region, va)) {
+        // a write racing with us sets the dirty bit in the entry we take, the page is kept then
+        old = __atomic_exchange_n(pte, 0, __ATOMIC_ACQ_REL);
+        tlb_flush_range(region, va, 1);
+        if (old & PAGE_DIRTY) {
+            *pte = old;
+            return 0;
+        }
+        vmm_rmap_remove(region, va, old);
+        vmm_free_frame(pa);
+        return ++walk->reclaimed >= walk->target;
+    }
+
+    if (old & PAGE_ACCESSED) {
+        *pte = old & ~PAGE_ACCESSED;
+        return 0;
+    }
+
+    // take the page away from every cpu before reading it, a late write would be lost otherwise
+    *pte = old & ~PAGE_PRESENT;
+    tlb_flush_range(region, va, 1);
+
+    uint32_t slot;
+    if (zram_store(pa, &slot) < 0) {
+        *pte = old;
+        return 0;
+    }
+    *pte = vmm_swap_pte(slot, old);
+    vmm_rmap_remove(region, va, old);
+    vmm_free_frame(pa);
+    return ++walk->reclaimed >= walk->target;
+}
+
+// evict up to pages cold anonymous pages of region, returns how many went
+size_t vmm_reclaim_region(vmm_region_t* region, size_t pages) {
+    if (!region || region == &kernel_region || !pages)
+        return 0;
+
+    vmm_reclaim_walk_t walk = {.target = pages, .reclaimed = 0};
+    vmm_walk_ops_t ops = {.pte_entry = vmm_reclaim_pte, .large_entry = NULL, .ctx = &walk};
+    vmm_walk(region, 0, KERNEL_VIRT_BASE, &ops);
+    return walk.reclaimed;
+}
+
+// memory pressure, go over every address space until enough pages have been evicted
+size_t vmm_reclaim(size_t pages) {
+    size_t done = 0;
+    for (vmm_region_t* region = region_list; region && done < pages; region = region->next)
+        done += vmm_reclaim_region(region, pages - done);
+    return done;
+}
+
+// drop up to pages cached file pages nobody maps, they can be read back from the file
+static size_t vmm_shrink_page_cache(size_t pages) {
+    size_t done = 0;
+    while (done < pages && page_cache_evict_one())
+        done++;
+    return done;
+}
+
+static thread_t* vmm_reclaim_worker = NULL;
+static atomic_uint vmm_reclaim_kicked = 0;
+
+// background reclaim, tops free frames back up to the high mark so faults rarely wait on eviction
+// gives up on a pass that frees nothing, the next kick tries again
+static void vmm_reclaim_thread(void) {
+    for (;;) {
+        if (!atomic_exchange_explicit(&vmm_reclaim_kicked, 0, memory_order_acq_rel)) {
+            sched_thread_sleep(VMM_RECLAIM_IDLE_MS);
+            continue;
+        }
+        while (pmm_get_free_page_count() < VMM_RECLAIM_HIGH) {
+            if (!vmm_shrink_page_cache(VMM_RECLAIM_BATCH) && !vmm_reclaim(VMM_RECLAIM_BATCH))
+                break;
+            sched_yield();
+        }
+    }
+}
+
+void vmm_reclaim_start(void) {
+    vmm_reclaim_worker = sched_create_kernel_thread(vmm_reclaim_thread, 1, "reclaim");
+    if (!vmm_reclaim_worker)
+        log("vmm: failed to start reclaim thread\n", RED);
+}
+
+// frame for a user page, the reclaim thread is woken once free frames drop under the low mark
+// if it falls behind and memory runs out, unused file pages go first since they
+// cost nothing to drop, then cold anonymous pages are evicted into zram, once each
+static uintptr_t vmm_alloc_user_frame(void) {
+    if (pmm_get_free_page_count() < VMM_RECLAIM_LOW &&
+        !atomic_exchange_explicit(&vmm_reclaim_kicked, 1, memory_order_acq_rel))
+        sched_thread_wake(vmm_reclaim_worker);
+
+    uintptr_t pa = (uintptr_t) pmm_alloc_high_page();
+    if (!pa && vmm_shrink_page_cache(VMM_RECLAIM_BATCH))
+        pa = (uintptr_t) pmm_alloc_high_page();
+    if (!pa && vmm_reclaim(VMM_RECLAIM_BATCH))
+        pa = (uintptr_t) pmm_alloc_high_page();
+    return pa;
+}
+
+// bring an evicted page back, 1 if the pte was not a swap entry
+static int vmm_swap_in(vmm_region_t* region, uintptr_t va) {
+    uint32_t pdi = pd_index(va);
+    if (!(region->pg_dir[pdi] & PAGE_PRESENT) || (region->pg_dir[pdi] & PAGE_LARGE))
+        return 1;
+
+    uint32_t* pt = vmm_region_pt(region, pdi);
+    uint32_t pte = pt[pt_index(va)];
+    if (!vmm_is_swap_pte(pte))
+        return 1;
+
+    uintptr_t pa = vmm_alloc_user_frame();
+    if (!pa)
+        return -1;
+    if (zram_load(pte >> 12, pa) < 0) {
+        pmm_free_page((void*) pa);
+        return -1;
+    }
+
+    // not present entries are never cached, no flush needed
+    // dirty, the contents exist nowhere else now and madvise(FREE) must not drop them
+    uint32_t loaded = pa | (pte & VMM_SWAP_FLAGS) | PAGE_PRESENT | PAGE_DIRTY;
+    if (vmm_rmap_add(region, va, loaded) < 0) {
+        pmm_free_page((void*) pa);
+        return -1;
+    }
+    pt[pt_index(va)] = loaded;
+    zram_free(pte >> 12);
+    return 0;
+}
+
+int vmm_is_swapped(vmm_region_t* region, uintptr_t va) {
+    uint32_t pdi = pd_index(va);
+    if (!region || !(region->pg_dir[pdi] & PAGE_PRESENT) || (region->pg_dir[pdi] & PAGE_LARGE))
+        return 0;
+    return vmm_is_swap_pte(vmm_region_pt(region, pdi)[pt_index(va)]);
+}
+
+// resolve a write to a cow page, the last sharer just takes the frame back
+static int vmm_cow_fault(vmm_region_t* region, uintptr_t va) {
+    uint32_t pdi = pd_index(va);
+    if (!(region->pg_dir[pdi] & PAGE_PRESENT) || (region->pg_dir[pdi] & PAGE_LARGE))
+        return -1;
+
+    uint32_t* pt = vmm_region_pt(region, pdi);
+    uint32_t pte = pt[pt_index(va)];
+    if (!(pte & PAGE_PRESENT) || !(pte & PAGE_COW))
+        return -1;
+
+    uintptr_t old_pa = pte & PAGE_MASK;
+    uint32_t flags = ((pte & ~PAGE_MASK) & ~PAGE_COW) | PAGE_RW;
+
+    if (pmm_page_refcount(old_pa) <= 1) {
+        pt[pt_index(va)] = old_pa | flags;
+        vmm_tlb_flush(region, va, 1);
+        return 0;
+    }
+
+    uintptr_t new_pa = vmm_alloc_user_frame();
+    if (!new_pa)
+        return -1;
+    if (highmem_copy_page(new_pa, old_pa) < 0) {
+        pmm_free_page((void*) new_pa);
+        return -1;
+    }
+    if (vmm_rmap_move(region, va, pte, va, new_pa | flags) < 0) {
+        pmm_free_page((void*) new_pa);
+        return -1;
+    }
+    pt[pt_index(va)] = new_pa | flags;
+    vmm_tlb_flush(region, va, 1);
+
+    // the other side may have exited in the meantime, so this can be the last ref
+    vmm_free_frame(old_pa);
+    return 0;
+}
+
+// drop write access from one pte, the next write faults
+// writeback uses this to notice a shared file page being written again
+int vmm_wrprotect(vmm_region_t* region, uintptr_t va) {
+    uint32_t pdi = pd_index(va);
+    if (!region || !(region->pg_dir[pdi] & PAGE_PRESENT) || (region->pg_dir[pdi] & PAGE_LARGE))
+        return -1;
+
+    uint32_t* pt = vmm_region_pt(region, pdi);
+    uint32_t pte = pt[pt_index(va)];
+    if (!(pte & PAGE_PRESENT))
+        return -1;
+    if (pte & PAGE_RW) {
+        pt[pt_index(va)] = pte & ~PAGE_RW;
+        vmm_tlb_flush(region, va, 1);
+    }
+    return 0;
+}
+
+// pages to read in behind a fault at va, never past the end of the range
+static uint32_t vmm_readahead_window(vmm_lazy_range_t* range, uintptr_t va) {
+    uint32_t window = VMM_READAHEAD_PAGES;
+    if (range->advice == VMM_ADV_SEQUENTIAL)
+        window = VMM_READAHEAD_SEQUENTIAL;
+    else if (range->advice == VMM_ADV_RANDOM)
+        window = 0;
+    uint32_t left = (range->end - va) / PAGE_SIZE - 1;
+    return window < left ? window : left;
+}
 
-        uint32_t* pt = &pg_tbls[pdi * PAGE_ENTRIES];
-        for (int pti = 0; pti < PAGE_ENTRIES; pti++) {
-            if (pt[pti] & PAGE_PRESENT) {
-                uintptr_t pa = pt[pti] & PAGE_MASK;
-                pmm_free_page((void*) pa);
-            }
-        }
+// back a page of a file range with the page cache
+// shared ranges map the cached frame itself, read-only until the first write marks it dirty
+// private ranges share it copy-on-write and get their own copy on the first write
+static int vmm_fault_in_file(vmm_region_t* region, uintptr_t va, vmm_lazy_range_t* range, uint32_t error_code) {
+    uint32_t pgoff = range->pgoff + (va - range->start) / PAGE_SIZE;
+    bool write = error_code & PF_WRITE;
+    bool shared = range->flags & PAGE_SHARED;
+    if (write && !(range->flags & PAGE_RW))
+        return -1;
 
-        uintptr_t pt_phys = region->pg_dir[pdi] & PAGE_MASK;
-        pmm_free_page((void*) pt_phys);
+    if (error_code & PF_PRESENT) {
+        // private writes were taken care of by the cow path, only a clean shared page is left
+        if (!write || !shared)
+            return -1;
+        uint32_t* pt = vmm_region_pt(region, pd_index(va));
+        uint32_t pte = pt[pt_index(va)];
+        if (!(pte & PAGE_SHARED))
+            return -1;
+        // writable before dirty, a writeback in between only writes the page out once more
+        pt[pt_index(va)] = pte | PAGE_RW;
+        vmm_tlb_flush(region, va, 1);
+        filemap_mark_dirty(range->file, pgoff);
+        return 0;
     }
 
-    uintptr_t dir_phys = (uintptr_t) region->pg_dir;
-    pmm_free_page((void*) dir_phys);
+    uintptr_t pa = filemap_page(range->file, pgoff, vmm_readahead_window(range, va));
+    if (!pa)
+        return -1;
 
-    region_remove(region);
-    kfree(region, sizeof(vmm_region_t));
-}
+    uint32_t flags = range->flags & ~PAGE_RW;
+    if (shared) {
+        if (write)
+            flags |= PAGE_RW;
+    } else if (write) {
+        uintptr_t copy = vmm_alloc_user_frame();
+        if (!copy) {
+            vmm_free_frame(pa);
+            return -1;
+        }
+        if (highmem_copy_page(copy, pa) < 0) {
+            pmm_free_page((void*) copy);
+            vmm_free_frame(pa);
+            return -1;
+        }
+        vmm_free_frame(pa);
+        pa = copy;
+        flags = range->flags;
+    } else if (range->flags & PAGE_RW) {
+        flags |= PAGE_COW;
+    }
 
-vmm_region_t* vmm_find_region(uintptr_t va) {
-    vmm_region_t* iter = region_list;
-    while (iter) {
-        if (vmm_resolve(iter, va))
-            return iter;
-        iter = iter->next;
+    if (vmm_map(region, va, pa, flags) < 0) {
+        vmm_free_frame(pa);
+        return -1;
     }
+    if (shared && write)
+        filemap_mark_dirty(range->file, pgoff);
     return 0;
 }
 
-size_t vmm_count_regions() {
-    size_t n = 0;
-    vmm_region_t* iter = region_list;
-    while (iter) {
-        n++;
-        iter = iter->next;
+// every page of [va, end) is covered by a lazy reservation
+static bool vmm_range_is_reserved(vmm_region_t* region, uintptr_t va, uintptr_t end) {
+    uintptr_t cur = va;
+    for (vmm_lazy_range_t* range = region->lazy_ranges; range && cur < end; range = range->next) {
+        if (range->end <= cur)
+            continue;
+        if (range->start > cur)
+            return false;
+        cur = range->end;
     }
-    return n;
+    return cur >= end;
 }
 
-int vmm_map_range(vmm_region_t* region, uintptr_t va, uintptr_t pa, size_t pages, uint32_t flags) {
-    for (size_t i = 0; i < pages; i++) {
-        if (vmm_map(region, va + i * PAGE_SIZE, pa + i * PAGE_SIZE, flags) < 0)
-            return -1;
+static int vmm_lazyfree_pte(vmm_region_t* region, uintptr_t va, uint32_t* pte, void* ctx) {
+    (void) ctx;
+    if ((*pte & PAGE_USER) && (*pte & PAGE_DIRTY) && !(*pte & (PAGE_SHARED | PAGE_COW))) {
+        __atomic_and_fetch(pte, ~PAGE_DIRTY, __ATOMIC_ACQ_REL);
+        vmm_tlb_flush(region, va, 1);
     }
     return 0;
 }
 
-int vmm_unmap_range(vmm_region_t* region, uintptr_t va, size_t pages) {
-    for (size_t i = 0; i < pages; i++) {
-        if (vmm_unmap(region, va + i * PAGE_SIZE) < 0)
+// madvise(WILLNEED): swapped pages come back and file pages are read and mapped now,
+// untouched anonymous pages only get their page tables, a zeroed page costs nothing to fault
+// tables are only made for reserved pages, mapped ones have theirs and a gap stays empty
+static int vmm_advise_willneed(vmm_region_t* region, uintptr_t va, uintptr_t end) {
+    for (vmm_lazy_range_t* range = region->lazy_ranges; range && range->start < end; range = range->next) {
+        uintptr_t from = range->start > va ? range->start : va;
+        uintptr_t to = range->end < end ? range->end : end;
+        if (from < to && vmm_prepopulate(region, from, (to - from) / PAGE_SIZE) < 0)
+            return -1;
+    }
+    for (uintptr_t cur = va; cur < end; cur += PAGE_SIZE) {
+        if (vmm_swap_in(region, cur) < 0)
+            return -1;
+        vmm_lazy_range_t* range = vmm_find_lazy_range(region, cur);
+        if (!range || !range->file || vmm_resolve(region, cur))
+            continue;
+        if (vmm_fault_in_file(region, cur, range, 0) < 0)
             return -1;
     }
     return 0;
 }
 
-int vmm_protect(vmm_region_t* region, uintptr_t va, uint32_t flags) {
-    uint32_t pdi = pd_index(va);
-    uint32_t pti = pt_index(va);
-    if (!(region->pg_dir[pdi] & PAGE_PRESENT))
+// apply an madvise hint to [va, va + pages)
+// everything except WILLNEED needs the range to be reserved (mmap), eagerly mapped memory has nothing to fall back to
+int vmm_advise(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t advice) {
+    if (!region || region == &kernel_region || !pages || (va & ~PAGE_MASK))
         return -1;
-    uint32_t* pt = &pg_tbls[pdi * PAGE_ENTRIES];
-    if (!(pt[pti] & PAGE_PRESENT))
+    if (!vmm_in_user_space(va, pages))
+        return -1;
+    uintptr_t end = va + pages * PAGE_SIZE;
+
+    switch (advice) {
+    case VMM_ADV_WILLNEED:
+        return vmm_advise_willneed(region, va, end);
+    case VMM_ADV_NORMAL:
+    case VMM_ADV_RANDOM:
+    case VMM_ADV_SEQUENTIAL:
+    case VMM_ADV_DONTNEED:
+    case VMM_ADV_FREE:
+        break;
+    default:
+        return -1;
+    }
+    if (!vmm_range_is_reserved(region, va, end))
         return -1;
-    pt[pti] = (pt[pti] & PAGE_MASK) | flags | PAGE_PRESENT;
-    invlpg((void*) va);
-    return 0;
-}
 
-uint32_t* vmm_get_pt(vmm_region_t* region, uintptr_t va) {
-    uint32_t pdi = pd_index(va);
-    if (!(region->pg_dir[pdi] & PAGE_PRESENT))
+    // the next touch zero-fills or goes back to the file
+    if (advice == VMM_ADV_DONTNEED) {
+        vmm_release_range(region, va, pages);
         return 0;
-    return &pg_tbls[pdi * PAGE_ENTRIES];
-}
-
-uint32_t vmm_get_pde(vmm_region_t* region, uintptr_t va) {
-    return region->pg_dir[pd_index(va)];
-}
-
-uintptr_t vmm_find_free_range(vmm_region_t* region, size_t pages) {
-    size_t run = 0;
-    uintptr_t start = 0;
-
-    for (uintptr_t va = 0; va < 0xFFFFFFFF; va += PAGE_SIZE) {
-        uint32_t* pt = vmm_get_pt(region, va);
-        uint32_t pde = vmm_get_pde(region, va);
-
-        int used = 0;
-        if (pde & PAGE_PRESENT) {
-            if (pt && (pt[pt_index(va)] & PAGE_PRESENT)) {
-                used = 1;
-            }
-        }
+    }
 
-        if (!used) {
-            if (run == 0)
-                start = va;
-            run++;
-            if (run >= pages) {
-                return start;
-            }
-        } else {
-            run = 0;
+    if (advice == VMM_ADV_FREE) {
+        for (vmm_lazy_range_t* range = vmm_find_lazy_range(region, va); range && range->start < end;
+             range = range->next) {
+            if (range->file)
+                return -1;
         }
     }
+    if (vmm_lazy_split(region, va) < 0 || vmm_lazy_split(region, end) < 0)
+        return -1;
+    for (vmm_lazy_range_t* range = vmm_find_lazy_range(region, va); range && range->start < end; range = range->next) {
+        if (advice == VMM_ADV_FREE)
+            range->lazyfree = true;
+        else
+            range->advice = advice;
+    }
+    if (advice != VMM_ADV_FREE)
+        return 0;
 
-    return 0; // no range found
+    // pages written from here on are dirty again and stay, clean ones may go under pressure
+    tlb_batch_t batch;
+    tlb_batch_t* open = vmm_batch_begin(region, &batch);
+    vmm_walk_ops_t ops = {.pte_entry = vmm_lazyfree_pte, .large_entry = NULL, .ctx = NULL};
+    vmm_walk(region, va, end, &ops);
+    vmm_batch_end(region, open);
+    return 0;
 }
 
-int vmm_map_shared(
-    vmm_region_t* a, vmm_region_t* b, uintptr_t va_a, uintptr_t va_b, uintptr_t pa, size_t pages, uint32_t flags) {
-    for (size_t i = 0; i < pages; i++) {
-        if (vmm_map(a, va_a + i * PAGE_SIZE, pa + i * PAGE_SIZE, flags) < 0)
-            return -1;
-        if (vmm_map(b, va_b + i * PAGE_SIZE, pa + i * PAGE_SIZE, flags) < 0)
-            return -1;
+// give a reserved page its own zeroed frame
+static int vmm_fault_in_anonymous(vmm_region_t* region, uintptr_t va, uint32_t flags) {
+    uintptr_t pa = vmm_alloc_user_frame();
+    if (!pa)
+        return -1;
+    if (highmem_zero_page(pa) < 0 || vmm_map(region, va, pa, flags) < 0) {
+        pmm_free_page((void*) pa);
+        return -1;
     }
     return 0;
 }
 
-int vmm_identity_map(vmm_region_t* region, uintptr_t base, size_t pages, uint32_t flags) {
-    return vmm_map_range(region, base, base, pages, flags);
-}
+// called from the page fault handler
+// returns 0 if the fault was resolved and the instruction can be restarted
+int vmm_handle_page_fault(vmm_region_t* region, uintptr_t va, uint32_t error_code) {
+    if (!region)
+        return -1;
 
-int vmm_is_mapped(vmm_region_t* region, uintptr_t va) {
-    return vmm_resolve(region, va) != 0;
-}
+    uintptr_t page_va = va & PAGE_MASK;
 
-size_t vmm_count_mapped(vmm_region_t* region) {
-    size_t n = 0;
-    for (uintptr_t va = 0; va < KERNEL_VIRT_BASE; va += PAGE_SIZE)
-        if (vmm_is_mapped(region, va))
-            n++;
-    return n;
-}
+    // kernel pde added after this directory was last synced
+    uint32_t pdi = pd_index(page_va);
+    if (!(error_code & PF_PRESENT) && vmm_is_kernel_pde(pdi) && kernel_pd_master &&
+        !(region->pg_dir[pdi] & PAGE_PRESENT) && (kernel_pd_master[pdi] & PAGE_PRESENT)) {
+        region->pg_dir[pdi] = kernel_pd_master[pdi];
+        invlpg((void*) page_va);
+        return 0;
+    }
+
+    // cow pages can live anywhere in the region, not just in lazy ranges
+    if ((error_code & PF_PRESENT) && (error_code & PF_WRITE) && vmm_cow_fault(region, page_va) == 0)
+        return 0;
 
-static void vmm_aslr_init_region(vmm_region_t* region) {
-    if (!region->random_table) {
-        region->random_table = kmalloc(sizeof(aslr_entry_t) * 16);
-        region->random_count = 0;
-        region->random_capacity = 16;
+    // evicted into zram, a failed swap-in must not fall through to the lazy path
+    if (!(error_code & PF_PRESENT)) {
+        int swapped = vmm_swap_in(region, page_va);
+        if (swapped <= 0)
+            return swapped;
     }
-}
 
-static void vmm_aslr_record(vmm_region_t* region, uintptr_t va, size_t pages, size_t align, uint32_t flags) {
-    if (region->random_count >= region->random_capacity) {
-        size_t new_cap = region->random_capacity * 2;
-        region->random_table = krealloc(
-            region->random_table, new_cap * sizeof(aslr_entry_t), region->random_capacity * sizeof(aslr_entry_t));
-        region->random_capacity = new_cap;
+    vmm_lazy_range_t* range = vmm_find_lazy_range(region, page_va);
+    if (!range)
+        return -1;
+    if (range->file)
+        return vmm_fault_in_file(region, page_va, range, error_code);
+
+    if (error_code & PF_PRESENT) {
+        // protection fault, only a write to the zero page is ours to resolve
+        if (!(error_code & PF_WRITE) || !(range->flags & PAGE_RW))
+            return -1;
+        if (!vmm_is_zero_page(vmm_resolve(region, page_va)))
+            return -1;
+        return vmm_fault_in_anonymous(region, page_va, range->flags);
+    }
+
+    if (error_code & PF_WRITE) {
+        if (!(range->flags & PAGE_RW))
+            return -1;
+        return vmm_fault_in_anonymous(region, page_va, range->flags);
     }
 
-    aslr_entry_t* entry = &region->random_table[region->random_count++];
-    entry->va = va;
-    entry->pages = pages;
-    entry->align = align;
-    entry->flags = flags;
+    // read fault, share the zero page until the first write
+    if (!vmm_zero_page)
+        return vmm_fault_in_anonymous(region, page_va, range->flags);
+    return vmm_map(region, page_va, vmm_zero_page, range->flags & ~PAGE_RW);
 }
 
 static uint32_t _vmm_aslr_rng_state = 0x12345678;
@@ -448,23 +2016,10 @@ static uint32_t rand32(void) {
     return _vmm_aslr_rng_state;
 }
 
-static int aslr_table_grow(vmm_region_t* region, size_t want) {
-    size_t newcap = region->random_capacity ? region->random_capacity * 2 : 8;
-    while (newcap < want)
-        newcap *= 2;
-
-    aslr_entry_t* newtab = (aslr_entry_t*) kmalloc(newcap * sizeof(aslr_entry_t));
-    if (!newtab)
-        return -1;
-
-    if (region->random_table) {
-        flop_memcpy(newtab, region->random_table, region->random_count * sizeof(aslr_entry_t));
-        kfree(region->random_table, region->random_capacity * sizeof(aslr_entry_t));
-    }
-    region->random_table = newtab;
-    region->random_capacity = newcap;
-    return 0;
-}
+// placement is drawn from the holes between earlier aslr ranges in O(log n),
+// other mappings are not in the tree so a draw that hits one is retried
+// after that the holes are walked from the bottom, so the result is always aligned and free in the tree
+#define VMM_ASLR_PROBES 4
 
 uintptr_t vmm_aslr_alloc(vmm_region_t* region, size_t pages, size_t align, uint32_t flags) {
     if (!region || pages == 0)
@@ -479,89 +2034,47 @@ uintptr_t vmm_aslr_alloc(vmm_region_t* region, size_t pages, size_t align, uint3
         align = a;
     }
     size_t align_bytes = align * PAGE_SIZE;
+    size_t bytes = pages * PAGE_SIZE;
 
-    const int RANDOM_PROBES = 16;
-    uintptr_t span = (USER_SPACE_END - USER_SPACE_START) & ~(PAGE_SIZE - 1);
-
-    for (int probe = 0; probe < RANDOM_PROBES; ++probe) {
-        uint32_t r = rand32();
-        uintptr_t candidate_offset = ((uint64_t) r * (uint64_t) span) >> 32;
-        uintptr_t candidate = (USER_SPACE_START + candidate_offset) & ~(align_bytes - 1);
-
-        if (candidate < USER_SPACE_START)
-            candidate = USER_SPACE_START;
-        if (candidate + pages * PAGE_SIZE - 1 > USER_SPACE_END)
-            continue;
-
-        int ok = 1;
-        for (size_t i = 0; i < pages; i++) {
-            if (vmm_resolve(region, candidate + i * PAGE_SIZE)) {
-                ok = 0;
-                break;
-            }
-        }
-        if (!ok)
-            continue;
-
-        if (region->random_count + 1 > region->random_capacity) {
-            if (aslr_table_grow(region, region->random_count + 1) != 0)
-                return 0;
-        }
-        aslr_entry_t* e = &region->random_table[region->random_count++];
-        e->va = candidate;
-        e->pages = pages;
-        e->align = align;
-        e->flags = flags;
-        return candidate;
+    uintptr_t va = 0;
+    for (int probe = 0; probe < VMM_ASLR_PROBES && !va; ++probe) {
+        uintptr_t candidate = gap_tree_pick(&region->aslr, bytes, align_bytes, rand32);
+        if (!candidate)
+            break;
+        if (vmm_range_is_free(region, candidate, pages))
+            va = candidate;
     }
 
-    uintptr_t found = vmm_find_free_range(region, pages);
-    if (!found)
-        return 0;
-
-    if (region->random_count + 1 > region->random_capacity) {
-        if (aslr_table_grow(region, region->random_count + 1) != 0)
+    for (uintptr_t from = region->aslr.base; !va;) {
+        uintptr_t candidate = gap_tree_first_fit(&region->aslr, from, bytes, align_bytes);
+        if (!candidate)
+            return 0;
+        if (vmm_range_is_free(region, candidate, pages))
+            va = candidate;
+        else if ((from = candidate + align_bytes) < candidate)
             return 0;
     }
-    aslr_entry_t* e = &region->random_table[region->random_count++];
-    e->va = found;
-    e->pages = pages;
-    e->align = align;
-    e->flags = flags;
-    return found;
+
+    if (gap_tree_insert(&region->aslr, va, va + bytes) != 0)
+        return 0;
+    return va;
 }
 
 void vmm_aslr_free(vmm_region_t* region, uintptr_t va) {
     if (!region)
         return;
-    size_t idx = (size_t) -1;
-    for (size_t i = 0; i < region->random_count; ++i) {
-        if (region->random_table[i].va == va) {
-            idx = i;
-            break;
-        }
-    }
-    if (idx == (size_t) -1)
+    uintptr_t end;
+    if (gap_tree_remove(&region->aslr, va, &end) != 0)
         return;
 
-    aslr_entry_t entry = region->random_table[idx];
-
     /* Just unmap the VA region (caller decides what to do with PA) */
     /* todo: free pages */
-    vmm_unmap_range(region, entry.va, entry.pages);
-
-    if (idx != region->random_count - 1) {
-        region->random_table[idx] = region->random_table[region->random_count - 1];
-    }
-    region->random_count--;
+    vmm_unmap_range(region, va, (end - va) / PAGE_SIZE);
 }
 
+// big aligned spans get 4 MiB pdes
 int vmm_map_direct(vmm_region_t* region, uintptr_t phys, size_t pages, uint32_t flags) {
-    for (size_t i = 0; i < pages; i++) {
-        if (vmm_map(region, phys + i * PAGE_SIZE, phys + i * PAGE_SIZE, flags) < 0)
-            return -1;
-    }
-    return 0;
+    return vmm_identity_map(region, phys, pages, flags);
 }
 
 uintptr_t vmm_map_anonymous(vmm_region_t* region, size_t pages, uint32_t flags) {
@@ -592,13 +2105,11 @@ uintptr_t vmm_map_direct_aslr(vmm_region_t* region, uintptr_t phys, size_t pages
     if (!va)
         return 0;
 
-    for (size_t i = 0; i < pages; i++) {
-        if (vmm_map(region, va + i * PAGE_SIZE, phys + i * PAGE_SIZE, flags) < 0) {
-            for (size_t j = 0; j < i; j++)
-                vmm_unmap(region, va + j * PAGE_SIZE);
-            vmm_aslr_free(region, va);
-            return 0;
-        }
+    // a 4 MiB alignment lets vmm_map_range use large pages for the whole span
+    if (vmm_map_range(region, va, phys, pages, flags) < 0) {
+        vmm_unmap_range(region, va, pages);
+        vmm_aslr_free(region, va);
+        return 0;
     }
 
     return va;
@@ -661,70 +2172,241 @@ static void shuffle_array(uintptr_t* array, size_t n) {
     }
 }
 
-flop_randframe_region_t* rand_frames_create(vmm_region_t* region) {
-    size_t pages = vmm_count_mapped(region);
-    if (!pages)
-        return NULL;
+// regions waiting for a batch, and the one the thread is stepping with the lock dropped
+static flop_randframe_region_t* rand_frames_pending = NULL;
+static flop_randframe_region_t* rand_frames_running = NULL;
+static spinlock_t rand_frames_lock = SPINLOCK_INIT;
+static thread_t* rand_frames_worker = NULL;
+
+// only frames nothing else maps can trade places
+static inline bool rand_frames_movable(uint32_t pte) {
+    uintptr_t pa = pte & PAGE_MASK;
+    return (pte & PAGE_PRESENT) && (pte & PAGE_USER) && !(pte & (PAGE_SHARED | PAGE_COW)) &&
+           !vmm_is_zero_page(pa) && pmm_page_refcount(pa) == 1;
+}
 
-    vmm_region_t* table_region = vmm_region_create(0, PAGE_PRESENT | PAGE_RW | PAGE_USER, NULL);
-    if (!table_region)
+static uint32_t* rand_frames_pte(vmm_region_t* region, uintptr_t va) {
+    uint32_t pde = region->pg_dir[pd_index(va)];
+    if (!(pde & PAGE_PRESENT) || (pde & PAGE_LARGE))
         return NULL;
+    return &vmm_region_pt(region, pd_index(va))[pt_index(va)];
+}
 
-    flop_randframe_region_t* rand_struct = (flop_randframe_region_t*) kmalloc(sizeof(flop_randframe_region_t));
-    rand_struct->entries = (flop_rand_entry_t*) kmalloc(sizeof(flop_rand_entry_t) * pages);
-    rand_struct->src_region = region;
-    rand_struct->table_region = table_region;
-    rand_struct->page_count = pages;
+static bool rand_frames_grow(flop_randframe_region_t* rs) {
+    if (rs->page_count < rs->capacity)
+        return true;
+    size_t cap = rs->capacity ? rs->capacity * 2 : RAND_FRAMES_BATCH;
+    flop_rand_entry_t* entries = (flop_rand_entry_t*) kmalloc(sizeof(flop_rand_entry_t) * cap);
+    if (!entries)
+        return false;
+    if (rs->entries) {
+        flop_memcpy(entries, rs->entries, sizeof(flop_rand_entry_t) * rs->page_count);
+        kfree(rs->entries, sizeof(flop_rand_entry_t) * rs->capacity);
+    }
+    rs->entries = entries;
+    rs->capacity = cap;
+    return true;
+}
 
-    uintptr_t* phys_pages = (uintptr_t*) kmalloc(sizeof(uintptr_t) * pages);
-    size_t idx = 0;
-    for (uintptr_t va = 0; va < 0xFFFFFFFF; va += PAGE_SIZE) {
-        uintptr_t pa = vmm_resolve(region, va);
-        if (!pa)
-            continue;
-        phys_pages[idx++] = pa;
-        if (idx >= pages)
-            break;
+typedef struct {
+    flop_randframe_region_t* rs;
+    size_t budget;
+    size_t shuffled;
+    uintptr_t next;
+} rand_frames_walk_t;
+
+// inside-out fisher-yates: page i trades frames with a random page j <= i, so every
+// prefix of the walk is a uniform shuffle and the pass can stop after any page
+static int rand_frames_step_pte(vmm_region_t* region, uintptr_t va, uint32_t* pte, void* ctx) {
+    rand_frames_walk_t* walk = (rand_frames_walk_t*) ctx;
+    flop_randframe_region_t* rs = walk->rs;
+    if (!walk->budget)
+        return 1;
+    walk->budget--;
+    walk->next = va + PAGE_SIZE;
+    if (!rand_frames_movable(*pte))
+        return 0;
+    if (!rand_frames_grow(rs)) {
+        walk->next = va; // out of memory, the next batch tries again
+        return 1;
     }
 
-    shuffle_array(phys_pages, pages);
+    size_t i = rs->page_count++;
+    rs->entries[i].va = va;
+    rs->entries[i].pa = *pte & PAGE_MASK;
+    walk->shuffled++;
 
-    idx = 0;
-    for (uintptr_t va = 0; va < 0xFFFFFFFF; va += PAGE_SIZE) {
-        uintptr_t pa = vmm_resolve(region, va);
-        if (!pa)
-            continue;
+    size_t j = rand32() % (i + 1);
+    if (j == i)
+        return 0;
+
+    // the other page may have been unmapped, swapped or shared since it was recorded
+    uintptr_t other_va = rs->entries[j].va;
+    uint32_t* other = rand_frames_pte(region, other_va);
+    if (!other || !rand_frames_movable(*other) || (*other & PAGE_MASK) != rs->entries[j].pa)
+        return 0;
+
+    uint32_t a = *pte, b = *other;
+    *pte = (b & PAGE_MASK) | (a & ~PAGE_MASK);
+    *other = (a & PAGE_MASK) | (b & ~PAGE_MASK);
+    // each frame keeps its entry, only the address it is mapped at changes
+    vmm_rmap_move(region, va, a, other_va, *other);
+    vmm_rmap_move(region, other_va, b, va, *pte);
+    vmm_tlb_flush(region, va, 1);
+    vmm_tlb_flush(region, other_va, 1);
+    rs->entries[i].pa = b & PAGE_MASK;
+    rs->entries[j].pa = a & PAGE_MASK;
+    return 0;
+}
+
+// shuffle up to budget more pages starting at the region's cursor
+// returns the number of pages added to the shuffle, rand_struct->done is set at the end
+size_t rand_frames_step(flop_randframe_region_t* rand_struct, size_t budget) {
+    if (!rand_struct || rand_struct->done || !budget)
+        return 0;
+
+    vmm_region_t* region = rand_struct->src_region;
+    rand_frames_walk_t walk = {.rs = rand_struct, .budget = budget, .shuffled = 0, .next = 0};
+    vmm_walk_ops_t ops = {.pte_entry = rand_frames_step_pte, .large_entry = NULL, .ctx = &walk};
+
+    tlb_batch_t batch;
+    tlb_batch_t* open = vmm_batch_begin(region, &batch);
+    int stopped = vmm_walk(region, rand_struct->cursor, KERNEL_VIRT_BASE, &ops);
+    vmm_batch_end(region, open);
+
+    if (stopped)
+        rand_struct->cursor = walk.next;
+    else
+        rand_struct->done = true;
+    return walk.shuffled;
+}
+
+// with rand_frames_lock held, the end of the list so every pending region gets its turn
+static void rand_frames_append_locked(flop_randframe_region_t* rand_struct) {
+    flop_randframe_region_t** link = &rand_frames_pending;
+    while (*link)
+        link = &(*link)->next;
+    rand_struct->next = NULL;
+    *link = rand_struct;
+}
+
+static void rand_frames_queue(flop_randframe_region_t* rand_struct) {
+    bool ints = spinlock(&rand_frames_lock);
+    rand_frames_append_locked(rand_struct);
+    spinlock_unlock(&rand_frames_lock, ints);
+    sched_thread_wake(rand_frames_worker);
+}
+
+// takes rand_frames_lock once the thread is not in the middle of a batch on rand_struct
+static bool rand_frames_lock_idle(flop_randframe_region_t* rand_struct) {
+    for (;;) {
+        bool ints = spinlock(&rand_frames_lock);
+        if (rand_frames_running != rand_struct)
+            return ints;
+        spinlock_unlock(&rand_frames_lock, ints);
+        sched_yield();
+    }
+}
 
-        vmm_unmap(region, va);
+static void rand_frames_dequeue_locked(flop_randframe_region_t* rand_struct) {
+    for (flop_randframe_region_t** link = &rand_frames_pending; *link; link = &(*link)->next) {
+        if (*link == rand_struct) {
+            *link = rand_struct->next;
+            break;
+        }
+    }
+    rand_struct->next = NULL;
+}
 
-        vmm_map(region, va, phys_pages[idx], PAGE_PRESENT | PAGE_RW);
+// the first batch is shuffled right away, the rest of the region by the background thread
+flop_randframe_region_t* rand_frames_create(vmm_region_t* region) {
+    if (!region)
+        return NULL;
 
-        rand_struct->entries[idx].va = va;
-        rand_struct->entries[idx].pa = phys_pages[idx];
-        idx++;
+    flop_randframe_region_t* rand_struct = (flop_randframe_region_t*) kmalloc(sizeof(flop_randframe_region_t));
+    if (!rand_struct)
+        return NULL;
+    vmm_region_t* table_region = vmm_region_create(0, PAGE_PRESENT | PAGE_RW | PAGE_USER, NULL);
+    if (!table_region) {
+        kfree(rand_struct, sizeof(flop_randframe_region_t));
+        return NULL;
     }
 
-    kfree(phys_pages, sizeof(uintptr_t) * pages);
+    rand_struct->src_region = region;
+    rand_struct->table_region = table_region;
+    rand_struct->entries = NULL;
+    rand_struct->page_count = 0;
+    rand_struct->capacity = 0;
+    rand_struct->cursor = 0;
+    rand_struct->done = false;
+    rand_struct->next = NULL;
+
+    rand_frames_step(rand_struct, RAND_FRAMES_BATCH);
+    if (rand_struct->done && !rand_struct->page_count) {
+        vmm_region_destroy(table_region);
+        kfree(rand_struct, sizeof(flop_randframe_region_t));
+        return NULL;
+    }
+    if (!rand_struct->done)
+        rand_frames_queue(rand_struct);
     return rand_struct;
 }
 
+// the shuffled frames stay where they are, only the bookkeeping goes
 void rand_frames_destroy(flop_randframe_region_t* rand_struct) {
     if (!rand_struct)
         return;
 
-    for (size_t i = 0; i < rand_struct->page_count; i++) {
-        vmm_unmap(rand_struct->src_region, rand_struct->entries[i].va);
-        vmm_map(
-            rand_struct->src_region, rand_struct->entries[i].va, rand_struct->entries[i].pa, PAGE_PRESENT | PAGE_RW);
-    }
+    bool ints = rand_frames_lock_idle(rand_struct);
+    rand_frames_dequeue_locked(rand_struct);
+    spinlock_unlock(&rand_frames_lock, ints);
 
     vmm_region_destroy(rand_struct->table_region);
-    kfree(rand_struct->entries, sizeof(flop_rand_entry_t) * rand_struct->page_count);
+    if (rand_struct->entries)
+        kfree(rand_struct->entries, sizeof(flop_rand_entry_t) * rand_struct->capacity);
     kfree(rand_struct, sizeof(flop_randframe_region_t));
 }
 
+// one batch at a time off the head of the list, unfinished regions go to the back
+// the walk and its tlb shootdowns run without the lock, destroy and reshuffle wait for the batch instead
+// with nothing pending the thread sleeps until rand_frames_queue wakes it
+static void rand_frames_thread(void) {
+    for (;;) {
+        bool ints = spinlock(&rand_frames_lock);
+        flop_randframe_region_t* rs = rand_frames_pending;
+        if (rs) {
+            rand_frames_pending = rs->next;
+            rs->next = NULL;
+            rand_frames_running = rs;
+        }
+        spinlock_unlock(&rand_frames_lock, ints);
+
+        if (!rs) {
+            sched_thread_sleep(RAND_FRAMES_IDLE_MS);
+            continue;
+        }
+
+        rand_frames_step(rs, RAND_FRAMES_BATCH);
+
+        ints = spinlock(&rand_frames_lock);
+        rand_frames_running = NULL;
+        if (!rs->done)
+            rand_frames_append_locked(rs);
+        spinlock_unlock(&rand_frames_lock, ints);
+        sched_thread_sleep(RAND_FRAMES_SLEEP_MS);
+    }
+}
+
+void rand_frames_start(void) {
+    rand_frames_worker = sched_create_kernel_thread(rand_frames_thread, 1, "randframes");
+    if (!rand_frames_worker)
+        log("vmm: failed to start frame randomization thread\n", RED);
+}
+
 uintptr_t rand_frames_aslr_map_direct(
     flop_randframe_region_t* rand_struct, uintptr_t phys, size_t pages, uint32_t flags, size_t align) {
+    if (!rand_struct || !rand_struct->page_count)
+        return 0;
     uintptr_t va = vmm_aslr_alloc(rand_struct->src_region, pages, align, flags);
     if (!va)
         return 0;
@@ -743,6 +2425,8 @@ uintptr_t rand_frames_aslr_map_direct(
 
 uintptr_t
 rand_frames_aslr_map_anonymous(flop_randframe_region_t* rand_struct, size_t pages, uint32_t flags, size_t align) {
+    if (!rand_struct || !rand_struct->page_count)
+        return 0;
     uintptr_t va = vmm_aslr_alloc(rand_struct->src_region, pages, align, flags);
     if (!va)
         return 0;
@@ -791,81 +2475,20 @@ int rand_frames_aslr_unmap_anonymous(flop_randframe_region_t* rand_struct, uintp
     return 0;
 }
 
+// start a fresh pass over the region, the old shuffle is the starting point of the new one
 int rand_frames_reshuffle(flop_randframe_region_t* rand_struct) {
-    if (!rand_struct || !rand_struct->entries || !rand_struct->page_count)
-        return -1;
-
-    size_t pages = rand_struct->page_count;
-
-    uintptr_t* phys_pages = (uintptr_t*) kmalloc(sizeof(uintptr_t) * pages);
-    if (!phys_pages)
-        return -1;
-
-    for (size_t i = 0; i < pages; i++)
-        phys_pages[i] = rand_struct->entries[i].pa;
-
-    shuffle_array(phys_pages, pages);
-
-    for (size_t i = 0; i < pages; i++) {
-        uintptr_t va = rand_struct->entries[i].va;
-
-        vmm_unmap(rand_struct->src_region, va);
-
-        if (vmm_map(rand_struct->src_region, va, phys_pages[i], PAGE_PRESENT | PAGE_RW) < 0) {
-            // rollback on failure
-            for (size_t j = 0; j < i; j++) {
-                vmm_unmap(rand_struct->src_region, rand_struct->entries[j].va);
-                vmm_map(rand_struct->src_region,
-                        rand_struct->entries[j].va,
-                        rand_struct->entries[j].pa,
-                        PAGE_PRESENT | PAGE_RW);
-            }
-            kfree(phys_pages, sizeof(uintptr_t) * pages);
-            return -1;
-        }
-
-        rand_struct->entries[i].pa = phys_pages[i];
-    }
-
-    kfree(phys_pages, sizeof(uintptr_t) * pages);
-    return 0;
-}
-
-int rand_frames_reshuffle_partial(flop_randframe_region_t* rand_struct, size_t start, size_t count) {
-    if (!rand_struct || start >= rand_struct->page_count)
-        return -1;
-    if (start + count > rand_struct->page_count)
-        count = rand_struct->page_count - start;
-
-    uintptr_t* phys_pages = (uintptr_t*) kmalloc(sizeof(uintptr_t) * count);
-    if (!phys_pages)
+    if (!rand_struct)
         return -1;
 
-    for (size_t i = 0; i < count; i++)
-        phys_pages[i] = rand_struct->entries[start + i].pa;
-
-    shuffle_array(phys_pages, count);
-
-    for (size_t i = 0; i < count; i++) {
-        uintptr_t va = rand_struct->entries[start + i].va;
-        vmm_unmap(rand_struct->src_region, va);
-
-        if (vmm_map(rand_struct->src_region, va, phys_pages[i], PAGE_PRESENT | PAGE_RW) < 0) {
-            for (size_t j = 0; j < i; j++) {
-                vmm_unmap(rand_struct->src_region, rand_struct->entries[start + j].va);
-                vmm_map(rand_struct->src_region,
-                        rand_struct->entries[start + j].va,
-                        rand_struct->entries[start + j].pa,
-                        PAGE_PRESENT | PAGE_RW);
-            }
-            kfree(phys_pages, sizeof(uintptr_t) * count);
-            return -1;
-        }
-
-        rand_struct->entries[start + i].pa = phys_pages[i];
-    }
-
-    kfree(phys_pages, sizeof(uintptr_t) * count);
+    bool ints = rand_frames_lock_idle(rand_struct);
+    bool queued = !rand_struct->done;
+    rand_struct->page_count = 0;
+    rand_struct->cursor = 0;
+    rand_struct->done = false;
+    if (!queued)
+        rand_frames_append_locked(rand_struct);
+    spinlock_unlock(&rand_frames_lock, ints);
+    sched_thread_wake(rand_frames_worker);
     return 0;
 }
 
@@ -890,6 +2513,10 @@ flop_randframe_region_t* rand_frames_clone_exact(flop_randframe_region_t* src) {
     clone->src_region = src->src_region;
     clone->table_region = table_region;
     clone->page_count = src->page_count;
+    clone->capacity = src->page_count;
+    clone->cursor = 0;
+    clone->done = true; // a clone is a snapshot, the shuffler never picks it up
+    clone->next = NULL;
 
     for (size_t i = 0; i < src->page_count; i++) {
         clone->entries[i].va = src->entries[i].va;
@@ -919,6 +2546,10 @@ flop_randframe_region_t* rand_frames_clone_randomized(flop_randframe_region_t* s
     clone->src_region = src->src_region;
     clone->table_region = table_region;
     clone->page_count = src->page_count;
+    clone->capacity = src->page_count;
+    clone->cursor = 0;
+    clone->done = true;
+    clone->next = NULL;
     for (size_t i = 0; i < src->page_count; i++)
         clone->entries[i].va = src->entries[i].va;
     uintptr_t* phys_pages = (uintptr_t*) kmalloc(sizeof(uintptr_t) * src->page_count);
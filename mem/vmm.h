@@ -2,23 +2,84 @@
 #define VMM_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "../smp/smp.h"
+#include "gaptree.h"
 
 #define PAGE_SIZE 4096
 #define RECURSIVE_PDE 1023
 
-typedef struct aslr_entry {
-    uintptr_t va;
-    size_t pages;
-    size_t align;
-    uint32_t flags;
-} aslr_entry_t;
+// page fault error code bits pushed by the cpu
+#define PF_PRESENT 0x1
+#define PF_WRITE 0x2
+#define PF_USER 0x4
+
+struct filemap;
+
+// madvise advice, the same values as MADV_* in sys/syscall.h
+#define VMM_ADV_NORMAL 0
+#define VMM_ADV_RANDOM 1
+#define VMM_ADV_SEQUENTIAL 2
+#define VMM_ADV_WILLNEED 3
+#define VMM_ADV_DONTNEED 4
+#define VMM_ADV_FREE 8
+
+// file pages read in behind a faulting one, per access pattern
+#define VMM_READAHEAD_PAGES 4
+#define VMM_READAHEAD_SEQUENTIAL 16
+
+// a range that has been reserved but is only backed by frames once it
+// is touched (see vmm_handle_page_fault), anonymous unless file is set
+typedef struct vmm_lazy_range {
+    uintptr_t start;
+    uintptr_t end;
+    uint32_t flags; // PAGE_SHARED on a file range makes writes reach the file
+    struct filemap* file;
+    uint32_t pgoff; // file page mapped at start
+    uint32_t advice; // VMM_ADV_NORMAL, RANDOM or SEQUENTIAL, sizes file readahead
+    bool lazyfree;   // madvise(FREE), reclaim drops clean pages instead of swapping them
+    struct vmm_lazy_range* next;
+} vmm_lazy_range_t;
+
+struct vmm_region;
+
+// pages evicted per reclaim pass when an allocation on the fault path fails
+#define VMM_RECLAIM_BATCH 32
+
+// free frame watermarks, dropping under low wakes the reclaim thread, which evicts until high
+#define VMM_RECLAIM_LOW 256
+#define VMM_RECLAIM_HIGH 512
+#define VMM_RECLAIM_IDLE_MS 1000
+
+// pre-zeroed page table frames kept per cpu, refilled below the low mark
+#define VMM_PT_POOL_SIZE 16
+#define VMM_PT_POOL_LOW 4
+#define VMM_PT_POOL_IDLE_MS 1000 // refill thread's sleep when nobody kicks it
+
+typedef struct vmm_pt_pool_stats {
+    uint32_t hits;     // tables taken from a pool
+    uint32_t misses;   // pool was empty, zeroed on the spot
+    uint32_t refilled; // frames put back by the refill
+} vmm_pt_pool_stats_t;
+
+// callbacks for vmm_walk, a nonzero return stops the walk and is passed back
+// large_entry may be NULL, 4 MiB pages are skipped then
+// pte_entry only sees present entries unless swapped is set, then swap entries are passed too
+typedef struct vmm_walk_ops {
+    int (*pte_entry)(struct vmm_region* region, uintptr_t va, uint32_t* pte, void* ctx);
+    int (*large_entry)(struct vmm_region* region, uintptr_t va, uint32_t* pde, void* ctx);
+    void* ctx;
+    bool swapped;
+} vmm_walk_ops_t;
 
 typedef struct vmm_region {
     uint32_t* pg_dir;
     struct vmm_region* next;
-    aslr_entry_t* random_table;
-    size_t random_count;
-    size_t random_capacity;
+    gap_tree_t aslr; // ranges handed out by vmm_aslr_alloc
+    vmm_lazy_range_t* lazy_ranges;
+    uint32_t kernel_pd_gen; // kernel pde generation this directory was synced to
+    uint32_t active_cpus[(CONFIG_MAX_CPUS + 31) / 32]; // cpus with this directory loaded
+    struct tlb_batch* tlb_batch; // open batch collecting flushes, see vmm_batch_begin
 } vmm_region_t;
 
 typedef struct {
@@ -26,11 +87,20 @@ typedef struct {
     uintptr_t pa;
 } flop_rand_entry_t;
 
-typedef struct {
+// frames are shuffled a batch at a time by a background thread, see rand_frames_step
+#define RAND_FRAMES_BATCH 64
+#define RAND_FRAMES_SLEEP_MS 10   // between batches while regions are pending
+#define RAND_FRAMES_IDLE_MS 1000  // nothing pending, rand_frames_queue cuts this short
+
+typedef struct flop_randframe_region {
     vmm_region_t* src_region;
     vmm_region_t* table_region;
     flop_rand_entry_t* entries;
     size_t page_count;
+    size_t capacity;   // entries allocated
+    uintptr_t cursor;  // next va the shuffle looks at
+    bool done;         // cursor went past the end of user space
+    struct flop_randframe_region* next; // pending list of the background shuffler
 } flop_randframe_region_t;
 
 extern uint32_t* pg_dir;
@@ -38,8 +108,14 @@ extern uint32_t* pg_tbls;
 extern uint32_t* current_pg_dir;
 
 int vmm_alloc_pde(uint32_t* dir, uint32_t pde_idx, uint32_t flags);
-#define USER_SPACE_START 0x00100000U
+#define USER_SPACE_START 0x04000000U // KERNEL_LOW_END, below is the kernel's identity map
 #define USER_SPACE_END 0xBFFFFFFFU
+
+// [va, va + pages) is user space from end to end and does not wrap, so it never reaches a kernel pde
+static inline bool vmm_in_user_space(uintptr_t va, size_t pages) {
+    uint64_t end = (uint64_t) va + (uint64_t) pages * PAGE_SIZE;
+    return pages && va >= USER_SPACE_START && end - 1 <= USER_SPACE_END;
+}
 uintptr_t vmm_aslr_alloc(vmm_region_t* region, size_t pages, size_t align, uint32_t flags);
 void vmm_aslr_free(vmm_region_t* region, uintptr_t va);
 void region_insert(vmm_region_t* region);
@@ -49,6 +125,10 @@ int vmm_map(vmm_region_t* region, uintptr_t va, uintptr_t pa, uint32_t flags);
 int vmm_unmap(vmm_region_t* region, uintptr_t va);
 int vmm_map_range(vmm_region_t* region, uintptr_t va, uintptr_t pa, size_t pages, uint32_t flags);
 int vmm_unmap_range(vmm_region_t* region, uintptr_t va, size_t pages);
+void vmm_release_range(vmm_region_t* region, uintptr_t va, size_t pages);
+int vmm_protect_range(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags);
+int vmm_walk(vmm_region_t* region, uintptr_t start, uintptr_t end, const vmm_walk_ops_t* ops);
+int vmm_range_is_unmapped(vmm_region_t* region, uintptr_t va, size_t pages);
 uintptr_t vmm_find_free_range(vmm_region_t* region, size_t pages);
 int vmm_protect(vmm_region_t* region, uintptr_t va, uint32_t flags);
 vmm_region_t* vmm_region_create(size_t initial_pages, uint32_t flags, uintptr_t* out_va);
@@ -58,5 +138,40 @@ uintptr_t vmm_alloc(vmm_region_t* region, size_t pages, uint32_t flags);
 void vmm_free(vmm_region_t* region, uintptr_t va, size_t pages);
 void vmm_init();
 vmm_region_t* vmm_copy_pagemap(vmm_region_t* src);
+vmm_region_t* vmm_current_region(void);
+vmm_region_t* vmm_region_list(void);
+int vmm_reserve_anonymous(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags);
+int vmm_reserve_file(
+    vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags, struct filemap* file, uint32_t pgoff);
+int vmm_unreserve(vmm_region_t* region, uintptr_t va, size_t pages);
+int vmm_protect_reserved(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t flags);
+int vmm_range_is_free(vmm_region_t* region, uintptr_t va, size_t pages);
+int vmm_move_range(vmm_region_t* region, uintptr_t old_va, uintptr_t new_va, size_t pages);
+int vmm_advise(vmm_region_t* region, uintptr_t va, size_t pages, uint32_t advice);
+vmm_lazy_range_t* vmm_find_lazy_range(vmm_region_t* region, uintptr_t va);
+int vmm_handle_page_fault(vmm_region_t* region, uintptr_t va, uint32_t error_code);
+int vmm_is_zero_page(uintptr_t pa);
+void vmm_free_frame(uintptr_t pa);
+void vmm_release_user_pages(vmm_region_t* region);
+void vmm_sync_kernel_region(vmm_region_t* region);
+struct tlb_batch* vmm_batch_begin(vmm_region_t* region, struct tlb_batch* batch);
+void vmm_batch_end(vmm_region_t* region, struct tlb_batch* batch);
+int vmm_prepare_kernel_pt(uintptr_t va);
+int vmm_install_kernel_pt(uintptr_t va, uintptr_t pt_phys);
+int vmm_map_kernel_mmio(uintptr_t pa, size_t pages);
+int vmm_prepopulate(vmm_region_t* region, uintptr_t va, size_t pages);
+void vmm_pt_pool_refill(void);
+void vmm_pt_pool_start(void);
+void vmm_reclaim_start(void);
+void vmm_pt_pool_get_stats(vmm_pt_pool_stats_t* out);
+int vmm_is_swapped(vmm_region_t* region, uintptr_t va);
+int vmm_wrprotect(vmm_region_t* region, uintptr_t va);
+size_t vmm_reclaim_region(vmm_region_t* region, size_t pages);
+size_t vmm_reclaim(size_t pages);
+flop_randframe_region_t* rand_frames_create(vmm_region_t* region);
+void rand_frames_destroy(flop_randframe_region_t* rand_struct);
+size_t rand_frames_step(flop_randframe_region_t* rand_struct, size_t budget);
+int rand_frames_reshuffle(flop_randframe_region_t* rand_struct);
+void rand_frames_start(void);
 
 #endif
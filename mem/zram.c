@@ -0,0 +1,282 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "zram.h"
+#include "alloc.h"
+#include "utils.h"
+#include "paging.h"
+#include "highmem.h"
+#include "../lib/lz4.h"
+#include "../lib/str.h"
+#include "../lib/logging.h"
+#include "../lib/cycles.h"
+#include "../task/sync/spinlock.h"
+#include <stdatomic.h>
+
+#define ZRAM_NO_SLOT 0xFFFFFFFF
+
+// slots live in fixed chunks that never move, growing the table only adds a chunk
+// slots are handed out from a free list threaded through the fill field
+static zram_slot_t* zram_chunks[ZRAM_MAX_SLOTS / ZRAM_CHUNK_SLOTS];
+static uint32_t zram_capacity = 0;
+static uint32_t zram_used = 0; // slots below this have been handed out at least once
+static uint32_t zram_free_head = ZRAM_NO_SLOT;
+static spinlock_t zram_lock = {0};
+
+// one compressor, zram_comp_lock covers the state and nothing else
+// allocations never happen under either lock
+static spinlock_t zram_comp_lock = {0};
+static lz4_state_t zram_lz4;
+static zram_stats_t zram_stats;
+
+static inline zram_slot_t* zram_slot(uint32_t slot) {
+    return &zram_chunks[slot / ZRAM_CHUNK_SLOTS][slot % ZRAM_CHUNK_SLOTS];
+}
+
+// add a chunk, the caller saw the table full at capacity seen
+// whoever gets the lock first installs theirs, a late one is dropped again
+static int zram_grow(uint32_t seen) {
+    if (seen >= ZRAM_MAX_SLOTS)
+        return -1;
+    zram_slot_t* chunk = (zram_slot_t*) kmalloc(ZRAM_CHUNK_SLOTS * sizeof(zram_slot_t));
+    if (!chunk)
+        return -1;
+
+    bool ints = spinlock(&zram_lock);
+    bool installed = zram_capacity == seen;
+    if (installed) {
+        zram_chunks[seen / ZRAM_CHUNK_SLOTS] = chunk;
+        zram_capacity += ZRAM_CHUNK_SLOTS;
+    }
+    spinlock_unlock(&zram_lock, ints);
+
+    if (!installed)
+        kfree(chunk, ZRAM_CHUNK_SLOTS * sizeof(zram_slot_t));
+    return 0;
+}
+
+// with zram_lock held, ZRAM_NO_SLOT means the table has to grow first
+static uint32_t zram_slot_alloc(void) {
+    if (zram_free_head != ZRAM_NO_SLOT) {
+        uint32_t slot = zram_free_head;
+        zram_free_head = zram_slot(slot)->fill;
+        return slot;
+    }
+    if (zram_used == zram_capacity)
+        return ZRAM_NO_SLOT;
+    return zram_used++;
+}
+
+// with zram_lock held, hands back the buffer for the caller to free after unlocking
+static uint8_t* zram_slot_release(uint32_t slot, uint16_t* len) {
+    zram_slot_t* s = zram_slot(slot);
+    uint8_t* data = s->data;
+    *len = s->len;
+    if (data)
+        zram_stats.compr_bytes -= s->len;
+    else
+        zram_stats.same_filled--;
+    zram_stats.orig_bytes -= PAGE_SIZE;
+    zram_stats.stored--;
+
+    s->data = NULL;
+    s->len = 0;
+    s->refs = 0;
+    s->fill = zram_free_head;
+    zram_free_head = slot;
+    return data;
+}
+
+// a page that is one word over and over (mostly zeroes) needs no buffer at all
+static bool zram_same_filled(const uint32_t* words, uint32_t* fill) {
+    for (size_t i = 1; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (words[i] != words[0])
+            return false;
+    }
+    *fill = words[0];
+    return true;
+}
+
+// compress the frame at pa into a new slot, the caller frees the frame afterwards
+// fails when the store is full or the page would not shrink below ZRAM_MAX_COMPRESSED
+int zram_store(uintptr_t pa, uint32_t* out_slot) {
+    if (!pa || !out_slot)
+        return -1;
+
+    uint64_t start = cycles_now();
+    uint32_t fill = 0;
+    uint8_t* data = NULL;
+    int len = 0;
+
+    // the frame is only looked at through a kmap slot, which is dropped around the allocations
+    const uint32_t* words = (const uint32_t*) kmap_atomic(pa);
+    if (!words)
+        return -1;
+    bool same = zram_same_filled(words, &fill);
+    kunmap_atomic((void*) words);
+
+    // compress into a worst case buffer, then keep only what was used
+    if (!same) {
+        uint8_t* buf = (uint8_t*) kmalloc(ZRAM_MAX_COMPRESSED);
+        if (!buf)
+            return -1;
+        const uint8_t* src = (const uint8_t*) kmap_atomic(pa);
+        if (!src) {
+            kfree(buf, ZRAM_MAX_COMPRESSED);
+            return -1;
+        }
+
+        bool ints = spinlock(&zram_comp_lock);
+        len = lz4_compress(src, PAGE_SIZE, buf, ZRAM_MAX_COMPRESSED, &zram_lz4);
+        spinlock_unlock(&zram_comp_lock, ints);
+        kunmap_atomic((void*) src);
+
+        data = len > 0 ? (uint8_t*) kmalloc((size_t) len) : NULL;
+        if (data)
+            flop_memcpy(data, buf, (size_t) len);
+        kfree(buf, ZRAM_MAX_COMPRESSED);
+        if (!data) {
+            if (len < 0)
+                atomic_fetch_add_explicit((atomic_uint*) &zram_stats.incompressible, 1, memory_order_relaxed);
+            return -1;
+        }
+    }
+
+    bool ints = spinlock(&zram_lock);
+    uint32_t slot;
+    while ((slot = zram_slot_alloc()) == ZRAM_NO_SLOT) {
+        uint32_t seen = zram_capacity;
+        spinlock_unlock(&zram_lock, ints);
+        if (zram_grow(seen) < 0) {
+            if (data)
+                kfree(data, (size_t) len);
+            return -1;
+        }
+        ints = spinlock(&zram_lock);
+    }
+
+    zram_slot_t* s = zram_slot(slot);
+    s->data = data;
+    s->len = data ? (uint16_t) len : 0;
+    s->fill = fill;
+    s->refs = 1;
+    if (data)
+        zram_stats.compr_bytes += (uint32_t) len;
+    else
+        zram_stats.same_filled++;
+
+    zram_stats.stored++;
+    zram_stats.stores++;
+    zram_stats.orig_bytes += PAGE_SIZE;
+    cycles_account(&zram_stats.store_avg_cycles, &zram_stats.store_max_cycles, zram_stats.stores, cycles_now() - start);
+    spinlock_unlock(&zram_lock, ints);
+
+    *out_slot = slot;
+    return 0;
+}
+
+// fill the frame at pa from a slot, the slot keeps its data until zram_free
+int zram_load(uint32_t slot, uintptr_t pa) {
+    if (!pa)
+        return -1;
+
+    uint64_t start = cycles_now();
+    uint8_t* dst = (uint8_t*) kmap_atomic(pa);
+    if (!dst)
+        return -1;
+    bool ints = spinlock(&zram_lock);
+    if (slot >= zram_used || !zram_slot(slot)->refs) {
+        spinlock_unlock(&zram_lock, ints);
+        kunmap_atomic(dst);
+        return -1;
+    }
+
+    zram_slot_t* s = zram_slot(slot);
+    int ret = 0;
+    if (!s->data) {
+        uint32_t* words = (uint32_t*) dst;
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++)
+            words[i] = s->fill;
+    } else if (lz4_decompress(s->data, s->len, dst, PAGE_SIZE) != PAGE_SIZE) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        zram_stats.loads++;
+        cycles_account(&zram_stats.load_avg_cycles, &zram_stats.load_max_cycles, zram_stats.loads, cycles_now() - start);
+    }
+    spinlock_unlock(&zram_lock, ints);
+    kunmap_atomic(dst);
+    return ret;
+}
+
+// fork copied a swap pte, both now point at the slot
+void zram_dup(uint32_t slot) {
+    bool ints = spinlock(&zram_lock);
+    if (slot < zram_used && zram_slot(slot)->refs)
+        zram_slot(slot)->refs++;
+    spinlock_unlock(&zram_lock, ints);
+}
+
+// a swap pte went away (swapped back in, unmapped or its region destroyed)
+void zram_free(uint32_t slot) {
+    uint8_t* data = NULL;
+    uint16_t len = 0;
+    bool ints = spinlock(&zram_lock);
+    if (slot < zram_used && zram_slot(slot)->refs && --zram_slot(slot)->refs == 0)
+        data = zram_slot_release(slot, &len);
+    spinlock_unlock(&zram_lock, ints);
+
+    if (data)
+        kfree(data, len);
+}
+
+void zram_get_stats(zram_stats_t* out) {
+    if (!out)
+        return;
+    bool ints = spinlock(&zram_lock);
+    *out = zram_stats;
+    spinlock_unlock(&zram_lock, ints);
+}
+
+void zram_log_stats(void) {
+    zram_stats_t st;
+    zram_get_stats(&st);
+
+    // ratio in tenths, kib keeps the math in 32 bits
+    uint32_t orig_kib = (uint32_t) (st.orig_bytes >> 10);
+    uint32_t compr_kib = (uint32_t) (st.compr_bytes >> 10);
+    uint32_t ratio = compr_kib ? orig_kib * 10 / compr_kib : 0;
+
+    char buffer[192];
+    flopsnprintf(buffer,
+                 sizeof(buffer),
+                 "zram: %u pages (%u same-filled), %u KiB -> %u KiB, ratio %u.%u, %u refused, "
+                 "store avg %u max %u cycles, load avg %u max %u cycles\n",
+                 st.stored,
+                 st.same_filled,
+                 orig_kib,
+                 compr_kib,
+                 ratio / 10,
+                 ratio % 10,
+                 st.incompressible,
+                 st.store_avg_cycles,
+                 st.store_max_cycles,
+                 st.load_avg_cycles,
+                 st.load_max_cycles);
+    log(buffer, GREEN);
+}
@@ -0,0 +1,42 @@
+#ifndef ZRAM_H
+#define ZRAM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "paging.h"
+
+// compressed in-memory store for evicted anonymous pages
+// a swapped out pte holds the slot number (see PAGE_SWAPPED)
+#define ZRAM_MAX_SLOTS (1u << 20)          // what fits in the frame bits of a pte
+#define ZRAM_MAX_COMPRESSED (PAGE_SIZE * 3 / 4) // anything bigger stays resident
+#define ZRAM_CHUNK_SLOTS 256                    // the slot table grows a chunk at a time
+
+typedef struct zram_slot {
+    uint8_t* data; // compressed bytes, NULL for a same-filled page
+    uint32_t fill; // the repeated word of a same-filled page, next free slot while unused
+    uint16_t len;
+    uint16_t refs; // swap ptes pointing here, fork shares a slot
+} zram_slot_t;
+
+typedef struct zram_stats {
+    uint32_t stored;         // pages held right now
+    uint32_t same_filled;    // of those, pages that were one repeated word and take no buffer
+    uint32_t stores;
+    uint32_t loads;
+    uint32_t incompressible; // refused, would not have saved enough
+    uint64_t orig_bytes;     // uncompressed size of the held pages
+    uint64_t compr_bytes;    // what they take in the store
+    uint32_t store_avg_cycles;
+    uint32_t store_max_cycles;
+    uint32_t load_avg_cycles;
+    uint32_t load_max_cycles;
+} zram_stats_t;
+
+int zram_store(uintptr_t pa, uint32_t* out_slot);
+int zram_load(uint32_t slot, uintptr_t pa);
+void zram_dup(uint32_t slot);
+void zram_free(uint32_t slot);
+void zram_get_stats(zram_stats_t* out);
+void zram_log_stats(void);
+
+#endif // ZRAM_H
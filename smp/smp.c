@@ -8,14 +8,13 @@
 #include "../lib/str.h"
 #include "../interrupts/interrupts.h"
 #include "../task/sync/spinlock.h"
+#include "../task/sched.h"
+#include "../cpu/apic.h"
 #include "../drivers/time/floptime.h"
 #include <stdint.h>
 #include <stddef.h>
 #include <stdatomic.h>
 
-extern uint32_t lapic_read(uint32_t offset);
-extern void lapic_write(uint32_t offset, uint32_t value);
-
 static atomic_int cpu_count_atomic = 0;
 static atomic_int smp_initialized = 0;
 
@@ -24,14 +23,20 @@ static uint8_t cpu_apic_id[CONFIG_MAX_CPUS];
 static void (*remote_fn[CONFIG_MAX_CPUS])(void*);
 static void* remote_arg[CONFIG_MAX_CPUS];
 
-/* pending flag: 1 == a remote_fn is pending for that cpu */
+/* pending flag: 1 == a remote_fn is pending for that cpu, 2 == it is running there */
 static atomic_int remote_pending[CONFIG_MAX_CPUS];
 
+// each cpu has one slot, so only one sender fills them at a time
+static spinlock_t remote_send_lock;
+
 static atomic_uint_fast32_t remote_seq[CONFIG_MAX_CPUS];
 
+// everything is cpu 0 until smp_init_bsp, the lapic may not even be mapped before that
 int smp_fetch_cpu(void) {
-    uint32_t apicid = (lapic_read(0x20) >> 24) & 0xFF;
     int count = atomic_load(&cpu_count_atomic);
+    if (count <= 1)
+        return 0;
+    uint32_t apicid = (lapic_read(0x20) >> 24) & 0xFF;
     for (int i = 0; i < count; ++i) {
         if (cpu_apic_id[i] == (uint8_t) apicid)
             return i;
@@ -68,6 +73,7 @@ void smp_init_bsp(void) {
         atomic_store(&remote_pending[i], 0);
         atomic_store(&remote_seq[i], 0);
     }
+    spinlock_init(&remote_send_lock);
 
     log_uint("smp: BSP initialized, apic id: \n", apicid);
 }
@@ -90,12 +96,32 @@ int smp_register_cpu(uint8_t apic_id) {
     return id;
 }
 
+// entry point for an ap once it is in protected mode with paging on and a stack of its own
+// it gets an idle thread and joins the scheduler, nothing comes back.
+// there is no init/sipi sequence or trampoline yet, so nothing calls this and only the bsp runs
+void smp_ap_main(void) {
+    uint32_t apicid = (lapic_read(0x20) >> 24) & 0xFF;
+    int cpu = smp_register_cpu((uint8_t) apicid);
+    if (cpu < 0 || sched_init_cpu(cpu) < 0) {
+        log_uint("smp: could not bring up apic id ", apicid);
+        for (;;)
+            __asm__ volatile("cli; hlt");
+    }
+
+    apic_init_timer(APIC_TIMER_VECTOR);
+    log_f("smp: CPU %u online\n", cpu);
+    sched_run_idle();
+}
+
 void smp_handle_ipi(void) {
     int me = smp_fetch_cpu();
     if (me < 0 || me >= CONFIG_MAX_CPUS)
         return;
 
-    if (!atomic_load(&remote_pending[me])) {
+    // the ipi and a sender spinning in smp_tell_cpus_to_do_fn can both get here, one of them runs it
+    int expected = 1;
+    if (!atomic_compare_exchange_strong_explicit(&remote_pending[me], &expected, 2, memory_order_acquire,
+                                                 memory_order_relaxed)) {
         return;
     }
 
@@ -112,7 +138,10 @@ void smp_handle_ipi(void) {
     atomic_fetch_add(&remote_seq[me], 1);
 }
 
-void smp_tell_other_cpus_to_do_fn(void (*fn)(void*), void* arg) {
+// run fn(arg) on every cpu set in cpu_mask (bit n == cpu n) and wait for all of them
+// callers may have interrupts off, so whatever was sent to us is run while we wait,
+// for the lock or for the targets. two cpus sending to each other would wait forever otherwise
+void smp_tell_cpus_to_do_fn(uint64_t cpu_mask, void (*fn)(void*), void* arg) {
     if (!fn)
         return;
     int me = smp_fetch_cpu();
@@ -120,9 +149,22 @@ void smp_tell_other_cpus_to_do_fn(void (*fn)(void*), void* arg) {
     if (num_cpus <= 1) {
         return;
     }
+    if (num_cpus > CONFIG_MAX_CPUS)
+        num_cpus = CONFIG_MAX_CPUS;
+
+    // we never ipi ourselves
+    cpu_mask &= ~((uint64_t) 1 << me);
+    if (!cpu_mask)
+        return;
+
+    // taken without touching the interrupt flag, the wait below never needs it off
+    while (!spinlock_trylock(&remote_send_lock)) {
+        smp_handle_ipi();
+        IA32_CPU_RELAX();
+    }
 
     for (int c = 0; c < num_cpus; ++c) {
-        if (c == me)
+        if (!(cpu_mask & ((uint64_t) 1 << c)))
             continue;
         remote_fn[c] = fn;
         remote_arg[c] = arg;
@@ -132,7 +174,7 @@ void smp_tell_other_cpus_to_do_fn(void (*fn)(void*), void* arg) {
     atomic_thread_fence(memory_order_seq_cst);
 
     for (int c = 0; c < num_cpus; ++c) {
-        if (c == me)
+        if (!(cpu_mask & ((uint64_t) 1 << c)))
             continue;
         uint8_t apic = cpu_apic_id[c];
         send_ipi_to_apic(apic, SMP_IPI_VECTOR);
@@ -140,14 +182,16 @@ void smp_tell_other_cpus_to_do_fn(void (*fn)(void*), void* arg) {
 
     /* wait for all remotes to clear pending */
     for (int c = 0; c < num_cpus; ++c) {
-        if (c == me)
+        if (!(cpu_mask & ((uint64_t) 1 << c)))
             continue;
-        int spins = 0;
         while (atomic_load_explicit(&remote_pending[c], memory_order_acquire)) {
-            cpu_relax();
-            spins++;
-            if ((spins & 0xFFF) == 0) {
-            }
+            smp_handle_ipi();
+            IA32_CPU_RELAX();
         }
     }
+    spinlock_unlock_noint(&remote_send_lock);
+}
+
+void smp_tell_other_cpus_to_do_fn(void (*fn)(void*), void* arg) {
+    smp_tell_cpus_to_do_fn(~(uint64_t) 0, fn, arg);
 }
@@ -17,7 +17,9 @@ int smp_fetch_cpu(void);
 int smp_cpu_count(void);
 
 void smp_tell_other_cpus_to_do_fn(void (*fn)(void*), void* arg);
+void smp_tell_cpus_to_do_fn(uint64_t cpu_mask, void (*fn)(void*), void* arg);
 
 void smp_handle_ipi(void);
+void smp_ap_main(void);
 
 #endif /* SMP_H */
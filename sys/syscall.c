@@ -17,6 +17,7 @@ You should have received a copy of the GNU General Public License along with Flo
 #include "../mem/pmm.h"
 #include "../mem/paging.h"
 #include "../mem/vmm.h"
+#include "../mem/filemap.h"
 #include "../mem/slab.h"
 #include "../mem/utils.h"
 #include "../fs/vfs/vfs.h"
@@ -27,6 +28,7 @@ You should have received a copy of the GNU General Public License along with Flo
 #include "../task/sync/spinlock.h"
 #include "../task/process.h"
 #include "../task/sched.h"
+#include "../task/ipc/shm.h"
 #include "../drivers/time/floptime.h"
 #include "../drivers/acpi/acpi.h"
 #include <stdint.h>
@@ -373,56 +375,8 @@ int sys_print(struct syscall_args* args) {
 
 // rollback a failed mmap allocation
 static void sys_mmap_internal_rb(vmm_region_t* region, uintptr_t start_va, uintptr_t end_va) {
-    for (uintptr_t va = start_va; va < end_va; va += PAGE_SIZE) {
-        uintptr_t phys_addr = vmm_resolve(region, va);
-        if (phys_addr) {
-            vmm_unmap(region, va);
-            pmm_free_page((void*) phys_addr);
-        }
-    }
-}
-
-// allocate and map pages for mmap
-static int sys_mmap_internal_alloc(
-    vmm_region_t* region, uintptr_t base_vaddr, uint32_t length, uint32_t flags, struct vfs_node* node) {
-    uintptr_t end_vaddr = base_vaddr + length;
-    // iterate through each page and allocate + map
-    for (uintptr_t cur_vaddr = base_vaddr; cur_vaddr < end_vaddr; cur_vaddr += PAGE_SIZE) {
-        void* phys_page = pmm_alloc_page();
-        if (!phys_page) {
-            sys_mmap_internal_rb(region, base_vaddr, cur_vaddr);
-            return -1;
-        }
-        // if we have a node, read data into the page
-        if (node) {
-            int read_bytes = vfs_read(node, phys_page, PAGE_SIZE);
-            // zero out the rest of the page if we read less than a page
-            if (read_bytes < 0) {
-                uint8_t* bp = (uint8_t*) phys_page;
-                for (size_t i = 0; i < PAGE_SIZE; i++) {
-                    bp[i] = 0;
-                };
-                // partially read page
-            } else if ((size_t) read_bytes < PAGE_SIZE) {
-                uint8_t* bp = (uint8_t*) phys_page;
-                for (size_t i = read_bytes; i < PAGE_SIZE; i++) {
-                    bp[i] = 0;
-                }
-            }
-
-        }
-        // no node, just zero the page
-        else {
-            uint8_t* bp = (uint8_t*) phys_page;
-            for (size_t i = 0; i < PAGE_SIZE; i++) {
-                bp[i] = 0;
-            }
-        }
-
-        vmm_map(region, cur_vaddr, (uintptr_t) phys_page, flags);
-    }
-
-    return 0;
+    vmm_release_range(region, start_va, (end_va - start_va) / PAGE_SIZE);
+    vmm_unreserve(region, start_va, (end_va - start_va) / PAGE_SIZE);
 }
 
 // get the virtual address for mmap
@@ -446,8 +400,8 @@ static int sys_mmap_internal_get_va(vmm_region_t* region, uint32_t requested_va,
     return 0;
 }
 
-// find the vfs_node for mmap and seek to offset
-int sys_mmap_internal_find_and_seek(int fd, struct vfs_node** out_node, uint32_t offset) {
+// find the vfs_node for mmap
+int sys_mmap_internal_find_node(int fd, struct vfs_node** out_node) {
     process_t* proc = proc_get_current();
 
     if (fd < 0 || fd >= MAX_PROC_FDS) {
@@ -462,12 +416,6 @@ int sys_mmap_internal_find_and_seek(int fd, struct vfs_node** out_node, uint32_t
     }
 
     *out_node = descriptor->node;
-
-    // seek to offset and return 0
-    if (vfs_seek(*out_node, offset, 0) < 0) {
-        return -1;
-    }
-
     return 0;
 }
 
@@ -499,10 +447,10 @@ int sys_mmap(struct syscall_args* args) {
         return -1;
     }
 
-    // find vfs_node if fd is given
+    // find vfs_node if fd is given, file offsets must be page aligned
     struct vfs_node* node = NULL;
     if (fd >= 0) {
-        if (sys_mmap_internal_find_and_seek(fd, &node, offset) < 0) {
+        if ((offset & (PAGE_SIZE - 1)) || sys_mmap_internal_find_node(fd, &node) < 0) {
             return -1;
         }
     }
@@ -513,8 +461,28 @@ int sys_mmap(struct syscall_args* args) {
         return -1;
     }
 
-    // allocate and map pages
-    if (sys_mmap_internal_alloc(region, map_start_va, len, flags, node) < 0) {
+    // anonymous mappings are only reserved, the page fault handler backs them
+    if (!node) {
+        if (vmm_reserve_anonymous(region, map_start_va, len / PAGE_SIZE, flags) < 0) {
+            return -1;
+        }
+        return map_start_va;
+    }
+
+    // file mappings too, pages come out of the page cache when they are touched
+    // a writable shared mapping needs a file that was opened for writing
+    bool writable = (flags & MAP_SHARED) && (flags & PAGE_RW);
+    if (writable && !(node->vfs_mode & VFS_MODE_W)) {
+        return -1;
+    }
+
+    filemap_t* file = filemap_get(node, writable);
+    if (!file) {
+        return -1;
+    }
+    int ret = vmm_reserve_file(region, map_start_va, len / PAGE_SIZE, flags, file, offset / PAGE_SIZE);
+    filemap_put(file);
+    if (ret < 0) {
         return -1;
     }
 
@@ -522,6 +490,17 @@ int sys_mmap(struct syscall_args* args) {
     return map_start_va;
 }
 
+// reserve the pages a growing mapping gained, they are faulted in like the rest of it
+// a file mapping keeps going through the file, anything else gets anonymous pages
+static int sys_mremap_internal_extend(vmm_region_t* region, uintptr_t tail, size_t pages, uint32_t flags) {
+    vmm_lazy_range_t* last = vmm_find_lazy_range(region, tail - PAGE_SIZE);
+    if (last && last->file) {
+        uint32_t pgoff = last->pgoff + (tail - last->start) / PAGE_SIZE;
+        return vmm_reserve_file(region, tail, pages, last->flags, last->file, pgoff);
+    }
+    return vmm_reserve_anonymous(region, tail, pages, last ? last->flags : flags);
+}
+
 // mremap; returns virtual address or -1
 int sys_mremap(struct syscall_args* args) {
     if (!args->a1 || !args->a2 || !args->a3 || !args->a4) {
@@ -539,12 +518,20 @@ int sys_mremap(struct syscall_args* args) {
         return -1;
     }
 
-    if (old_len == 0 || new_len == 0)
+    if (old_len == 0 || new_len == 0 || (addr & (PAGE_SIZE - 1)))
         return -1;
 
-    // page align new and old lengths
+    // page align new and old lengths, one that wraps to 0 while rounding up is refused
     old_len = ALIGN_UP(old_len, PAGE_SIZE);
     new_len = ALIGN_UP(new_len, PAGE_SIZE);
+    if (old_len == 0 || new_len == 0)
+        return -1;
+
+    // the old range has to be user space, the grown one is checked where it is placed
+    if (!vmm_in_user_space(addr, old_len / PAGE_SIZE)) {
+        log("sys: mremap range outside user space", RED);
+        return -1;
+    }
 
     // fetch current process and vm region
     process_t* proc = proc_get_current();
@@ -562,29 +549,33 @@ int sys_mremap(struct syscall_args* args) {
         uintptr_t shrink_end = addr + old_len;
         sys_mmap_internal_rb(region, shrink_start, shrink_end);
         return addr;
-    } else {
-        // expand
-        uintptr_t expand_start = addr + old_len;
-        uintptr_t expand_end = addr + new_len;
-
-        // iterate through each page and allocate + map
-        for (uintptr_t va = expand_start; va < expand_end; va += PAGE_SIZE) {
-            void* phys_page = pmm_alloc_page();
-            // allocation failed, rollback and return -1
-            if (!phys_page) {
-                sys_mmap_internal_rb(region, expand_start, va);
-                return -1;
-            }
-            // zero out the page
-            uint8_t* bp = (uint8_t*) phys_page;
-            for (size_t i = 0; i < PAGE_SIZE; i++)
-                bp[i] = 0;
-            // map the page
-            vmm_map(region, va, (uintptr_t) phys_page, flags);
-        }
-        // return the starting virtual address
-        return addr;
     }
+
+    // expand, the whole old range has to be ours
+    uintptr_t old_end = addr + old_len;
+    size_t extra = (new_len - old_len) / PAGE_SIZE;
+    for (uintptr_t va = addr; va < old_end; va += PAGE_SIZE) {
+        if (!vmm_resolve(region, va) && !vmm_find_lazy_range(region, va) && !vmm_is_swapped(region, va))
+            return -1;
+    }
+
+    // grow in place when nothing follows the mapping, otherwise move its page table
+    // entries to a range with room, the data pages are never copied either way
+    uintptr_t base = addr;
+    if (!vmm_range_is_free(region, old_end, extra)) {
+        base = vmm_find_free_range(region, new_len / PAGE_SIZE);
+        if (!base || !vmm_range_is_free(region, base, new_len / PAGE_SIZE))
+            return -1;
+        if (vmm_move_range(region, addr, base, old_len / PAGE_SIZE) < 0)
+            return -1;
+    }
+
+    if (sys_mremap_internal_extend(region, base + old_len, extra, flags) < 0) {
+        if (base != addr)
+            vmm_move_range(region, base, addr, old_len / PAGE_SIZE);
+        return -1;
+    }
+    return base;
 }
 
 // validate a memory mapping for munmap
@@ -605,13 +596,7 @@ static int sys_munmap_internal_validate(vmm_region_t* region, uintptr_t addr, ui
 
 // free physical pages for munmap; also unmaps them
 static void sys_munmap_internal_free_phys(vmm_region_t* region, uintptr_t start_va, uintptr_t end_va) {
-    for (uintptr_t va = start_va; va < end_va; va += PAGE_SIZE) {
-        uintptr_t phys = vmm_resolve(region, va);
-        if (phys) {
-            vmm_unmap(region, va);
-            pmm_free_page((void*) phys);
-        }
-    }
+    vmm_release_range(region, start_va, (end_va - start_va) / PAGE_SIZE);
 }
 
 // unmap a memory range for munmap
@@ -620,13 +605,14 @@ static int sys_munmap_internal_unmap_range(vmm_region_t* region, uintptr_t addr,
 
     for (uintptr_t va = addr; va < end; va += PAGE_SIZE) {
         uintptr_t phys = vmm_resolve(region, va);
-        if (!phys) {
+        if (!phys && !vmm_find_lazy_range(region, va) && !vmm_is_swapped(region, va)) {
             // not mapped
             return -1;
         }
     }
 
     sys_munmap_internal_free_phys(region, addr, end);
+    vmm_unreserve(region, addr, len / PAGE_SIZE);
     return 0;
 }
 
@@ -1233,13 +1219,15 @@ int sys_link(struct syscall_args* args) {
 
 // get maximum priority; returns max priority
 int sys_get_priority_max(struct syscall_args* args) {
-    (void) args;
+    if (args && (args->a1 == SCHED_FIFO || args->a1 == SCHED_RR))
+        return SCHED_RT_PRIO_MAX;
     return MAX_PRIORITY;
 }
 
 // get minimum priority; returns min priority
 int sys_get_priority_min(struct syscall_args* args) {
-    (void) args;
+    if (args && (args->a1 == SCHED_FIFO || args->a1 == SCHED_RR))
+        return SCHED_RT_PRIO_MIN;
     return 0;
 }
 
@@ -1341,21 +1329,298 @@ int sys_mprotect(struct syscall_args* args) {
     for (uintptr_t va = addr; va < end; va += PAGE_SIZE) {
         uintptr_t phys = vmm_resolve(region, va);
 
-        if (!phys) {
+        if (!phys && !vmm_find_lazy_range(region, va) && !vmm_is_swapped(region, va)) {
             return -1;
         }
     }
 
-    for (uintptr_t va = addr; va < end; va += PAGE_SIZE) {
-        vmm_protect(region, va, flags);
-    }
+    vmm_protect_range(region, addr, len / PAGE_SIZE, flags);
+
+    // pages not faulted in yet pick the new flags up on first touch
+    vmm_protect_reserved(region, addr, len / PAGE_SIZE, flags);
 
     return 0;
 }
 
+// create a shared memory object; returns a handle or -1
+int sys_shm_create(struct syscall_args* args) {
+    if (!args || !args->a2) {
+        log("sys: invalid args passed to sys_shm_create", RED);
+        return -1;
+    }
+
+    const char* name = (const char*) args->a1;
+    uint32_t len = (uint32_t) args->a2;
+
+    if (args->a3 || args->a4 || args->a5) {
+        log("sys: invalid args passed to sys_shm_create", RED);
+        return -1;
+    }
+
+    process_t* proc = proc_get_current();
+    if (!proc) {
+        return -1;
+    }
+
+    shm_object_t* obj = shm_create(name, ALIGN_UP(len, PAGE_SIZE) / PAGE_SIZE);
+    if (!obj) {
+        return -1;
+    }
+
+    int handle = shm_install(proc, obj);
+    if (handle < 0) {
+        shm_put(obj);
+        return -1;
+    }
+    return handle;
+}
+
+// open a named shared memory object; returns a handle or -1
+int sys_shm_open(struct syscall_args* args) {
+    if (!args || !args->a1) {
+        log("sys: invalid args passed to sys_shm_open", RED);
+        return -1;
+    }
+
+    const char* name = (const char*) args->a1;
+
+    if (args->a2 || args->a3 || args->a4 || args->a5) {
+        log("sys: invalid args passed to sys_shm_open", RED);
+        return -1;
+    }
+
+    process_t* proc = proc_get_current();
+    if (!proc) {
+        return -1;
+    }
+
+    shm_object_t* obj = shm_open(name);
+    if (!obj) {
+        return -1;
+    }
+
+    int handle = shm_install(proc, obj);
+    if (handle < 0) {
+        shm_put(obj);
+        return -1;
+    }
+    return handle;
+}
+
+// map a shared memory object, addr 0 picks a free range; returns virtual address or -1
+int sys_shm_map(struct syscall_args* args) {
+    if (!args) {
+        return -1;
+    }
+
+    int handle = (int) args->a1;
+    uintptr_t addr = (uintptr_t) args->a2;
+    uint32_t flags = (uint32_t) args->a3;
+
+    if (args->a4 || args->a5) {
+        log("sys: invalid args passed to sys_shm_map", RED);
+        return -1;
+    }
+
+    process_t* proc = proc_get_current();
+    if (!proc || !proc->region) {
+        return -1;
+    }
+
+    shm_object_t* obj = shm_lookup(proc, handle);
+    if (!obj) {
+        return -1;
+    }
+
+    // a fixed address has to leave room for the whole object below the kernel
+    if (addr && !vmm_in_user_space(addr, obj->pages)) {
+        log("sys: shm_map address outside user space", RED);
+        return -1;
+    }
+
+    uintptr_t va = shm_map(obj, proc->region, addr, flags);
+    if (!va) {
+        return -1;
+    }
+    return va;
+}
+
+// unmap a shared memory mapping; returns 0 or -1
+int sys_shm_unmap(struct syscall_args* args) {
+    if (!args || !args->a1 || !args->a2) {
+        log("sys: invalid args passed to sys_shm_unmap", RED);
+        return -1;
+    }
+
+    uintptr_t addr = (uintptr_t) args->a1;
+    uint32_t len = (uint32_t) args->a2;
+
+    if (args->a3 || args->a4 || args->a5) {
+        log("sys: invalid args passed to sys_shm_unmap", RED);
+        return -1;
+    }
+
+    process_t* proc = proc_get_current();
+    if (!proc || !proc->region) {
+        return -1;
+    }
+
+    return shm_unmap(proc->region, addr, ALIGN_UP(len, PAGE_SIZE) / PAGE_SIZE);
+}
+
+// drop a shared memory handle, existing mappings stay valid; returns 0 or -1
+int sys_shm_close(struct syscall_args* args) {
+    if (!args) {
+        return -1;
+    }
+
+    int handle = (int) args->a1;
+
+    if (args->a2 || args->a3 || args->a4 || args->a5) {
+        log("sys: invalid args passed to sys_shm_close", RED);
+        return -1;
+    }
+
+    process_t* proc = proc_get_current();
+    if (!proc) {
+        return -1;
+    }
+
+    return shm_close(proc, handle);
+}
+
+// hint how a range of memory will be used; returns 0 or -1
+int sys_madvise(struct syscall_args* args) {
+    if (!args || !args->a1 || !args->a2) {
+        log("sys: invalid args passed to sys_madvise", RED);
+        return -1;
+    }
+
+    uintptr_t addr = (uintptr_t) args->a1;
+    uint32_t len = (uint32_t) args->a2;
+    uint32_t advice = (uint32_t) args->a3;
+
+    if (args->a4 || args->a5) {
+        log("sys: invalid args passed to sys_madvise", RED);
+        return -1;
+    }
+
+    if (addr & (PAGE_SIZE - 1)) {
+        return -1;
+    }
+
+    process_t* proc = proc_get_current();
+    if (!proc || !proc->region) {
+        return -1;
+    }
+
+    return vmm_advise(proc->region, addr, ALIGN_UP(len, PAGE_SIZE) / PAGE_SIZE, advice);
+}
+
+// a thread of the calling process by id, 0 is the caller itself
+static thread_t* sys_sched_thread(uint32_t tid) {
+    thread_t* current = sched_current_thread();
+    if (!tid || !current)
+        return current;
+
+    process_t* proc = proc_get_current();
+    if (!proc || !proc->threads) {
+        return NULL;
+    }
+
+    bool ints = spinlock(&proc->threads->lock);
+    thread_t* thread = proc->threads->head;
+    while (thread && thread->id != tid)
+        thread = thread->next;
+    spinlock_unlock(&proc->threads->lock, ints);
+    return thread;
+}
+
+// set the scheduling policy of a thread; returns 0 or -1 on failure
+int sys_sched_setscheduler(struct syscall_args* args) {
+    if (!args) {
+        log("sys: invalid args passed to sys_sched_setscheduler", RED);
+        return -1;
+    }
+
+    int policy = (int) args->a2;
+    unsigned priority = (unsigned) args->a3;
+    uint32_t quantum_ms = (uint32_t) args->a4;
+
+    if (args->a5) {
+        log("sys: invalid args passed to sys_sched_setscheduler", RED);
+        return -1;
+    }
+
+    thread_t* thread = sys_sched_thread(args->a1);
+    if (!thread) {
+        return -1;
+    }
+
+    // an rt thread can keep everything else off its cpu for most of each period, and a strict
+    // priority thread outranks every fair one. only root moves a thread into those or above its base
+    process_t* proc = proc_get_current();
+    if (proc && proc->uid != 0) {
+        if (policy == SCHED_FIFO || policy == SCHED_RR) {
+            return -1;
+        }
+        if (policy == SCHED_PRIO && thread->policy != SCHED_PRIO) {
+            return -1;
+        }
+        if (priority > thread->priority.base) {
+            return -1;
+        }
+    }
+
+    return sched_setscheduler(thread, policy, priority, quantum_ms);
+}
+
+// get the scheduling policy of a thread; returns the policy or -1 on failure
+int sys_sched_getscheduler(struct syscall_args* args) {
+    if (!args) {
+        return -1;
+    }
+    return sched_getscheduler(sys_sched_thread(args->a1));
+}
+
+// get the priority a thread is scheduled at; returns the priority or -1 on failure
+int sys_sched_getparam(struct syscall_args* args) {
+    if (!args) {
+        return -1;
+    }
+
+    thread_t* thread = sys_sched_thread(args->a1);
+    if (!thread) {
+        return -1;
+    }
+    if (thread->policy == SCHED_FIFO || thread->policy == SCHED_RR) {
+        return (int) thread->rt_priority;
+    }
+    return (int) thread->priority.base;
+}
+
+// get the round robin turn of a thread; returns ms or -1 on failure
+int sys_sched_rr_get_interval(struct syscall_args* args) {
+    if (!args) {
+        return -1;
+    }
+
+    thread_t* thread = sys_sched_thread(args->a1);
+    if (!thread) {
+        return -1;
+    }
+    if (thread->policy != SCHED_RR) {
+        return 0;
+    }
+    return (int) (thread->rr_quantum * TIMER_MS_PER_TICK);
+}
+
 // called by the assembly syscall_routine when handling the 0x80 software interrupt
 int c_syscall_routine(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5) {
     struct syscall_args args = {.a1 = a1, .a2 = a2, .a3 = a3, .a4 = a4, .a5 = a5};
 
-    return syscall_dispatch_table[num](&args);
+    int ret = syscall_dispatch_table[num](&args);
+    // on the way out is where a thread whose slice ran out gives up the cpu
+    sched_preempt_point();
+    return ret;
 }
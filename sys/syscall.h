@@ -14,6 +14,17 @@ struct syscall_args {
 
 typedef int (*syscall_function_pointer)(struct syscall_args*);
 
+// mmap flag, same bit as PAGE_SHARED: writes to a file mapping reach the file and every other mapping of it
+#define MAP_SHARED 0x400
+
+// madvise hints
+#define MADV_NORMAL 0     // default readahead
+#define MADV_RANDOM 1     // no readahead for file pages
+#define MADV_SEQUENTIAL 2 // large readahead for file pages
+#define MADV_WILLNEED 3   // swap in and read/map file pages now
+#define MADV_DONTNEED 4   // drop the pages, the next touch zero-fills or rereads the file
+#define MADV_FREE 8       // anonymous pages may be dropped under memory pressure unless written again
+
 typedef enum syscall_num {
     SYSCALL_READ = 0,
     SYSCALL_WRITE = 1,
@@ -56,7 +67,17 @@ typedef enum syscall_num {
     SYSCALL_COPY_FILE_RANGE = 38,
     SYSCALL_GETCWD = 39,
     SYSCALL_MPROTECT = 40,
-    SYSCALL_MREMAP = 41
+    SYSCALL_MREMAP = 41,
+    SYSCALL_SHM_CREATE = 42,
+    SYSCALL_SHM_OPEN = 43,
+    SYSCALL_SHM_MAP = 44,
+    SYSCALL_SHM_UNMAP = 45,
+    SYSCALL_SHM_CLOSE = 46,
+    SYSCALL_MADVISE = 47,
+    SYSCALL_SCHED_SETSCHEDULER = 48,
+    SYSCALL_SCHED_GETSCHEDULER = 49,
+    SYSCALL_SCHED_GETPARAM = 50,
+    SYSCALL_SCHED_RR_GET_INTERVAL = 51
 } syscall_num_t;
 
 typedef struct syscall_table {
@@ -94,6 +115,16 @@ typedef struct syscall_table {
     int (*sys_copy_file_range)(struct syscall_args* args);
     int (*sys_mprotect)(struct syscall_args* args);
     int (*sys_mremap)(struct syscall_args* args);
+    int (*sys_shm_create)(struct syscall_args* args);
+    int (*sys_shm_open)(struct syscall_args* args);
+    int (*sys_shm_map)(struct syscall_args* args);
+    int (*sys_shm_unmap)(struct syscall_args* args);
+    int (*sys_shm_close)(struct syscall_args* args);
+    int (*sys_madvise)(struct syscall_args* args);
+    int (*sys_sched_setscheduler)(struct syscall_args* args);
+    int (*sys_sched_getscheduler)(struct syscall_args* args);
+    int (*sys_sched_getparam)(struct syscall_args* args);
+    int (*sys_sched_rr_get_interval)(struct syscall_args* args);
     struct vfs_node* (*sys_getcwd)(struct syscall_args* args);
     pid_t (*sys_fork)(struct syscall_args* args);
     uid_t (*sys_getuid)(struct syscall_args* args);
@@ -122,6 +153,7 @@ int sys_open(struct syscall_args* args);
 int sys_close(struct syscall_args* args);
 
 // 5: mmap(addr, len, flags, fd, offset)
+// flags are page flags, file mappings are private copy-on-write unless MAP_SHARED is set
 int sys_mmap(struct syscall_args* args);
 
 // 6: seek(fd, offset, whence)
@@ -211,10 +243,10 @@ int sys_setgid(struct syscall_args* args);
 // 34: regidt(rgid, gid)
 int sys_regidt(struct syscall_args* args);
 
-// 35: get_priority_max()
+// 35: get_priority_max(policy)
 int sys_get_priority_max(struct syscall_args* args);
 
-// 36: get_priority_min()
+// 36: get_priority_min(policy)
 int sys_get_priority_min(struct syscall_args* args);
 
 // 37: fsmount(source, target, flags)
@@ -230,8 +262,40 @@ int sys_getcwd(struct syscall_args* args);
 int sys_mprotect(struct syscall_args* args);
 
 // 41: mremap(addr, old_len, new_len, flags)
+// grows in place or moves the mapping (returns the new address), pages are never copied
 int sys_mremap(struct syscall_args* args);
 
+// 42: shm_create(name, len), a null name makes an anonymous object
+int sys_shm_create(struct syscall_args* args);
+
+// 43: shm_open(name)
+int sys_shm_open(struct syscall_args* args);
+
+// 44: shm_map(handle, addr, flags)
+int sys_shm_map(struct syscall_args* args);
+
+// 45: shm_unmap(addr, len)
+int sys_shm_unmap(struct syscall_args* args);
+
+// 46: shm_close(handle)
+int sys_shm_close(struct syscall_args* args);
+
+// 47: madvise(addr, len, advice), one of the MADV_* hints
+int sys_madvise(struct syscall_args* args);
+
+// 48: sched_setscheduler(tid, policy, priority, quantum_ms), tid 0 is the caller
+// SCHED_FIFO and SCHED_RR take an rt priority and need uid 0, quantum_ms 0 is the default rr turn
+int sys_sched_setscheduler(struct syscall_args* args);
+
+// 49: sched_getscheduler(tid), returns the SCHED_* policy
+int sys_sched_getscheduler(struct syscall_args* args);
+
+// 50: sched_getparam(tid), returns the rt priority under fifo and rr, the base priority otherwise
+int sys_sched_getparam(struct syscall_args* args);
+
+// 51: sched_rr_get_interval(tid), returns the rr turn in ms, 0 for other policies
+int sys_sched_rr_get_interval(struct syscall_args* args);
+
 syscall_function_pointer syscall_dispatch_table[] = {
     [SYSCALL_READ] = sys_read,
     [SYSCALL_WRITE] = sys_write,
@@ -275,6 +339,16 @@ syscall_function_pointer syscall_dispatch_table[] = {
     [SYSCALL_GETCWD] = sys_getcwd,
     [SYSCALL_MPROTECT] = sys_mprotect,
     [SYSCALL_MREMAP] = sys_mremap,
+    [SYSCALL_SHM_CREATE] = sys_shm_create,
+    [SYSCALL_SHM_OPEN] = sys_shm_open,
+    [SYSCALL_SHM_MAP] = sys_shm_map,
+    [SYSCALL_SHM_UNMAP] = sys_shm_unmap,
+    [SYSCALL_SHM_CLOSE] = sys_shm_close,
+    [SYSCALL_MADVISE] = sys_madvise,
+    [SYSCALL_SCHED_SETSCHEDULER] = sys_sched_setscheduler,
+    [SYSCALL_SCHED_GETSCHEDULER] = sys_sched_getscheduler,
+    [SYSCALL_SCHED_GETPARAM] = sys_sched_getparam,
+    [SYSCALL_SCHED_RR_GET_INTERVAL] = sys_sched_rr_get_interval,
 };
 
 extern syscall_table_t syscall_table;
@@ -0,0 +1,233 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../sync/spinlock.h"
+#include "../process.h"
+#include "../../mem/pmm.h"
+#include "../../mem/paging.h"
+#include "../../mem/utils.h"
+#include "../../mem/tlb.h"
+#include "../../mem/highmem.h"
+#include "../../lib/str.h"
+#include "shm.h"
+#include <stdatomic.h>
+
+// named objects, anonymous ones are only reachable through handles
+static shm_object_t* shm_objects = NULL;
+static spinlock_t shm_lock = {0};
+
+static shm_object_t* shm_find_locked(const char* name) {
+    for (shm_object_t* obj = shm_objects; obj; obj = obj->next) {
+        if (flopstrcmp(obj->name, name) == 0)
+            return obj;
+    }
+    return NULL;
+}
+
+static void shm_free_object(shm_object_t* obj) {
+    for (size_t i = 0; i < obj->pages; i++)
+        vmm_free_frame(obj->frames[i]);
+    kfree(obj->frames, obj->pages * sizeof(uintptr_t));
+    kfree(obj, sizeof(shm_object_t));
+}
+
+// name may be NULL or empty for an anonymous object
+// the frames are zeroed up front, the object starts with one handle
+shm_object_t* shm_create(const char* name, size_t pages) {
+    bool named = name && name[0];
+    if (!pages || (named && flopstrnlen(name, SHM_NAME_MAX) >= SHM_NAME_MAX))
+        return NULL;
+
+    shm_object_t* obj = (shm_object_t*) kmalloc(sizeof(shm_object_t));
+    if (!obj)
+        return NULL;
+    flop_memset(obj, 0, sizeof(shm_object_t));
+
+    obj->frames = (uintptr_t*) kmalloc(pages * sizeof(uintptr_t));
+    if (!obj->frames) {
+        kfree(obj, sizeof(shm_object_t));
+        return NULL;
+    }
+
+    for (size_t i = 0; i < pages; i++) {
+        uintptr_t pa = (uintptr_t) pmm_alloc_high_page();
+        if (pa && highmem_zero_page(pa) < 0) {
+            pmm_free_page((void*) pa);
+            pa = 0;
+        }
+        if (!pa) {
+            obj->pages = i;
+            shm_free_object(obj);
+            return NULL;
+        }
+        obj->frames[i] = pa;
+    }
+    obj->pages = pages;
+    refcount_init(&obj->refs);
+
+    if (!named)
+        return obj;
+
+    flopstrlcpy(obj->name, name, SHM_NAME_MAX);
+    bool ints = spinlock(&shm_lock);
+    if (shm_find_locked(obj->name)) {
+        spinlock_unlock(&shm_lock, ints);
+        shm_free_object(obj);
+        return NULL;
+    }
+    obj->next = shm_objects;
+    shm_objects = obj;
+    spinlock_unlock(&shm_lock, ints);
+    return obj;
+}
+
+// takes a new handle on a named object
+shm_object_t* shm_open(const char* name) {
+    if (!name || !name[0])
+        return NULL;
+
+    bool ints = spinlock(&shm_lock);
+    shm_object_t* obj = shm_find_locked(name);
+    if (obj && !refcount_inc_not_zero(&obj->refs))
+        obj = NULL;
+    spinlock_unlock(&shm_lock, ints);
+    return obj;
+}
+
+bool shm_get(shm_object_t* obj) {
+    return obj && refcount_inc_not_zero(&obj->refs);
+}
+
+// drop a handle, the last one takes a named object out of the namespace
+// mapped frames stay alive through their own references
+void shm_put(shm_object_t* obj) {
+    if (!obj)
+        return;
+
+    bool ints = spinlock(&shm_lock);
+    if (!refcount_dec_and_test(&obj->refs)) {
+        spinlock_unlock(&shm_lock, ints);
+        return;
+    }
+    for (shm_object_t** link = &shm_objects; *link; link = &(*link)->next) {
+        if (*link == obj) {
+            *link = obj->next;
+            break;
+        }
+    }
+    spinlock_unlock(&shm_lock, ints);
+    shm_free_object(obj);
+}
+
+// map every frame of obj into region at va (or a free range if va is 0)
+// ptes carry PAGE_SHARED so fork keeps them shared instead of copy-on-write
+// the whole range has to sit in user space, clear of mappings, swapped pages and lazy reservations
+uintptr_t shm_map(shm_object_t* obj, vmm_region_t* region, uintptr_t va, uint32_t flags) {
+    if (!obj || !region || !obj->pages || (va & (PAGE_SIZE - 1)))
+        return 0;
+
+    if (!va)
+        va = vmm_find_free_range(region, obj->pages);
+    if (!va || !vmm_range_is_free(region, va, obj->pages))
+        return 0;
+
+    uint32_t pte_flags = (flags & PAGE_RW) | PAGE_PRESENT | PAGE_USER | PAGE_SHARED;
+    tlb_batch_t batch;
+    tlb_batch_t* open = vmm_batch_begin(region, &batch);
+    for (size_t i = 0; i < obj->pages; i++) {
+        if (vmm_map(region, va + i * PAGE_SIZE, obj->frames[i], pte_flags) < 0) {
+            vmm_release_range(region, va, i);
+            vmm_batch_end(region, open);
+            return 0;
+        }
+        pmm_page_ref(obj->frames[i]);
+    }
+    vmm_batch_end(region, open);
+    return va;
+}
+
+static int shm_unmap_check_pte(vmm_region_t* region, uintptr_t va, uint32_t* pte, void* ctx) {
+    (void) region;
+    (void) va;
+    (void) ctx;
+    return (*pte & PAGE_SHARED) ? 0 : 1;
+}
+
+// only ranges made by shm_map, anything else goes through munmap
+int shm_unmap(vmm_region_t* region, uintptr_t va, size_t pages) {
+    if (!region || !pages || (va & (PAGE_SIZE - 1)))
+        return -1;
+
+    vmm_walk_ops_t ops = {.pte_entry = shm_unmap_check_pte, .large_entry = NULL, .ctx = NULL};
+    if (vmm_walk(region, va, va + pages * PAGE_SIZE, &ops) != 0)
+        return -1;
+
+    vmm_release_range(region, va, pages);
+    return 0;
+}
+
+int shm_install(process_t* process, shm_object_t* obj) {
+    if (!process || !obj)
+        return -1;
+
+    for (int handle = 0; handle < MAX_PROC_SHM; handle++) {
+        if (!process->shm[handle]) {
+            process->shm[handle] = obj;
+            return handle;
+        }
+    }
+    return -1;
+}
+
+shm_object_t* shm_lookup(process_t* process, int handle) {
+    if (!process || handle < 0 || handle >= MAX_PROC_SHM)
+        return NULL;
+    return process->shm[handle];
+}
+
+int shm_close(process_t* process, int handle) {
+    shm_object_t* obj = shm_lookup(process, handle);
+    if (!obj)
+        return -1;
+
+    process->shm[handle] = NULL;
+    shm_put(obj);
+    return 0;
+}
+
+// fork, the child gets its own reference on every handle
+int shm_dup_handles(process_t* dest, process_t* src) {
+    if (!dest || !src)
+        return -1;
+
+    for (int handle = 0; handle < MAX_PROC_SHM; handle++) {
+        dest->shm[handle] = NULL;
+        if (src->shm[handle] && shm_get(src->shm[handle]))
+            dest->shm[handle] = src->shm[handle];
+    }
+    return 0;
+}
+
+void shm_close_all(process_t* process) {
+    if (!process)
+        return;
+
+    for (int handle = 0; handle < MAX_PROC_SHM; handle++) {
+        if (process->shm[handle])
+            shm_close(process, handle);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "../sync/spinlock.h"
+#include "../../lib/refcount.h"
+#include "../../mem/vmm.h"
+
+#define SHM_NAME_MAX 32
+
+struct process;
+
+// a set of frames that can be mapped into any number of regions
+// the object keeps one reference on every frame and each mapping takes another,
+// so frames outlive the object until the last region unmaps them
+typedef struct shm_object {
+    char name[SHM_NAME_MAX]; // empty for anonymous objects
+    uintptr_t* frames;
+    size_t pages;
+    refcount_t refs; // open handles across all processes
+    struct shm_object* next;
+} shm_object_t;
+
+shm_object_t* shm_create(const char* name, size_t pages);
+shm_object_t* shm_open(const char* name);
+bool shm_get(shm_object_t* obj);
+void shm_put(shm_object_t* obj);
+uintptr_t shm_map(shm_object_t* obj, vmm_region_t* region, uintptr_t va, uint32_t flags);
+int shm_unmap(vmm_region_t* region, uintptr_t va, size_t pages);
+
+// per process handle table, a handle is an index into process->shm
+int shm_install(struct process* process, shm_object_t* obj);
+shm_object_t* shm_lookup(struct process* process, int handle);
+int shm_close(struct process* process, int handle);
+int shm_dup_handles(struct process* dest, struct process* src);
+void shm_close_all(struct process* process);
+
+#endif // SHM_H
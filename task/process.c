@@ -13,6 +13,7 @@ You should have received a copy of the GNU General Public License along with Flo
 */
 
 #include "sched.h"
+#include "ipc/shm.h"
 
 #include "../mem/alloc.h"
 #include "../mem/pmm.h"
@@ -23,6 +24,7 @@ You should have received a copy of the GNU General Public License along with Flo
 #include "../lib/logging.h"
 #include "../lib/str.h"
 #include "../lib/refcount.h"
+#include "../lib/cycles.h"
 #include "../interrupts/interrupts.h"
 #include "../task/sync/spinlock.h"
 #include "../drivers/time/floptime.h"
@@ -202,9 +204,11 @@ static process_t* proc_alloc(void) {
     for (int i = 0; i < MAX_PROC_FDS; ++i) {
         flop_memset(&process->fds[i], 0, sizeof(struct vfs_file_descriptor));
     }
+    flop_memset(process->shm, 0, sizeof(process->shm));
 
     process->region = NULL;
     process->mem_usage = 0;
+    process->minor_faults = 0;
     process->parent = NULL;
     process->children = NULL;
     process->siblings = NULL;
@@ -284,7 +288,10 @@ static void proc_init_process_free_data_structures(process_t* process) {
         vfs_close(process->cwd);
     }
 
+    shm_close_all(process);
+
     if (process->region) {
+        vmm_release_user_pages(process->region);
         vmm_region_destroy(process->region);
     }
 
@@ -395,14 +402,16 @@ int proc_kill(process_t* process) {
 
     while (process->threads && process->threads->head) {
         thread_t* thread = process->threads->head;
-        sched_remove(sched.ready_queue, thread);
-        sched_remove(sched.sleep_queue, thread);
+        sched_unready(thread);
+        sched_cancel_sleep(thread);
     }
 
     if (process->cwd) {
         vfs_close(process->cwd);
     }
 
+    shm_close_all(process);
+    vmm_release_user_pages(process->region);
     vmm_region_destroy(process->region);
     kfree(process->name, flopstrlen(process->name) + 1);
     kfree(process->threads, sizeof(thread_list_t));
@@ -422,8 +431,8 @@ int proc_exit_all_threads(process_t* process) {
 
     while (process->threads && process->threads->head) {
         thread_t* thread = process->threads->head;
-        sched_remove(sched.ready_queue, thread);
-        sched_remove(sched.sleep_queue, thread);
+        sched_unready(thread);
+        sched_cancel_sleep(thread);
     }
 
     spinlock(&proc_tbl->proc_table_lock);
@@ -552,7 +561,10 @@ static void proc_fork_failed_child_data_structures(process_t* child) {
         vfs_close(child->cwd);
     }
 
+    shm_close_all(child);
+
     if (child->region) {
+        vmm_release_user_pages(child->region);
         vmm_region_destroy(child->region);
     }
 
@@ -597,6 +609,11 @@ pid_t proc_fork(process_t* parent) {
         return -1;
     }
 
+    if (shm_dup_handles(child, parent) < 0) {
+        proc_fork_failed_child_data_structures(child);
+        return -1;
+    }
+
     char* child_name = parent->name ? parent->name : "__embryo_process";
     size_t name_len = flopstrlen(child_name) + 1;
     child->name = (char*) kmalloc(name_len);
@@ -668,6 +685,11 @@ int proc_init() {
         return -1;
     }
 
+#ifdef CONFIG_FORK_BENCH
+    // boot-time fork latency numbers, build with -DCONFIG_FORK_BENCH to get them
+    proc_fork_bench(init_process, PROC_FORK_BENCH_ITERATIONS);
+#endif
+
     log("proc: init - ok\n", GREEN);
     return 0;
 }
@@ -701,7 +723,7 @@ void proc_free_within_process(process_t* process, uintptr_t addr, size_t size) {
         pages += 1;
     }
 
-    vmm_unmap(process->region, addr);
+    vmm_free(process->region, addr, pages);
     process->mem_usage -= pages * PAGE_SIZE;
 }
 
@@ -774,8 +796,8 @@ static int proc_terminate_all_threads(process_t* process) {
     thread_t* iter_thread = process->threads->head;
     while (iter_thread) {
         thread_t* next_thread = iter_thread->next;
-        sched_remove(sched.ready_queue, iter_thread);
-        sched_remove(sched.sleep_queue, iter_thread);
+        sched_unready(iter_thread);
+        sched_cancel_sleep(iter_thread);
         iter_thread = next_thread;
     }
 
@@ -793,7 +815,10 @@ static int proc_clean(process_t* process) {
         process->cwd = NULL;
     }
 
+    shm_close_all(process);
+
     if (process->region) {
+        vmm_release_user_pages(process->region);
         vmm_region_destroy(process->region);
         process->region = NULL;
     }
@@ -873,6 +898,49 @@ static int proc_kill_all_children(process_t* parent) {
     return 0;
 }
 
+// times proc_fork on a parent and throws each child away right after
+// with cow the cost tracks the number of page tables, not the parent's resident memory
+void proc_fork_bench(process_t* parent, uint32_t iterations) {
+    if (!parent || !parent->region || iterations == 0)
+        return;
+
+    uint32_t avg = 0;
+    uint32_t worst = 0;
+    uint32_t best = 0xFFFFFFFF;
+    uint32_t done = 0;
+    for (uint32_t i = 0; i < iterations; i++) {
+        uint64_t start = cycles_now();
+        pid_t pid = proc_fork(parent);
+        uint64_t cycles = cycles_now() - start;
+        if (pid < 0)
+            break;
+
+        cycles_account(&avg, &worst, ++done, cycles);
+        if ((uint32_t) cycles < best)
+            best = (uint32_t) cycles;
+
+        // proc_assign_child_ids pushes the new child to the front
+        process_t* child = parent->children;
+        proc_family_remove_child(parent, child);
+        proc_terminate_process(child);
+    }
+
+    if (done == 0) {
+        log("proc: fork bench - fork failed\n", RED);
+        return;
+    }
+
+    char buffer[128];
+    flopsnprintf(buffer,
+                 sizeof(buffer),
+                 "proc: fork bench - %u forks, avg %u cycles, min %u cycles, max %u cycles\n",
+                 done,
+                 avg,
+                 best,
+                 worst);
+    log(buffer, GREEN);
+}
+
 static int proc_copy_process_memory(process_t* source_process, process_t* target_process) {
     if (!source_process || !target_process)
         return -1;
@@ -925,11 +993,13 @@ void proc_debug_dump_process_info(process_t* process) {
                            "name: %s\n"
                            "state: %d\n"
                            "memory usage: %u bytes\n"
+                           "minor faults: %u\n"
                            "cwd: %p\n",
                            process->pid,
                            process->name ? process->name : "NULL",
                            process->state,
                            process->mem_usage,
+                           process->minor_faults,
                            (void*) process->cwd);
     log(buffer, GREEN);
 }
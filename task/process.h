@@ -15,6 +15,7 @@ typedef struct process process_t;
 typedef signed int pid_t;
 typedef int uid_t;
 typedef struct thread_list thread_list_t;
+struct shm_object;
 extern process_t* current_process;
 
 typedef enum process_state {
@@ -39,6 +40,8 @@ typedef struct proc_info {
 } proc_info_t;
 
 #define MAX_PROC_FDS 128
+#define MAX_PROC_SHM 32
+#define PROC_FORK_BENCH_ITERATIONS 64 // forks timed at boot with CONFIG_FORK_BENCH
 
 // data structure representing a process
 // a process has its own address space
@@ -56,6 +59,9 @@ typedef struct process {
     // TODO: there's probably a better way of tracking this.
     uint32_t mem_usage;
 
+    // page faults resolved without touching a backing store
+    uint32_t minor_faults;
+
     // we can add a pointer to the procfs node of the process
     // but we can easily get the path by looking up /process/[PID]
     // the cwd is still necessary though (sysv)
@@ -64,6 +70,9 @@ typedef struct process {
     // file descriptor table
     struct vfs_file_descriptor fds[MAX_PROC_FDS];
 
+    // shared memory handles (see ipc/shm.h)
+    struct shm_object* shm[MAX_PROC_SHM];
+
     // all processes have a parent
     struct process* parent;
 
@@ -112,6 +121,7 @@ pid_t proc_fork(process_t* parent);
 int proc_init();
 int proc_exit(process_t* process, int status);
 pid_t proc_dup(pid_t pid);
+void proc_fork_bench(process_t* parent, uint32_t iterations);
 process_t* proc_get_process_by_pid();
 int proc_exit_all_threads(process_t* process);
 #endif
\ No newline at end of file
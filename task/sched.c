@@ -21,67 +21,39 @@ You should have received a copy of the GNU General Public License along with Flo
 #include "../mem/utils.h"
 #include "../lib/logging.h"
 #include "../lib/str.h"
+#include "../lib/cycles.h"
 #include "../interrupts/interrupts.h"
 #include "../task/sync/spinlock.h"
 #include "../drivers/time/floptime.h"
+#include "../smp/smp.h"
+#include "timer.h"
+#include "../drivers/time/clockevent.h"
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
 
 uint64_t sched_ticks_counter;
+uint32_t sched_cycles_per_tick;
 
 extern process_t* current_process;
 static reaper_descriptor_t reaper_desc;
 
+static void sched_sleep_expired(void* arg);
+static inline sched_cpu_t* sched_this(void);
+
 static void idle_thread_loop() {
     for (;;) {
+        // nothing was ready on this cpu, look again (and try to steal) after the next interrupt
+        // with nothing queued the tick stops until the next timer is due
+        IA32_INT_MASK();
+        if (!sched_this()->rq.count)
+            clockevent_idle_enter();
+        __asm__ volatile("sti; hlt");
+        clockevent_idle_exit();
+        sched_yield();
     }
 }
 
-static void sched_reaper_remove_from_sleep_queue(thread_t* thread) {
-    if (!thread || !sched.sleep_queue) {
-        return;
-    }
-
-    spinlock(&sched.sleep_queue->lock);
-
-    thread_t* previous_thread = NULL;
-    thread_t* current_thread = sched.sleep_queue->head;
-
-    while (current_thread) {
-        thread_t* next_thread = current_thread->next;
-
-        if (current_thread == thread) {
-            if (previous_thread) {
-                previous_thread->next = next_thread;
-            } else {
-                sched.sleep_queue->head = next_thread;
-            }
-
-            if (current_thread == sched.sleep_queue->tail) {
-                sched.sleep_queue->tail = previous_thread;
-            }
-
-            sched.sleep_queue->count--;
-            current_thread->next = NULL;
-            break;
-        }
-
-        previous_thread = current_thread;
-        current_thread = next_thread;
-    }
-
-    spinlock_unlock(&sched.sleep_queue->lock, true);
-}
-
-static void sched_reaper_enqueue_ready(thread_t* thread) {
-    if (!thread)
-        return;
-
-    thread->thread_state = THREAD_READY;
-    sched_enqueue(sched.ready_queue, thread);
-}
-
 void sched_wake_reaper(void) {
     if (!sched.reaper_thread)
         return;
@@ -89,13 +61,7 @@ void sched_wake_reaper(void) {
     thread_t* reaper_thread = sched.reaper_thread;
     atomic_store(&reaper_desc.wake_signal.state, 1);
 
-    if (reaper_thread->thread_state == THREAD_RUNNING || reaper_thread->thread_state == THREAD_READY)
-        return;
-
-    if (reaper_thread->thread_state == THREAD_SLEEPING) {
-        sched_reaper_remove_from_sleep_queue(reaper_thread);
-        sched_reaper_enqueue_ready(reaper_thread);
-    }
+    sched_thread_wake(reaper_thread);
 }
 
 static inline void signal_wait(signal_t* s) {
@@ -165,7 +131,7 @@ void reaper_init(void) {
     reaper_desc.dead_threads.name = "reaper_dead";
 
     reaper_desc.reaper_thread = sched_internal_init_thread(reaper_thread_main, 1, "reaper", 0, NULL);
-    sched_enqueue(sched.ready_queue, reaper_desc.reaper_thread);
+    sched_make_ready(reaper_desc.reaper_thread);
     sched.reaper_thread = reaper_desc.reaper_thread;
 }
 
@@ -193,7 +159,16 @@ void sched_stop_reaper(void) {
     signal_send(&reaper_desc.wake_signal);
 }
 
-static void stealer_thread_entry() {}
+static void sched_balance(void);
+
+// spreads ready threads when some cpus have a longer queue than others,
+// idle cpus do not wait for it, they steal as soon as their own queue runs dry
+static void stealer_thread_entry() {
+    for (;;) {
+        sched_balance();
+        sched_thread_sleep(SCHED_BALANCE_MS);
+    }
+}
 
 extern void context_switch(cpu_ctx_t* old, cpu_ctx_t* new);
 extern void usermode_entry_routine(uint32_t stack, uint32_t ip);
@@ -201,14 +176,13 @@ scheduler_t sched;
 #define USER_STACK_TOP 0xC0000000
 #define USER_STACK_SIZE 0x1000
 
+// the stack is reserved only, the first push faults its frame in
 static uintptr_t sched_internal_alloc_user_stack(process_t* process, uint32_t stack_index) {
     uintptr_t user_stack_top = USER_STACK_TOP - (stack_index * USER_STACK_SIZE);
-    uintptr_t phys = (uintptr_t) pmm_alloc_page();
-    if (!phys) {
-        return 0;
-    }
-    if (vmm_map(process->region, user_stack_top - USER_STACK_SIZE, phys, PAGE_RW | PAGE_USER) < 0) {
-        pmm_free_page((void*) phys);
+    if (vmm_reserve_anonymous(process->region,
+                              user_stack_top - USER_STACK_SIZE,
+                              USER_STACK_SIZE / PAGE_SIZE,
+                              PAGE_RW | PAGE_USER) < 0) {
         return 0;
     }
 
@@ -230,39 +204,30 @@ static inline uint32_t sched_internal_fetch_next_stack_index(process_t* process)
 }
 
 int sched_spinlocks_init(void) {
-    static spinlock_t ready_queue_spinlock_initializer = SPINLOCK_INIT;
-    static spinlock_t sleep_queue_spinlock_initializer = SPINLOCK_INIT;
     static spinlock_t kernel_threads_spinlock_initializer = SPINLOCK_INIT;
     static spinlock_t user_threads_spinlock_initializer = SPINLOCK_INIT;
-    spinlock_init(&sched.ready_queue->lock);
-    spinlock_init(&sched.sleep_queue->lock);
+    for (int cpu = 0; cpu < CONFIG_MAX_CPUS; cpu++)
+        spinlock_init(&sched.cpus[cpu].rq.lock);
     spinlock_init(&sched.kernel_threads->lock);
     spinlock_init(&sched.user_threads->lock);
     return 0;
 }
 
 int sched_scheduler_lists_init(void) {
-    thread_list_t* ready_queue_list_instance = kmalloc(sizeof(thread_list_t));
-    thread_list_t* sleep_queue_list_instance = kmalloc(sizeof(thread_list_t));
     thread_list_t* kernel_threads_inst = kmalloc(sizeof(thread_list_t));
     thread_list_t* user_threads_inst = kmalloc(sizeof(thread_list_t));
 
-    flop_memset(ready_queue_list_instance, 0, sizeof(thread_list_t));
-    flop_memset(sleep_queue_list_instance, 0, sizeof(thread_list_t));
+    flop_memset(sched.cpus, 0, sizeof(sched.cpus));
     flop_memset(kernel_threads_inst, 0, sizeof(thread_list_t));
     flop_memset(user_threads_inst, 0, sizeof(thread_list_t));
 
-    sched.ready_queue = ready_queue_list_instance;
-    sched.sleep_queue = sleep_queue_list_instance;
     sched.kernel_threads = kernel_threads_inst;
     sched.user_threads = user_threads_inst;
 
     if (sched_spinlocks_init() < 0) {
-        kfree(sched.ready_queue, sizeof(thread_list_t));
-        kfree(sched.sleep_queue, sizeof(thread_list_t));
         kfree(sched.kernel_threads, sizeof(thread_list_t));
         kfree(sched.user_threads, sizeof(thread_list_t));
-        sched.ready_queue = sched.sleep_queue = sched.kernel_threads = sched.user_threads = NULL;
+        sched.kernel_threads = sched.user_threads = NULL;
         return -1;
     }
 
@@ -270,8 +235,6 @@ int sched_scheduler_lists_init(void) {
 }
 
 int sched_assign_list_names(void) {
-    sched.ready_queue->name = "ready_queue";
-    sched.sleep_queue->name = "sleep_queue";
     sched.kernel_threads->name = "kernel_threads";
     sched.user_threads->name = "user_threads";
     return 0;
@@ -298,8 +261,9 @@ void sched_init(void) {
     sched.stealer_thread = NULL;
     sched.next_tid = 0;
 
-    log("sched: adding idle thread to ready queue\n", GREEN);
-    sched_thread_list_add(sched.idle_thread, sched.ready_queue);
+    if (sched_init_cpu(0) < 0)
+        log("sched: failed to create the idle thread\n", RED);
+    sched.stealer_thread = sched_create_kernel_thread(stealer_thread_entry, 1, "balancer");
 
     log("sched: init - ok", GREEN);
 }
@@ -472,6 +436,27 @@ sched_internal_init_thread(void (*entry)(void), unsigned priority, char* name, i
     this_thread->time_since_last_run = 0;
     this_thread->time_slice = priority * 2;
 
+    this_thread->rq_next = this_thread->rq_prev = NULL;
+    this_thread->age_next = this_thread->age_prev = NULL;
+    this_thread->rq_level = 0;
+    this_thread->ready_since = 0;
+    this_thread->on_rq = false;
+    this_thread->on_cpu = false;
+    this_thread->cpu = -1;
+    this_thread->last_ran = 0;
+    this_thread->sched_class = SCHED_CLASS_DEFAULT;
+    this_thread->vruntime = 0;
+    this_thread->sum_exec = 0;
+    this_thread->exec_start = 0;
+    this_thread->slice_start = 0;
+    this_thread->fair_weight = 0;
+    this_thread->policy = SCHED_OTHER;
+    this_thread->rt_priority = 0;
+    this_thread->rr_quantum = 0;
+    this_thread->rr_left = 0;
+    this_thread->preempted = false;
+    timer_init(&this_thread->sleep_timer, sched_sleep_expired, this_thread);
+
     return this_thread;
 }
 
@@ -547,7 +532,61 @@ thread_t* sched_create_kernel_thread(void (*entry)(void), unsigned priority, cha
     return new_thread;
 }
 
-thread_t* current_thread;
+static inline int sched_this_cpu(void) {
+#ifdef CONFIG_SMP
+    int cpu = smp_fetch_cpu();
+    return cpu >= 0 && cpu < CONFIG_MAX_CPUS ? cpu : 0;
+#else
+    return 0;
+#endif
+}
+
+static inline int sched_online_cpus(void) {
+#ifdef CONFIG_SMP
+    int n = smp_cpu_count();
+    return n < 1 ? 1 : (n > CONFIG_MAX_CPUS ? CONFIG_MAX_CPUS : n);
+#else
+    return 1;
+#endif
+}
+
+static inline sched_cpu_t* sched_this(void) {
+    return &sched.cpus[sched_this_cpu()];
+}
+
+// give a cpu its idle thread, the bsp calls this from sched_init and every ap once it is up
+int sched_init_cpu(int cpu) {
+    if (cpu < 0 || cpu >= CONFIG_MAX_CPUS)
+        return -1;
+    if (sched.cpus[cpu].idle)
+        return 0;
+    thread_t* idle = sched_internal_init_thread(idle_thread_loop, 0, "idle", 0, NULL);
+    if (!idle)
+        return -1;
+    idle->cpu = cpu;
+    sched.cpus[cpu].idle = idle;
+    return 0;
+}
+
+// prev's registers are saved once we are on another stack, only then may another cpu take it
+// threads that start fresh never come back through here, the next tick on the cpu does it for them
+static void sched_finish_switch(sched_cpu_t* cpu) {
+    thread_t* prev = cpu->prev;
+    cpu->prev = NULL;
+    if (prev && prev != cpu->current)
+        __atomic_store_n(&prev->on_cpu, false, __ATOMIC_RELEASE);
+}
+
+// an ap's boot path ends here, what runs on its boot stack becomes the idle thread
+// (unreached until aps are started, see smp_ap_main)
+void sched_run_idle(void) {
+    sched_cpu_t* cpu = sched_this();
+    if (!cpu->idle)
+        return;
+    cpu->idle->on_cpu = true;
+    cpu->current = cpu->idle;
+    idle_thread_loop();
+}
 
 // our context switch takes our cpu context struct which
 // contains edi, esi, ebx, ebp, eip
@@ -559,98 +598,464 @@ extern void context_switch(cpu_ctx_t* old, cpu_ctx_t* new);
 // the user stack to start executing ip
 extern void usermode_entry_routine(uint32_t sp, uint32_t ip);
 
-void sched_boost_starved_threads(thread_list_t* list) {
-    spinlock(&list->lock);
+// index of the highest set bit, x must not be 0
+static inline uint32_t sched_bsr(uint32_t x) {
+    uint32_t bit;
+    __asm__("bsr %1, %0" : "=r"(bit) : "rm"(x));
+    return bit;
+}
 
-    for (thread_t* t = list->head; t; t = t->next) {
-        t->time_since_last_run++;
-        if (t->time_since_last_run > STARVATION_THRESHOLD && t->priority.effective < MAX_PRIORITY) {
-            t->priority.effective += BOOST_AMOUNT;
-        }
-    }
+static inline uint32_t sched_thread_level(thread_t* t) {
+    return t->priority.effective > MAX_PRIORITY ? MAX_PRIORITY : t->priority.effective;
+}
 
-    spinlock_unlock(&list->lock, true);
+// queue t at the back of a level, or the front for a thread that was only preempted
+void prio_array_add(prio_array_t* array, thread_t* t, uint32_t level, bool front) {
+    t->rq_level = level;
+    if (front) {
+        t->rq_prev = NULL;
+        t->rq_next = array->head[level];
+        if (array->head[level])
+            array->head[level]->rq_prev = t;
+        else
+            array->tail[level] = t;
+        array->head[level] = t;
+    } else {
+        t->rq_next = NULL;
+        t->rq_prev = array->tail[level];
+        if (array->tail[level])
+            array->tail[level]->rq_next = t;
+        else
+            array->head[level] = t;
+        array->tail[level] = t;
+    }
+    array->bitmap[level / 32] |= 1u << (level % 32);
+    array->summary |= 1u << (level / 32);
+}
+
+void prio_array_del(prio_array_t* array, thread_t* t) {
+    uint32_t level = t->rq_level;
+    if (t->rq_prev)
+        t->rq_prev->rq_next = t->rq_next;
+    else
+        array->head[level] = t->rq_next;
+    if (t->rq_next)
+        t->rq_next->rq_prev = t->rq_prev;
+    else
+        array->tail[level] = t->rq_prev;
+    t->rq_next = t->rq_prev = NULL;
+
+    if (!array->head[level]) {
+        array->bitmap[level / 32] &= ~(1u << (level % 32));
+        if (!array->bitmap[level / 32])
+            array->summary &= ~(1u << (level / 32));
+    }
+}
+
+// head of the highest non-empty level
+thread_t* prio_array_first(prio_array_t* array) {
+    if (!array->summary)
+        return NULL;
+    uint32_t word = sched_bsr(array->summary);
+    uint32_t level = word * 32 + sched_bsr(array->bitmap[word]);
+    return array->head[level];
+}
+
+static void rq_insert(run_queue_t* rq, thread_t* t) {
+    t->sched_class->enqueue(rq, t);
+    t->ready_since = rq->clock;
+    t->age_next = NULL;
+    t->age_prev = rq->newest;
+    if (rq->newest)
+        rq->newest->age_next = t;
+    else
+        rq->oldest = t;
+    rq->newest = t;
+    t->on_rq = true;
+    rq->count++;
+}
+
+static void rq_delete(run_queue_t* rq, thread_t* t) {
+    t->sched_class->dequeue(rq, t);
+    if (t->age_prev)
+        t->age_prev->age_next = t->age_next;
+    else
+        rq->oldest = t->age_next;
+    if (t->age_next)
+        t->age_next->age_prev = t->age_prev;
+    else
+        rq->newest = t->age_prev;
+    t->age_next = t->age_prev = NULL;
+    t->on_rq = false;
+    rq->count--;
+}
+
+// the thread that has been ready the longest is boosted a step per pick once it
+// waited past the threshold, it keeps its place in the age list until it runs
+// fair threads cannot starve each other, only prio threads are aged
+static void rq_age(run_queue_t* rq) {
+    thread_t* t = rq->oldest;
+    if (!t || t->sched_class != &sched_prio_class)
+        return;
+    if (rq->clock - t->ready_since <= STARVATION_THRESHOLD || t->priority.effective >= MAX_PRIORITY)
+        return;
+    t->priority.effective += BOOST_AMOUNT;
+    if (sched_thread_level(t) == t->rq_level)
+        return;
+    prio_array_del(&rq->prio, t);
+    prio_array_add(&rq->prio, t, sched_thread_level(t), false);
 }
 
-void sched_find_best_thread_iterate(thread_list_t* list,
-                                    thread_t** out_best,
-                                    thread_t** out_prev_best,
-                                    thread_t** out_prev) {
-    thread_t* iter = list->head;
-    thread_t* prev = NULL;
+static void prio_enqueue(run_queue_t* rq, thread_t* t) {
+    prio_array_add(&rq->prio, t, sched_thread_level(t), false);
+}
 
-    while (iter) {
-        if (!*out_best || iter->priority.effective > (*out_best)->priority.effective) {
-            *out_best = iter;
-            *out_prev_best = prev;
-        }
-        prev = iter;
-        iter = iter->next;
-    }
+static void prio_dequeue(run_queue_t* rq, thread_t* t) {
+    prio_array_del(&rq->prio, t);
 }
 
-static thread_t* sched_find_best_thread(thread_list_t* list, thread_t** out_prev) {
-    if (!list || !list->head)
-        return NULL;
+static thread_t* prio_pick(run_queue_t* rq) {
+    rq_age(rq);
+    return prio_array_first(&rq->prio);
+}
+
+// the boost is spent once the thread gets the cpu
+static void prio_set_next(run_queue_t* rq, thread_t* t) {
+    (void) rq;
+    t->priority.effective = t->priority.base;
+}
 
-    thread_t* best = NULL;
-    thread_t* best_prev = NULL;
+static bool prio_check_preempt(run_queue_t* rq, thread_t* curr, thread_t* t) {
+    (void) rq;
+    return sched_thread_level(t) > sched_thread_level(curr);
+}
 
-    sched_find_best_thread_iterate(list, &best, &best_prev, NULL);
+const sched_class_t sched_prio_class = {
+    .name = "prio",
+    .next = &sched_fair_class,
+    .enqueue = prio_enqueue,
+    .dequeue = prio_dequeue,
+    .pick = prio_pick,
+    .set_next = prio_set_next,
+    .check_preempt = prio_check_preempt,
+};
 
-    if (out_prev) {
-        *out_prev = best_prev;
+static bool sched_class_above(const sched_class_t* a, const sched_class_t* b) {
+    for (const sched_class_t* cls = SCHED_CLASS_HIGHEST; cls; cls = cls->next) {
+        if (cls == b)
+            return false;
+        if (cls == a)
+            return true;
     }
+    return false;
+}
 
+static thread_t* rq_pick(run_queue_t* rq) {
+    rq->clock++;
+    thread_t* t = NULL;
+    for (const sched_class_t* cls = SCHED_CLASS_HIGHEST; cls && !t; cls = cls->next)
+        t = cls->pick(rq);
+    if (!t)
+        return NULL;
+    rq_delete(rq, t);
+
+    t->time_since_last_run = rq->clock - t->ready_since;
+    t->last_ran = rq->clock;
+    if (t->sched_class->set_next)
+        t->sched_class->set_next(rq, t);
+    return t;
+}
+
+// move a ready thread to another cpu's queue, both locks held
+// it keeps how long it has waited so aging on the new cpu carries on
+static void rq_migrate(run_queue_t* src, run_queue_t* dst, int dst_cpu, thread_t* t) {
+    uint32_t waited = src->clock - t->ready_since;
+    rq_delete(src, t);
+    if (t->sched_class->migrate)
+        t->sched_class->migrate(src, dst, t);
+    t->cpu = dst_cpu;
+    rq_insert(dst, t);
+    t->ready_since = dst->clock - waited;
+}
+
+// lock two queues in index order so two cpus stealing from each other cannot deadlock
+static bool sched_lock_pair(int a, int b) {
+    bool ints = spinlock(&sched.cpus[a < b ? a : b].rq.lock);
+    spinlock_noint(&sched.cpus[a < b ? b : a].rq.lock);
+    return ints;
+}
+
+static void sched_unlock_pair(int a, int b, bool ints) {
+    spinlock_unlock_noint(&sched.cpus[a < b ? b : a].rq.lock);
+    spinlock_unlock(&sched.cpus[a < b ? a : b].rq.lock, ints);
+}
+
+// move up to n ready threads from src to dst, both locks held
+// threads that ran on src a moment ago still have a warm cache there and go last
+static uint32_t sched_pull(int src_cpu, int dst_cpu, uint32_t n) {
+    run_queue_t* src = &sched.cpus[src_cpu].rq;
+    run_queue_t* dst = &sched.cpus[dst_cpu].rq;
+    thread_t* hot[SCHED_STEAL_SCAN];
+    uint32_t hot_count = 0, moved = 0, seen = 0;
+
+    thread_t* t = src->oldest;
+    while (t && moved < n && seen < SCHED_STEAL_SCAN) {
+        thread_t* next = t->age_next;
+        seen++;
+        // a yielding thread is queued before it is switched out, its registers are not saved yet
+        if (__atomic_load_n(&t->on_cpu, __ATOMIC_ACQUIRE)) {
+            t = next;
+            continue;
+        }
+        if (src->clock - t->last_ran < SCHED_CACHE_HOT_PICKS) {
+            hot[hot_count++] = t;
+        } else {
+            rq_migrate(src, dst, dst_cpu, t);
+            moved++;
+        }
+        t = next;
+    }
+    for (uint32_t i = 0; i < hot_count && moved < n; i++, moved++)
+        rq_migrate(src, dst, dst_cpu, hot[i]);
+    return moved;
+}
+
+// the cpu with the longest queue, counts are read without the locks and only a hint
+static int sched_busiest_cpu(int except, uint32_t* out_count) {
+    int best = -1;
+    uint32_t best_count = 0;
+    int cpus = sched_online_cpus();
+    for (int cpu = 0; cpu < cpus; cpu++) {
+        uint32_t count = __atomic_load_n(&sched.cpus[cpu].rq.count, __ATOMIC_RELAXED);
+        if (cpu != except && count > best_count) {
+            best = cpu;
+            best_count = count;
+        }
+    }
+    *out_count = best_count;
     return best;
 }
 
-static void sched_unlink_thread(thread_list_t* list, thread_t* thread, thread_t* prev) {
-    if (!list || !thread)
+// an idle cpu takes half of the busiest queue, rounded up so a single waiting thread moves too
+static uint32_t sched_steal(int me) {
+    uint32_t count;
+    int victim = sched_busiest_cpu(me, &count);
+    if (victim < 0)
+        return 0;
+
+    bool ints = sched_lock_pair(me, victim);
+    uint32_t moved = sched_pull(victim, me, (sched.cpus[victim].rq.count + 1) / 2);
+    sched_unlock_pair(me, victim, ints);
+    return moved;
+}
+
+// evens out the longest and the shortest queue, run every SCHED_BALANCE_MS
+static void sched_balance(void) {
+    int cpus = sched_online_cpus();
+    if (cpus < 2)
         return;
 
-    if (prev) {
-        prev->next = thread->next;
-    } else {
-        list->head = thread->next;
+    uint32_t most;
+    int busiest = sched_busiest_cpu(-1, &most);
+    int idlest = 0;
+    uint32_t least = __atomic_load_n(&sched.cpus[0].rq.count, __ATOMIC_RELAXED);
+    for (int cpu = 1; cpu < cpus; cpu++) {
+        uint32_t count = __atomic_load_n(&sched.cpus[cpu].rq.count, __ATOMIC_RELAXED);
+        if (count < least) {
+            idlest = cpu;
+            least = count;
+        }
     }
+    if (busiest < 0 || busiest == idlest || most < least + 2)
+        return;
 
-    if (list->tail == thread) {
-        list->tail = prev;
-    }
+    bool ints = sched_lock_pair(busiest, idlest);
+    uint32_t src = sched.cpus[busiest].rq.count, dst = sched.cpus[idlest].rq.count;
+    if (src >= dst + 2)
+        sched_pull(busiest, idlest, (src - dst) / 2);
+    sched_unlock_pair(busiest, idlest, ints);
+}
 
-    if (list->count > 0)
-        list->count--;
+// whether a thread that just became ready should take the cpu from what runs there
+// current is read without that cpu's lock, it is only a hint for the next preemption point
+static bool sched_wakeup_preempts(sched_cpu_t* cpu, thread_t* t) {
+    thread_t* curr = cpu->current;
+    if (!curr || curr == cpu->idle)
+        return true;
+    if (curr == t)
+        return false;
+    if (curr->sched_class != t->sched_class)
+        return sched_class_above(t->sched_class, curr->sched_class);
+    return t->sched_class->check_preempt && t->sched_class->check_preempt(&cpu->rq, curr, t);
+}
 
-    thread->next = NULL;
+// queue a thread in its class on the cpu it last ran on, a thread already queued stays where it is
+void sched_make_ready(thread_t* thread) {
+    if (!thread)
+        return;
+    int cpu = thread->cpu;
+    if (cpu < 0 || cpu >= sched_online_cpus())
+        cpu = sched_this_cpu();
+
+    run_queue_t* rq = &sched.cpus[cpu].rq;
+    bool ints = spinlock(&rq->lock);
+    if (!thread->on_rq) {
+        thread->cpu = cpu;
+        rq_insert(rq, thread);
+        if (sched_wakeup_preempts(&sched.cpus[cpu], thread))
+            sched.cpus[cpu].need_resched = true;
+    }
+    spinlock_unlock(&rq->lock, ints);
+}
+
+// take a thread off whichever run queue holds it, false if it was not queued
+bool sched_unready(thread_t* thread) {
+    if (!thread)
+        return false;
+    for (;;) {
+        int cpu = __atomic_load_n(&thread->cpu, __ATOMIC_ACQUIRE);
+        if (cpu < 0 || cpu >= CONFIG_MAX_CPUS)
+            return false;
+        run_queue_t* rq = &sched.cpus[cpu].rq;
+        bool ints = spinlock(&rq->lock);
+        // a steal may have moved it before the lock was taken
+        if (thread->cpu != cpu) {
+            spinlock_unlock(&rq->lock, ints);
+            continue;
+        }
+        bool queued = thread->on_rq;
+        if (queued)
+            rq_delete(rq, thread);
+        spinlock_unlock(&rq->lock, ints);
+        return queued;
+    }
 }
 
 static inline void sched_assign_time_slice(thread_t* t) {
     t->time_slice = t->priority.base ? t->priority.base : 1;
 }
 
-static thread_t* sched_select_by_time_slice(thread_list_t* list) {
-    if (!list || !list->head)
-        return NULL;
+// move a thread to a policy's class, it is requeued if it was ready
+// priority is SCHED_RT_PRIO_MIN..MAX for fifo and rr, the base priority otherwise
+// quantum_ms is the rr turn length, 0 for SCHED_RR_QUANTUM_MS
+int sched_setscheduler(thread_t* thread, int policy, unsigned priority, uint32_t quantum_ms) {
+    if (!thread)
+        return -1;
 
-    thread_t* prev = NULL;
-    thread_t* best = sched_find_best_thread(list, &prev);
-    if (!best)
-        return NULL;
+    const sched_class_t* cls;
+    bool rt = policy == SCHED_FIFO || policy == SCHED_RR;
+    switch (policy) {
+    case SCHED_FIFO:
+    case SCHED_RR:
+        cls = &sched_rt_class;
+        break;
+    case SCHED_PRIO:
+        cls = &sched_prio_class;
+        break;
+    case SCHED_OTHER:
+        cls = &sched_fair_class;
+        break;
+    default:
+        return -1;
+    }
+    if (rt && (priority < SCHED_RT_PRIO_MIN || priority > SCHED_RT_PRIO_MAX))
+        return -1;
+    if (!rt && priority > MAX_PRIORITY)
+        return -1;
 
-    sched_unlink_thread(list, best, prev);
-    sched_assign_time_slice(best);
+    bool queued = sched_unready(thread);
+    thread->policy = policy;
+    if (rt) {
+        thread->rt_priority = priority;
+        thread->rr_quantum = timer_ms_to_ticks(quantum_ms ? quantum_ms : SCHED_RR_QUANTUM_MS);
+        if (!thread->rr_quantum)
+            thread->rr_quantum = 1;
+        thread->rr_left = 0;
+    } else {
+        thread->rt_priority = 0;
+        thread->priority.base = thread->priority.effective = priority;
+    }
+    thread->sched_class = cls;
+    // a running thread is charged from here on by its new class
+    thread->exec_start = cycles_now();
+    thread->slice_start = thread->sum_exec;
+    if (queued)
+        sched_make_ready(thread);
+    return 0;
+}
 
-    return best;
+int sched_getscheduler(thread_t* thread) {
+    return thread ? thread->policy : -1;
+}
+
+// every cpu's tick, the boot cpu's also measures the tsc rate the fair class times slices with
+void sched_cpu_tick(uint32_t ticks) {
+    int me = sched_this_cpu();
+    sched_cpu_t* cpu = &sched.cpus[me];
+    uint64_t now = cycles_now();
+    if (me == 0 && ticks == 1 && cpu->tick_stamp && now - cpu->tick_stamp < 0xFFFFFFFF) {
+        uint32_t cycles = (uint32_t) (now - cpu->tick_stamp);
+        // averaged, one late interrupt should not move it much
+        sched_cycles_per_tick = sched_cycles_per_tick ? sched_cycles_per_tick - sched_cycles_per_tick / 4 + cycles / 4 : cycles;
+    }
+    cpu->tick_stamp = now;
+    sched_finish_switch(cpu);
+
+    // class bookkeeping that runs whatever is on the cpu, the rt budget refills here
+    bool resched = false;
+    bool ints = spinlock(&cpu->rq.lock);
+    for (const sched_class_t* cls = SCHED_CLASS_HIGHEST; cls; cls = cls->next) {
+        if (cls->rq_tick && cls->rq_tick(&cpu->rq, ticks))
+            resched = true;
+    }
+    spinlock_unlock(&cpu->rq.lock, ints);
+    if (resched)
+        cpu->need_resched = true;
+
+    thread_t* curr = cpu->current;
+    if (!curr)
+        return;
+    if (curr == cpu->idle) {
+        if (__atomic_load_n(&cpu->rq.count, __ATOMIC_RELAXED))
+            cpu->need_resched = true;
+        return;
+    }
+    if (!curr->sched_class->tick)
+        return;
+
+    ints = spinlock(&cpu->rq.lock);
+    if (curr->sched_class->tick(&cpu->rq, curr))
+        cpu->need_resched = true;
+    spinlock_unlock(&cpu->rq.lock, ints);
+}
+
+// called where a thread can safely be switched out, the end of every syscall
+// and every irq that interrupted user mode
+void sched_preempt_point(void) {
+    sched_cpu_t* cpu = sched_this();
+    if (!cpu->need_resched || !cpu->current)
+        return;
+    cpu->current->preempted = true;
+    sched_yield();
 }
 
 static thread_t* sched_select_next(void) {
-    sched_boost_starved_threads(sched.ready_queue);
+    int me = sched_this_cpu();
+    run_queue_t* rq = &sched.cpus[me].rq;
+    sched.cpus[me].need_resched = false;
+
+    bool ints = spinlock(&rq->lock);
+    thread_t* next = rq_pick(rq);
+    spinlock_unlock(&rq->lock, ints);
 
-    spinlock(&sched.ready_queue->lock);
-    thread_t* next = sched_select_by_time_slice(sched.ready_queue);
-    spinlock_unlock(&sched.ready_queue->lock, true);
+    if (!next && sched_steal(me)) {
+        ints = spinlock(&rq->lock);
+        next = rq_pick(rq);
+        spinlock_unlock(&rq->lock, ints);
+    }
 
+    if (next)
+        sched_assign_time_slice(next);
     return next;
 }
 
@@ -658,25 +1063,38 @@ static thread_t* sched_select_idle_if_needed(thread_t* candidate) {
     if (candidate)
         return candidate;
 
-    thread_t* idle = sched.idle_thread;
-    idle->time_slice = idle->priority.base ? idle->priority.base : 1;
+    thread_t* idle = sched_this()->idle;
+    if (idle)
+        idle->time_slice = idle->priority.base ? idle->priority.base : 1;
     return idle;
 }
 
 static inline bool sched_should_skip(thread_t* next) {
-    return next == current_thread;
+    return !next || next == sched_this()->current;
 }
 
-static inline void sched_prepare_thread(thread_t* next) {
-    next->time_since_last_run = 0;
+// kernel threads have no address space of their own, they keep running on
+// whatever directory is loaded (lazy tlb), the kernel's low identity map and
+// the kernel half are shared by all of them
+static void sched_switch_address_space(thread_t* next) {
+    if (!next->process || !next->process->region)
+        return;
+    vmm_switch(next->process->region);
 }
 
 static void sched_determine_and_switch(thread_t* next) {
-    thread_t* prev = current_thread;
-    current_thread = next;
+    sched_cpu_t* cpu = sched_this();
+    thread_t* prev = cpu->current;
+    sched_finish_switch(cpu);
+    cpu->current = next;
+    cpu->prev = prev;
+    next->on_cpu = true;
     current_process = next->process;
 
+    sched_switch_address_space(next);
     context_switch(&prev->context, &next->context);
+    // back on prev's stack, possibly on another cpu
+    sched_finish_switch(sched_this());
 }
 
 void sched_schedule(void) {
@@ -686,12 +1104,11 @@ void sched_schedule(void) {
     if (sched_should_skip(next))
         return;
 
-    sched_prepare_thread(next);
     sched_determine_and_switch(next);
 }
 
 thread_t* sched_current_thread(void) {
-    return current_thread;
+    return sched_this()->current;
 }
 
 void sched_thread_exit(void) {
@@ -701,81 +1118,60 @@ void sched_thread_exit(void) {
 }
 
 void sched_yield(void) {
-    if (!current_thread) {
+    sched_cpu_t* cpu = sched_this();
+    thread_t* current = cpu->current;
+    if (!current) {
         return;
     }
-    if (current_thread != sched.idle_thread) {
-        sched_enqueue(sched.ready_queue, current_thread);
+    // charge what it ran before it is queued again, the fair class orders by it
+    if (current != cpu->idle && current->sched_class->put_prev) {
+        bool ints = spinlock(&cpu->rq.lock);
+        current->sched_class->put_prev(&cpu->rq, current);
+        spinlock_unlock(&cpu->rq.lock, ints);
+    }
+    // sleeping and exiting threads are queued elsewhere, they must not come back from here
+    if (current != cpu->idle && current->thread_state != THREAD_SLEEPING && current->thread_state != THREAD_DEAD) {
+        sched_make_ready(current);
     }
+    current->preempted = false;
 
     sched_schedule();
 }
 
+static void sched_sleep_expired(void* arg) {
+    thread_t* thread = (thread_t*) arg;
+    if (thread->thread_state != THREAD_SLEEPING)
+        return;
+    thread->thread_state = THREAD_READY;
+    sched_make_ready(thread);
+}
+
+// the thread sits in the timer wheel until it is due, nothing looks at it before then
 void sched_thread_sleep(uint32_t ms) {
     thread_t* current = sched_current_thread();
     if (!current || ms == 0)
         return;
 
-    current->wake_time = sched_ticks_counter + (uint64_t) ms;
+    // sleeping before the timer is armed, it may fire before we get to yield
     current->thread_state = THREAD_SLEEPING;
-
-    sched_enqueue(sched.sleep_queue, current);
+    timer_add(&current->sleep_timer, ms, ms >> SCHED_SLEEP_SLACK_SHIFT);
     sched_yield();
 }
 
-static inline bool sched_thread_should_wake(thread_t* t) {
-    return t->wake_time <= sched_ticks_counter;
-}
-
-static void sched_remove_from_sleep_queue(thread_list_t* sleep_queue, thread_t* thread, thread_t* prev) {
-    if (prev) {
-        prev->next = thread->next;
-    } else {
-        sleep_queue->head = thread->next;
-    }
-
-    if (sleep_queue->tail == thread) {
-        sleep_queue->tail = prev;
-    }
-
-    if (sleep_queue->count > 0) {
-        sleep_queue->count--;
-    }
-
-    thread->next = NULL;
-}
-
-static void sched_wake_thread(thread_t* t) {
-    t->thread_state = THREAD_READY;
-    sched_enqueue(sched.ready_queue, t);
+// cut a sleep short, whoever cancels the sleep timer first wakes the thread, the timer or us
+void sched_thread_wake(thread_t* thread) {
+    if (thread && thread->thread_state == THREAD_SLEEPING && timer_cancel(&thread->sleep_timer))
+        sched_sleep_expired(thread);
 }
 
-static thread_t* sched_process_sleep_thread(thread_list_t* sleep_queue, thread_t* t, thread_t* prev) {
-    thread_t* next = t->next;
-
-    if (sched_thread_should_wake(t)) {
-        sched_remove_from_sleep_queue(sleep_queue, t, prev);
-        sched_wake_thread(t);
-        return prev; // prev stays the same since we removed t
-    } else {
-        return t; // prev moves forward
-    }
+void sched_cancel_sleep(thread_t* thread) {
+    if (thread)
+        timer_cancel(&thread->sleep_timer);
 }
 
-void sched_tick(void) {
-    sched_ticks_counter++;
-
-    spinlock(&sched.sleep_queue->lock);
-
-    thread_t* prev = NULL;
-    thread_t* curr = sched.sleep_queue->head;
-
-    while (curr) {
-        prev = sched_process_sleep_thread(sched.sleep_queue, curr, prev);
-        curr = (prev) ? prev->next : sched.sleep_queue->head;
-    }
-
-    spinlock_unlock(&sched.sleep_queue->lock, true);
+void sched_tick(uint32_t ticks) {
+    sched_ticks_counter += ticks;
+    timer_tick(ticks);
 }
 
 typedef struct worker_thread {
@@ -880,7 +1276,7 @@ int sched_create_worker_pool(worker_pool_descriptor_t* desc, size_t count) {
             break;
         }
 
-        sched_enqueue(sched.ready_queue, worker->thread);
+        sched_make_ready(worker->thread);
         pool[created++] = worker;
     }
 
@@ -931,7 +1327,7 @@ int sched_expand_worker_pool(worker_pool_descriptor_t* desc, size_t target_count
         if (!worker) {
             break;
         }
-        sched_enqueue(sched.ready_queue, worker->thread);
+        sched_make_ready(worker->thread);
         new_pool[i] = worker;
         created++;
     }
@@ -973,7 +1369,7 @@ int sched_start_worker_pool_manager(worker_pool_descriptor_t* desc) {
         return -1;
     }
 
-    sched_enqueue(sched.ready_queue, mgr->thread);
+    sched_make_ready(mgr->thread);
     return 0;
 }
 
@@ -1226,7 +1622,7 @@ static int sched_replace_worker(worker_pool_descriptor_t* desc, size_t index, wo
 
     desc->pool[index] = new_worker;
     sched_thread_list_add(new_worker->thread, sched.kernel_threads);
-    sched_enqueue(sched.ready_queue, new_worker->thread);
+    sched_make_ready(new_worker->thread);
     return 0;
 }
 
@@ -1235,7 +1631,7 @@ static int sched_suspend_worker(worker_thread* worker) {
         return -1;
 
     worker->thread->thread_state = THREAD_SUSPENDED;
-    sched_remove(sched.ready_queue, worker->thread);
+    sched_unready(worker->thread);
     return 0;
 }
 
@@ -1244,7 +1640,7 @@ static int sched_resume_worker(worker_thread* worker) {
         return -1;
 
     worker->thread->thread_state = THREAD_READY;
-    sched_enqueue(sched.ready_queue, worker->thread);
+    sched_make_ready(worker->thread);
     return 0;
 }
 
@@ -1314,7 +1710,7 @@ static int sched_dispatch_task_to_worker(worker_pool_descriptor_t* pool, void (*
             worker->arg = arg;
 
             t->thread_state = THREAD_READY;
-            sched_enqueue(sched.ready_queue, t);
+            sched_make_ready(t);
             return 0;
         }
     }
@@ -10,6 +10,8 @@
 #include "../mem/vmm.h"
 #include "../fs/vfs/vfs.h"
 #include "process.h"
+#include "timer.h"
+#include "../lib/rbtree.h"
 typedef struct process process_t;
 
 // state of the cpu upon a context switch
@@ -45,9 +47,31 @@ typedef struct signal {
     atomic_int state;
 } signal_t;
 
-#define STARVATION_THRESHOLD 1000
+#define STARVATION_THRESHOLD 1000 // picks a ready thread may wait before it is boosted
 #define BOOST_AMOUNT 5
 #define MAX_PRIORITY 255
+#define SCHED_PRIO_LEVELS (MAX_PRIORITY + 1)
+#define SCHED_PRIO_WORDS (SCHED_PRIO_LEVELS / 32)
+#define SCHED_CACHE_HOT_PICKS 4 // a thread picked this recently on its cpu is left there by stealing
+#define SCHED_STEAL_SCAN 16     // ready threads looked at per steal, the oldest first
+#define SCHED_BALANCE_MS 100
+#define SCHED_SLEEP_SLACK_SHIFT 3 // a sleep may run an eighth over so wakeups share ticks
+#define SCHED_FAIR_LATENCY_MS 20            // every ready fair thread gets the cpu once within this
+#define SCHED_FAIR_MIN_GRANULARITY_MS 4     // shortest slice, with many threads the period stretches past the latency
+#define SCHED_FAIR_WAKEUP_GRANULARITY_MS 2  // a woken thread this far behind the running one preempts it
+#define SCHED_FAIR_NICE0_PRIO 20            // priority that weighs the same as nice 0
+#define SCHED_FAIR_WEIGHT_SHIFT 10          // nice 0 weighs 1 << this
+#define SCHED_RT_PRIO_MIN 1
+#define SCHED_RT_PRIO_MAX 99
+#define SCHED_RR_QUANTUM_MS 100  // default round robin quantum
+#define SCHED_RT_PERIOD_MS 1000  // rt threads get at most SCHED_RT_RUNTIME_MS of a cpu per period
+#define SCHED_RT_RUNTIME_MS 950  // while anything else is ready there
+
+// policies, each maps onto a class
+#define SCHED_OTHER 0 // fair
+#define SCHED_FIFO 1  // rt, runs until it blocks, yields or something higher wakes
+#define SCHED_RR 2    // rt, as fifo but takes turns with its level every quantum
+#define SCHED_PRIO 3  // strict effective priority with aging
 
 typedef struct thread_list {
     thread_t* head;
@@ -104,17 +128,116 @@ typedef struct thread {
     uint32_t time_since_last_run;
     uint32_t time_slice;
 
-    uint64_t wake_time;
+    timer_t sleep_timer; // pending while the thread is in sched_thread_sleep
+
+    // run queue links, next/previous belong to the other thread lists
+    thread_t* rq_next;
+    thread_t* rq_prev;
+    thread_t* age_next;
+    thread_t* age_prev;
+    uint32_t rq_level;    // priority fifo the thread sits in
+    uint32_t ready_since; // run queue clock when it became ready
+    bool on_rq;
+    bool on_cpu;          // running, or queued again but its switch out has not finished
+    int cpu;              // queue it sits in, or the cpu it last ran on
+    uint32_t last_ran;    // that cpu's run queue clock when it was last picked
+
+    // how the thread is queued and picked
+    const struct sched_class* sched_class;
+
+    // fair class
+    rb_node_t fair_node;
+    uint64_t vruntime;    // cycles run, scaled by nice 0 weight / its weight
+    uint64_t sum_exec;    // cycles run
+    uint64_t exec_start;  // tsc when its runtime was last charged
+    uint64_t slice_start; // sum_exec when it was last picked
+    uint32_t fair_weight;
+
+    // rt class
+    int policy;
+    unsigned rt_priority; // SCHED_RT_PRIO_MIN..MAX, higher runs first
+    uint32_t rr_quantum;  // ticks per round robin turn
+    uint32_t rr_left;     // ticks left of the current turn, 0 once it ran out
+    bool preempted;       // switched out at a preemption point rather than giving up the cpu
 } thread_t;
 
+// one fifo per level and a bitmap of the non-empty ones
+// picking the highest level is two bsr's and an unlink however many threads are queued
+typedef struct prio_array {
+    thread_t* head[SCHED_PRIO_LEVELS];
+    thread_t* tail[SCHED_PRIO_LEVELS];
+    uint32_t bitmap[SCHED_PRIO_WORDS];
+    uint32_t summary; // bit w is set while bitmap[w] is nonzero
+} prio_array_t;
+
+// rt class, the bandwidth is counted in ticks of a cpu spent on rt threads
+typedef struct rt_rq {
+    prio_array_t queue;
+    uint32_t count;
+    uint32_t runtime;     // ticks used this period
+    uint32_t period_left; // ticks until the budget refills
+    bool throttled;       // budget spent, rt threads wait while anything else is ready
+} rt_rq_t;
+
+// fair class, ready threads sorted by vruntime, the leftmost has had the least cpu for its weight
+typedef struct fair_rq {
+    rb_root_t tree;
+    rb_node_t* leftmost;
+    uint64_t min_vruntime; // only moves forward, woken and new threads are placed relative to it
+    uint32_t load;         // summed weight of the queued threads
+    uint32_t count;
+} fair_rq_t;
+
+// ready threads of every class, the age list keeps them in the order they became ready
+typedef struct run_queue {
+    prio_array_t prio; // prio class, a fifo per effective priority
+    thread_t* oldest;
+    thread_t* newest;
+    uint32_t count;
+    uint32_t clock; // picks so far, waiting is measured in picks
+    fair_rq_t fair;
+    rt_rq_t rt;
+    spinlock_t lock;
+} run_queue_t;
+
+// a scheduling class owns how its threads are ordered in the run queue
+// classes are tried from SCHED_CLASS_HIGHEST down the next links, a lower class only
+// runs when every higher one has nothing ready. all ops run with the queue's lock held
+typedef struct sched_class {
+    const char* name;
+    const struct sched_class* next;
+    void (*enqueue)(run_queue_t* rq, thread_t* t);
+    void (*dequeue)(run_queue_t* rq, thread_t* t);
+    thread_t* (*pick)(run_queue_t* rq);                    // the one to run next, still queued
+    void (*set_next)(run_queue_t* rq, thread_t* t);        // optional, t was picked
+    void (*put_prev)(run_queue_t* rq, thread_t* t);        // optional, t is giving up the cpu
+    bool (*tick)(run_queue_t* rq, thread_t* curr);         // optional, true once curr should yield
+    bool (*check_preempt)(run_queue_t* rq, thread_t* curr, thread_t* t); // optional, t woke up
+    void (*migrate)(run_queue_t* src, run_queue_t* dst, thread_t* t);    // optional, t moves queues
+    bool (*rq_tick)(run_queue_t* rq, uint32_t ticks);                   // optional, every tick whatever runs
+} sched_class_t;
+
+extern const sched_class_t sched_rt_class;   // fifo and round robin, above everything else
+extern const sched_class_t sched_prio_class; // strict effective priority with aging
+extern const sched_class_t sched_fair_class; // weighted fair share by virtual runtime
+#define SCHED_CLASS_HIGHEST (&sched_rt_class)
+#define SCHED_CLASS_DEFAULT (&sched_fair_class)
+
+// a cpu's own run queue and threads, other cpus only touch the queue to wake or steal
+typedef struct sched_cpu {
+    run_queue_t rq;
+    thread_t* current;
+    thread_t* idle;
+    bool need_resched;   // current should yield at the next preemption point
+    uint64_t tick_stamp; // tsc at the last tick
+    thread_t* prev;      // switched out last, on_cpu is cleared once we run on the next stack
+} sched_cpu_t;
+
 typedef struct scheduler {
-    thread_list_t* ready_queue;
-    thread_list_t* sleep_queue;
+    sched_cpu_t cpus[CONFIG_MAX_CPUS];
     thread_list_t* kernel_threads;
     thread_list_t* user_threads;
-    spinlock_t ready_queue_lock;
     uint32_t next_tid;
-    thread_t* idle_thread;
     thread_t* reaper_thread;
     thread_t* stealer_thread;
 } scheduler_t;
@@ -130,8 +253,26 @@ void sched_init(void);
 void sched_enqueue(thread_list_t* list, thread_t* thread);
 thread_t* sched_dequeue(thread_list_t* list);
 thread_t* sched_remove(thread_list_t* list, thread_t* target);
+void sched_make_ready(thread_t* thread);
+bool sched_unready(thread_t* thread);
+int sched_init_cpu(int cpu);
+void sched_run_idle(void);
+thread_t* sched_current_thread(void);
 void sched_schedule(void);
 void sched_yield(void);
+void sched_thread_sleep(uint32_t ms);
+void sched_cancel_sleep(thread_t* thread);
+void sched_thread_wake(thread_t* thread);
+int sched_setscheduler(thread_t* thread, int policy, unsigned priority, uint32_t quantum_ms);
+int sched_getscheduler(thread_t* thread);
+void prio_array_add(prio_array_t* array, thread_t* t, uint32_t level, bool front);
+void prio_array_del(prio_array_t* array, thread_t* t);
+thread_t* prio_array_first(prio_array_t* array);
+void sched_cpu_tick(uint32_t ticks);
+void sched_preempt_point(void);
+
+// tsc cycles per tick, measured by the boot cpu, 0 until the first ticks went by
+extern uint32_t sched_cycles_per_tick;
 
-extern void sched_tick(void);
+extern void sched_tick(uint32_t ticks);
 #endif // SCHED_H
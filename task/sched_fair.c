@@ -0,0 +1,210 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sched.h"
+#include "timer.h"
+#include "../lib/rbtree.h"
+#include "../lib/cycles.h"
+
+// weight per nice level, -20 first, each step is about 10% of cpu against a nice 0 thread
+static const uint32_t fair_nice_to_weight[40] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,   335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+// 2^32 / weight, so charging runtime is a multiply instead of a 64 bit divide
+static const uint32_t fair_nice_to_wmult[40] = {
+    48388,     59856,     76040,     92818,     118348,    147320,    184698,    229616,
+    287308,    360437,    449829,    563644,    704093,    875809,    1099582,   1376151,
+    1717300,   2157191,   2708050,   3363326,   4194304,   5237765,   6557202,   8165337,
+    10153587,  12820798,  15790321,  19976592,  24970740,  31350126,  39045157,  49367440,
+    61356676,  76695844,  95443717,  119304647, 148102320, 186737708, 238609294, 286331153,
+};
+
+#define FAIR_NICE0_INDEX 20
+
+// higher priority is a lower nice, SCHED_FAIR_NICE0_PRIO is nice 0
+static inline uint32_t fair_index(thread_t* t) {
+    int prio = t->priority.base > MAX_PRIORITY ? MAX_PRIORITY : (int) t->priority.base;
+    int nice = SCHED_FAIR_NICE0_PRIO - prio;
+    if (nice < -20)
+        nice = -20;
+    if (nice > 19)
+        nice = 19;
+    return (uint32_t) (nice + 20);
+}
+
+// n / d where the quotient is known to fit in 32 bits, no libgcc here
+static inline uint32_t fair_div(uint64_t n, uint32_t d) {
+    uint32_t q, r;
+    __asm__("divl %4" : "=a"(q), "=d"(r) : "a"((uint32_t) n), "d"((uint32_t) (n >> 32)), "rm"(d));
+    return q;
+}
+
+// 0 until the boot cpu has measured the tsc, slices are not enforced before that
+static inline uint32_t fair_ms_to_cycles(uint32_t ms) {
+    return sched_cycles_per_tick / TIMER_MS_PER_TICK * ms;
+}
+
+static inline thread_t* fair_entry(rb_node_t* node) {
+    return node ? rb_entry(node, thread_t, fair_node) : NULL;
+}
+
+// min_vruntime follows the slowest of the running thread and the leftmost queued one
+static void fair_update_min(run_queue_t* rq, thread_t* curr) {
+    uint64_t vruntime = curr->vruntime;
+    thread_t* first = fair_entry(rq->fair.leftmost);
+    if (first && first->vruntime < vruntime)
+        vruntime = first->vruntime;
+    if (vruntime > rq->fair.min_vruntime)
+        rq->fair.min_vruntime = vruntime;
+}
+
+// charge what t ran since exec_start, scaled down by its weight so heavier threads age slower
+static void fair_update_curr(run_queue_t* rq, thread_t* t) {
+    uint64_t now = cycles_now();
+    uint64_t delta = now - t->exec_start;
+    bool stamped = t->exec_start != 0;
+    t->exec_start = now;
+    // running since before the scheduler picked anything, nothing to charge yet
+    if (!stamped)
+        return;
+    // another cpu's tsc after a steal can read behind, a long stall is capped
+    if ((int64_t) delta <= 0)
+        return;
+    if (delta > 0xFFFFFFFF)
+        delta = 0xFFFFFFFF;
+
+    uint32_t index = fair_index(t);
+    t->sum_exec += delta;
+    if (index == FAIR_NICE0_INDEX)
+        t->vruntime += delta;
+    else
+        t->vruntime += (delta * fair_nice_to_wmult[index]) >> (32 - SCHED_FAIR_WEIGHT_SHIFT);
+    fair_update_min(rq, t);
+}
+
+// t's share of the period, the period is the target latency unless there are too many
+// threads to give each the minimum granularity in it
+static uint32_t fair_slice(run_queue_t* rq, thread_t* t) {
+    uint32_t latency = fair_ms_to_cycles(SCHED_FAIR_LATENCY_MS);
+    uint32_t min_gran = fair_ms_to_cycles(SCHED_FAIR_MIN_GRANULARITY_MS);
+    if (!min_gran)
+        return UINT32_MAX;
+
+    uint32_t nr = rq->fair.count + 1;
+    uint32_t period = latency;
+    if (nr > latency / min_gran)
+        period = nr > UINT32_MAX / min_gran ? UINT32_MAX : nr * min_gran;
+    return fair_div((uint64_t) period * t->fair_weight, rq->fair.load + t->fair_weight);
+}
+
+static void fair_enqueue(run_queue_t* rq, thread_t* t) {
+    t->fair_weight = fair_nice_to_weight[fair_index(t)];
+
+    // new and long sleeping threads start just behind the queue, half a latency of credit at most
+    uint64_t credit = fair_ms_to_cycles(SCHED_FAIR_LATENCY_MS) / 2;
+    uint64_t floor = rq->fair.min_vruntime > credit ? rq->fair.min_vruntime - credit : 0;
+    if (t->vruntime < floor)
+        t->vruntime = floor;
+
+    rb_node_t** link = &rq->fair.tree.node;
+    rb_node_t* parent = NULL;
+    bool leftmost = true;
+    while (*link) {
+        parent = *link;
+        // equal keys go right, they run in the order they came
+        if (t->vruntime < fair_entry(parent)->vruntime) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    rb_link_node(&t->fair_node, parent, link);
+    rb_insert_color(&rq->fair.tree, &t->fair_node);
+    if (leftmost)
+        rq->fair.leftmost = &t->fair_node;
+
+    rq->fair.load += t->fair_weight;
+    rq->fair.count++;
+}
+
+static void fair_dequeue(run_queue_t* rq, thread_t* t) {
+    if (rq->fair.leftmost == &t->fair_node)
+        rq->fair.leftmost = rb_next(&t->fair_node);
+    rb_erase(&rq->fair.tree, &t->fair_node);
+    rq->fair.load -= t->fair_weight;
+    rq->fair.count--;
+}
+
+static thread_t* fair_pick(run_queue_t* rq) {
+    return fair_entry(rq->fair.leftmost);
+}
+
+static void fair_set_next(run_queue_t* rq, thread_t* t) {
+    (void) rq;
+    t->exec_start = cycles_now();
+    t->slice_start = t->sum_exec;
+}
+
+static void fair_put_prev(run_queue_t* rq, thread_t* t) {
+    fair_update_curr(rq, t);
+}
+
+// curr is out of the tree while it runs, its slice is taken against everyone queued
+static bool fair_tick(run_queue_t* rq, thread_t* curr) {
+    fair_update_curr(rq, curr);
+    if (!rq->fair.count)
+        return false;
+    return curr->sum_exec - curr->slice_start >= fair_slice(rq, curr);
+}
+
+static bool fair_check_preempt(run_queue_t* rq, thread_t* curr, thread_t* t) {
+    (void) rq;
+    return curr->vruntime > t->vruntime + fair_ms_to_cycles(SCHED_FAIR_WAKEUP_GRANULARITY_MS);
+}
+
+// vruntime only means something against its own queue's min_vruntime, so the lag is carried over
+// a thread that slept below the source minimum keeps no more credit than a wakeup gets
+static void fair_migrate(run_queue_t* src, run_queue_t* dst, thread_t* t) {
+    int64_t lag = (int64_t) (t->vruntime - src->fair.min_vruntime);
+    int64_t credit = (int64_t) (fair_ms_to_cycles(SCHED_FAIR_LATENCY_MS) / 2);
+    if (lag < -credit)
+        lag = -credit;
+
+    uint64_t base = dst->fair.min_vruntime;
+    if (lag < 0 && base < (uint64_t) -lag)
+        t->vruntime = 0;
+    else
+        t->vruntime = base + (uint64_t) lag;
+}
+
+const sched_class_t sched_fair_class = {
+    .name = "fair",
+    .next = NULL,
+    .enqueue = fair_enqueue,
+    .dequeue = fair_dequeue,
+    .pick = fair_pick,
+    .set_next = fair_set_next,
+    .put_prev = fair_put_prev,
+    .tick = fair_tick,
+    .check_preempt = fair_check_preempt,
+    .migrate = fair_migrate,
+};
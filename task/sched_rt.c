@@ -0,0 +1,107 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "sched.h"
+#include "timer.h"
+
+// SCHED_FIFO and SCHED_RR share one class, a fifo per rt priority on top of every other class
+// rt threads only ever yield to higher rt threads, except when the cpu's rt budget is spent
+
+static inline uint32_t rt_period_ticks(void) {
+    return timer_ms_to_ticks(SCHED_RT_PERIOD_MS);
+}
+
+static inline uint32_t rt_runtime_ticks(void) {
+    return timer_ms_to_ticks(SCHED_RT_RUNTIME_MS);
+}
+
+// a thread that was only preempted goes back to the front of its level so it keeps its place,
+// a round robin thread whose turn ran out or anything that gave up the cpu goes to the back
+static void rt_enqueue(run_queue_t* rq, thread_t* t) {
+    bool front = t->preempted && (t->policy == SCHED_FIFO || t->rr_left);
+    prio_array_add(&rq->rt.queue, t, t->rt_priority, front);
+    rq->rt.count++;
+}
+
+static void rt_dequeue(run_queue_t* rq, thread_t* t) {
+    prio_array_del(&rq->rt.queue, t);
+    rq->rt.count--;
+}
+
+// a throttled queue steps aside while anything else is ready, with nothing else the cpu would idle anyway
+static thread_t* rt_pick(run_queue_t* rq) {
+    if (!rq->rt.count)
+        return NULL;
+    if (rq->rt.throttled && rq->count > rq->rt.count)
+        return NULL;
+    return prio_array_first(&rq->rt.queue);
+}
+
+static void rt_set_next(run_queue_t* rq, thread_t* t) {
+    (void) rq;
+    if (t->policy == SCHED_RR && !t->rr_left)
+        t->rr_left = t->rr_quantum;
+}
+
+static bool rt_tick(run_queue_t* rq, thread_t* curr) {
+    // asked again every tick, something else may only have become ready after the budget ran out
+    if (++rq->rt.runtime >= rt_runtime_ticks())
+        rq->rt.throttled = true;
+    if (rq->rt.throttled && rq->count > rq->rt.count)
+        return true;
+
+    if (curr->policy != SCHED_RR || !curr->rr_left || --curr->rr_left)
+        return false;
+    // turn is over, only worth a switch if someone at its level or above is waiting
+    thread_t* next = prio_array_first(&rq->rt.queue);
+    if (next && next->rq_level >= curr->rt_priority)
+        return true;
+    curr->rr_left = curr->rr_quantum;
+    return false;
+}
+
+static bool rt_check_preempt(run_queue_t* rq, thread_t* curr, thread_t* t) {
+    (void) rq;
+    return t->rt_priority > curr->rt_priority;
+}
+
+// refill the budget once a period, unthrottled rt threads that waited get the cpu back
+static bool rt_rq_tick(run_queue_t* rq, uint32_t ticks) {
+    if (rq->rt.period_left > ticks) {
+        rq->rt.period_left -= ticks;
+        return false;
+    }
+    rq->rt.period_left = rt_period_ticks();
+    rq->rt.runtime = 0;
+    if (!rq->rt.throttled)
+        return false;
+    rq->rt.throttled = false;
+    return rq->rt.count != 0;
+}
+
+const sched_class_t sched_rt_class = {
+    .name = "rt",
+    .next = &sched_prio_class,
+    .enqueue = rt_enqueue,
+    .dequeue = rt_dequeue,
+    .pick = rt_pick,
+    .set_next = rt_set_next,
+    .tick = rt_tick,
+    .check_preempt = rt_check_preempt,
+    .rq_tick = rt_rq_tick,
+};
@@ -0,0 +1,43 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mutex.h"
+#include "../sched.h"
+
+void mutex_init(mutex_t* mutex) {
+    __atomic_store_n(&mutex->state, MUTEX_STATE_UNLOCKED, __ATOMIC_RELAXED);
+}
+
+bool mutex_trylock(mutex_t* mutex) {
+    mutex_state_t expected = MUTEX_STATE_UNLOCKED;
+    return __atomic_compare_exchange_n(
+        &mutex->state, &expected, MUTEX_STATE_LOCKED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+// spin a little first, most holders are out again quickly
+// after that the waiter yields, the holder may need this cpu to finish
+void mutex_lock(mutex_t* mutex) {
+    for (uint32_t spins = 0; !mutex_trylock(mutex); spins++) {
+        if (spins < SPIN_COUNT)
+            IA32_CPU_RELAX();
+        else
+            sched_yield();
+    }
+}
+
+void mutex_unlock(mutex_t* mutex) {
+    __atomic_store_n(&mutex->state, MUTEX_STATE_UNLOCKED, __ATOMIC_RELEASE);
+}
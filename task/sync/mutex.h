@@ -1,6 +1,9 @@
+#ifndef MUTEX_H
+#define MUTEX_H
 
 #include "spinlock.h"
 #include <stdint.h>
+#include <stdbool.h>
 
 #define SPIN_COUNT 1000 // Number of spins before blocking
 
@@ -14,4 +17,15 @@ typedef struct {
     volatile mutex_state_t state; // Mutex state
     //spinlock_t lock;              // Spinlock for protecting the wait queue
     //task_queue_t wait_queue;         // Queue of tasks waiting for the mutex
-} mutex_t;
\ No newline at end of file
+} mutex_t;
+
+#define MUTEX_INIT {.state = MUTEX_STATE_UNLOCKED}
+
+// sleeping lock for long critical sections (file i/o), interrupts stay on while it is held
+// never from interrupt context, a waiter gives its cpu away until the holder lets go
+void mutex_init(mutex_t* mutex);
+bool mutex_trylock(mutex_t* mutex);
+void mutex_lock(mutex_t* mutex);
+void mutex_unlock(mutex_t* mutex);
+
+#endif // MUTEX_H
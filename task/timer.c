@@ -0,0 +1,208 @@
+/*
+
+Copyright 2024, 2025 Amar Djulovic <aaamargml@gmail.com>
+
+This file is part of FloppaOS.
+
+FloppaOS is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+
+FloppaOS is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with FloppaOS. If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "timer.h"
+#include "sync/spinlock.h"
+
+// level n slots are 64^n ticks wide, a timer sits in the lowest level whose span covers it
+static timer_t* timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+static uint64_t timer_ticks; // ticks since boot
+static uint64_t timer_clock; // next tick the wheel runs, only behind timer_ticks inside timer_tick
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+static inline uint32_t timer_fls64(uint64_t x) {
+    uint32_t hi = (uint32_t) (x >> 32);
+    if (hi)
+        return 32 + (31 - __builtin_clz(hi));
+    return 31 - __builtin_clz((uint32_t) x);
+}
+
+// move expires to the coarsest tick boundary that is still within the slack
+// timers with overlapping slack windows land on the same boundary and fire together
+static uint64_t timer_apply_slack(uint64_t expires, uint32_t slack) {
+    if (!slack)
+        return expires;
+    uint64_t limit = expires + slack;
+    uint64_t mask = expires ^ limit;
+    if (!mask)
+        return expires;
+    return limit & ~(((uint64_t) 1 << timer_fls64(mask)) - 1);
+}
+
+uint32_t timer_ms_to_ticks(uint32_t ms) {
+    return ms / TIMER_MS_PER_TICK + (ms % TIMER_MS_PER_TICK != 0);
+}
+
+void timer_init(timer_t* timer, timer_fn_t fn, void* arg) {
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->next = timer->prev = NULL;
+    timer->bucket = NULL;
+}
+
+// called with timer_lock held
+static void timer_enqueue(timer_t* timer) {
+    uint64_t expires = timer->expires < timer_clock ? timer_clock : timer->expires;
+    uint64_t delta = expires - timer_clock;
+
+    uint32_t level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && (delta >> (TIMER_WHEEL_BITS * (level + 1))))
+        level++;
+    // past the top level, park it in the furthest slot and let the cascade look again
+    if (delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+        expires = timer_clock + ((uint64_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+    uint32_t slot = (uint32_t) (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    timer_t** bucket = &timer_wheel[level][slot];
+    timer->prev = NULL;
+    timer->next = *bucket;
+    if (*bucket)
+        (*bucket)->prev = timer;
+    *bucket = timer;
+    timer->bucket = bucket;
+}
+
+// called with timer_lock held
+static void timer_dequeue(timer_t* timer) {
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        *timer->bucket = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    timer->bucket = NULL;
+}
+
+void timer_add(timer_t* timer, uint32_t ms, uint32_t slack_ms) {
+    if (!timer || !timer->fn)
+        return;
+
+    uint32_t ticks = timer_ms_to_ticks(ms);
+    if (!ticks)
+        ticks = 1;
+
+    bool ints = spinlock(&timer_lock);
+    if (timer->bucket)
+        timer_dequeue(timer);
+    timer->expires = timer_apply_slack(timer_ticks + ticks, timer_ms_to_ticks(slack_ms));
+    timer_enqueue(timer);
+    spinlock_unlock(&timer_lock, ints);
+}
+
+bool timer_cancel(timer_t* timer) {
+    if (!timer)
+        return false;
+
+    bool ints = spinlock(&timer_lock);
+    bool pending = timer->bucket != NULL;
+    if (pending)
+        timer_dequeue(timer);
+    spinlock_unlock(&timer_lock, ints);
+    return pending;
+}
+
+bool timer_pending(timer_t* timer) {
+    return timer && __atomic_load_n(&timer->bucket, __ATOMIC_RELAXED) != NULL;
+}
+
+uint64_t timer_now(void) {
+    bool ints = spinlock(&timer_lock);
+    uint64_t now = timer_ticks;
+    spinlock_unlock(&timer_lock, ints);
+    return now;
+}
+
+// put every timer of the current slot of a level back in, they all fall to lower levels
+// returns the slot so the caller knows whether this level wrapped as well
+static uint32_t timer_cascade(uint32_t level) {
+    uint32_t slot = (uint32_t) (timer_clock >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    timer_t* timer = timer_wheel[level][slot];
+    timer_wheel[level][slot] = NULL;
+
+    while (timer) {
+        timer_t* next = timer->next;
+        timer_enqueue(timer);
+        timer = next;
+    }
+    return slot;
+}
+
+// the first non-empty slot of a level, starting after the current one which was already
+// cascaded (anything in it now is a whole lap ahead), level 0 slots hold a single tick
+static uint64_t timer_level_next(uint32_t level) {
+    uint32_t shift = TIMER_WHEEL_BITS * level;
+    uint32_t index = (uint32_t) (timer_clock >> shift) & TIMER_WHEEL_MASK;
+    uint32_t start = level ? 1 : 0;
+
+    for (uint32_t i = start; i < TIMER_WHEEL_SIZE + start; i++) {
+        timer_t* timer = timer_wheel[level][(index + i) & TIMER_WHEEL_MASK];
+        if (!timer)
+            continue;
+        if (!level)
+            return timer_clock + i;
+        uint64_t next = TIMER_NONE;
+        for (; timer; timer = timer->next) {
+            if (timer->expires < next)
+                next = timer->expires;
+        }
+        return next;
+    }
+    return TIMER_NONE;
+}
+
+// called when a cpu goes idle, looks at one slot list per level at most
+uint64_t timer_next_expiry(void) {
+    bool ints = spinlock(&timer_lock);
+    uint64_t next = TIMER_NONE;
+    for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        uint64_t expires = timer_level_next(level);
+        if (expires < next)
+            next = expires;
+    }
+    spinlock_unlock(&timer_lock, ints);
+    return next;
+}
+
+void timer_tick(uint32_t ticks) {
+    bool ints = spinlock(&timer_lock);
+    timer_ticks += ticks;
+
+    while (timer_clock <= timer_ticks) {
+        uint32_t slot = (uint32_t) timer_clock & TIMER_WHEEL_MASK;
+        if (!slot) {
+            for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                if (timer_cascade(level))
+                    break;
+            }
+        }
+
+        // one at a time, a callback may re-arm itself or cancel another timer in this slot
+        timer_t** bucket = &timer_wheel[0][slot];
+        while (*bucket) {
+            timer_t* timer = *bucket;
+            timer_dequeue(timer);
+            spinlock_unlock(&timer_lock, false);
+            timer->fn(timer->arg);
+            spinlock(&timer_lock);
+        }
+        timer_clock++;
+    }
+
+    spinlock_unlock(&timer_lock, ints);
+}
@@ -0,0 +1,49 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// kernel timers on a hierarchical timing wheel driven by the timekeeping cpu's tick
+// a tick only runs the timers due on it, far off timers cascade down a level every 64 ticks of the level below
+#define TIMER_HZ 100 // tick rate, clock event devices tick at it while their cpu is busy
+#define TIMER_MS_PER_TICK (1000 / TIMER_HZ)
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 4 // 2^24 ticks ahead, about 46 hours, later timers wait at the top level
+#define TIMER_NONE UINT64_MAX
+
+typedef void (*timer_fn_t)(void* arg);
+
+// embedded in whatever owns it, the wheel never allocates
+typedef struct timer {
+    uint64_t expires; // tick it fires on
+    timer_fn_t fn;    // called from the tick interrupt with the wheel unlocked
+    void* arg;
+    struct timer* next;
+    struct timer* prev;
+    struct timer** bucket; // list head it sits in, NULL while not pending
+} timer_t;
+
+void timer_init(timer_t* timer, timer_fn_t fn, void* arg);
+
+// (re)arm to fire ms from now, the wheel may push it up to slack_ms later so it fires
+// on the same tick as other timers, a nonzero slack is what lets wakeups coalesce
+void timer_add(timer_t* timer, uint32_t ms, uint32_t slack_ms);
+
+// returns true if the timer was pending, false if it already fired or was never added
+bool timer_cancel(timer_t* timer);
+bool timer_pending(timer_t* timer);
+
+uint64_t timer_now(void);
+uint32_t timer_ms_to_ticks(uint32_t ms);
+
+// tick the earliest pending timer is due on, TIMER_NONE if there is none
+uint64_t timer_next_expiry(void);
+
+// ticks since the last call, more than one after the timekeeping cpu slept through some
+void timer_tick(uint32_t ticks);
+
+#endif // TIMER_H